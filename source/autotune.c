@@ -0,0 +1,154 @@
+#include "autotune.h"
+#include "knn.h"
+#include "knn_kernels.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+
+static const int autotune_tiles[] = { 32, 64, 128, 256 };
+
+void autotune_apply(const autotune_config_t *cfg) {
+    omp_set_num_threads(cfg->threads);
+    knn_set_self_tile(cfg->tile);
+    knn_kernels_enable(cfg->kernels);
+}
+
+/* best of two runs of cfg over the sample, in seconds */
+static double autotune_time(matrix_t *sample, int k, const autotune_config_t *cfg) {
+    double best = 1e300;
+    autotune_apply(cfg);
+    for (int rep = 0; rep < 2; ++rep) {
+        double t0 = omp_get_wtime();
+        struct KNN_Pair **res = cfg->engine == AUTOTUNE_ENGINE_SCAN
+            ? knn_search_self_scan(sample, k, 0)
+            : knn_search_self(sample, k, 0);
+        double t = omp_get_wtime() - t0;
+        KNN_Pair_destroy_table(res, matrix_get_rows(sample));
+        if (!res) return 1e300;
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+/* benchmarks engines, tiles and kernels at full threads, then thread counts for the winner */
+static void autotune_search(matrix_t *sample, int k, autotune_config_t *best) {
+    int max_threads = omp_get_max_threads();
+    int dims = matrix_get_cols(sample);
+    autotune_config_t cfg = { AUTOTUNE_ENGINE_SELF, KNN_SELF_TILE, max_threads, 1, 1e300 };
+    *best = cfg;
+
+    for (size_t t = 0; t < sizeof(autotune_tiles) / sizeof(autotune_tiles[0]); ++t) {
+        cfg.engine = AUTOTUNE_ENGINE_SELF;
+        cfg.tile = autotune_tiles[t];
+        cfg.seconds = autotune_time(sample, k, &cfg);
+        if (cfg.seconds < best->seconds) *best = cfg;
+    }
+    cfg.tile = KNN_SELF_TILE;
+    for (int kernels = 0; kernels <= 1; ++kernels) {
+        knn_kernels_enable(1);
+        if (kernels && !knn_kernel_lookup(dims, k + 1)) continue;
+        cfg.engine = AUTOTUNE_ENGINE_SCAN;
+        cfg.kernels = kernels;
+        cfg.seconds = autotune_time(sample, k, &cfg);
+        if (cfg.seconds < best->seconds) *best = cfg;
+    }
+    for (int threads = max_threads / 2; threads >= 1; threads /= 2) {
+        cfg = *best;
+        cfg.threads = threads;
+        cfg.seconds = autotune_time(sample, k, &cfg);
+        if (cfg.seconds < best->seconds) *best = cfg;
+        if (threads == 1) break;
+    }
+}
+
+/* profile lines: host rows dims k max_threads -> engine tile threads kernels seconds */
+static int autotune_lookup(const char *profile, const char *host, long rows, int dims, int k,
+                           int max_threads, autotune_config_t *out) {
+    FILE *f = fopen(profile, "r");
+    if (!f) return 0;
+    char line[512], h[256];
+    long r;
+    int d, kk, mt, found = 0;
+    autotune_config_t cfg;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%255s %ld %d %d %d %d %d %d %d %lf", h, &r, &d, &kk, &mt,
+                   &cfg.engine, &cfg.tile, &cfg.threads, &cfg.kernels, &cfg.seconds) != 10)
+            continue;
+        /* the last matching line wins */
+        if (strcmp(h, host) == 0 && r == rows && d == dims && kk == k && mt == max_threads) {
+            *out = cfg;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void autotune_store(const char *profile, const char *host, long rows, int dims, int k,
+                           int max_threads, const autotune_config_t *cfg) {
+    FILE *f = fopen(profile, "a");
+    if (!f) {
+        fprintf(stderr, "ERROR: no se pudo escribir el perfil %s\n", profile);
+        return;
+    }
+    fprintf(f, "%s %ld %d %d %d %d %d %d %d %.6f\n", host, rows, dims, k, max_threads,
+            cfg->engine, cfg->tile, cfg->threads, cfg->kernels, cfg->seconds);
+    fclose(f);
+}
+
+/* autotune_run: rank 0 looks up (host, global rows, dims, k, max threads) in the profile
+ * and, on a miss, benchmarks the candidates on a sample of its rows and appends the
+ * winner. The configuration is broadcast and applied on every rank.
+ */
+int autotune_run(matrix_t *data, int k, const char *profile, autotune_config_t *out,
+                 int *cached, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (!profile) profile = AUTOTUNE_PROFILE;
+    long rows = matrix_get_rows(data), total = 0;
+    MPI_Allreduce(&rows, &total, 1, MPI_LONG, MPI_SUM, comm);
+    int dims = matrix_get_cols(data);
+    int max_threads = omp_get_max_threads();
+
+    /* engine, tile, threads, kernels, hit; then the sample time */
+    int msg[5] = { AUTOTUNE_ENGINE_SELF, KNN_SELF_TILE, max_threads, 1, 0 };
+    double seconds = 0.0;
+    if (rank == 0) {
+        char host[MPI_MAX_PROCESSOR_NAME];
+        int len = 0;
+        MPI_Get_processor_name(host, &len);
+        autotune_config_t cfg;
+        if (autotune_lookup(profile, host, total, dims, k, max_threads, &cfg)) {
+            msg[4] = 1;
+        } else {
+            int n = rows < AUTOTUNE_SAMPLE ? (int) rows : AUTOTUNE_SAMPLE;
+            matrix_t *sample = matrix_create(n, dims);
+            if (sample && n > k) {
+                /* evenly spaced rows, so the sample has no repeats */
+                for (int i = 0; i < n; ++i)
+                    memcpy(sample->data[i], data->data[(long) i * rows / n], sizeof(double) * dims);
+                autotune_search(sample, k, &cfg);
+                autotune_store(profile, host, total, dims, k, max_threads, &cfg);
+            } else {
+                cfg = (autotune_config_t) { AUTOTUNE_ENGINE_SELF, KNN_SELF_TILE, max_threads, 1, 0.0 };
+            }
+            matrix_destroy(sample);
+        }
+        msg[0] = cfg.engine;
+        msg[1] = cfg.tile;
+        msg[2] = cfg.threads;
+        msg[3] = cfg.kernels;
+        seconds = cfg.seconds;
+    }
+    MPI_Bcast(msg, 5, MPI_INT, 0, comm);
+    MPI_Bcast(&seconds, 1, MPI_DOUBLE, 0, comm);
+    out->engine = msg[0];
+    out->tile = msg[1];
+    out->threads = msg[2];
+    out->kernels = msg[3];
+    out->seconds = seconds;
+    if (cached) *cached = msg[4];
+    autotune_apply(out);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <mpi.h>
+#include "matrix.h"
+
+/* exact all-kNN engines the tuner chooses between */
+#define AUTOTUNE_ENGINE_SELF 0   /* symmetric tiled self-join (knn_search_self) */
+#define AUTOTUNE_ENGINE_SCAN 1   /* per-row scan (knn_search_self_scan) */
+
+/* rows benchmarked per candidate, and the profile file used when none is given */
+#define AUTOTUNE_SAMPLE 4096
+#define AUTOTUNE_PROFILE ".knn_autotune"
+
+typedef struct autotune_config_t {
+    int engine;
+    int tile;       /* self-join tile rows */
+    int threads;    /* OpenMP threads per rank */
+    int kernels;    /* specialised (dims, k) kernels on/off */
+    double seconds; /* best sample time */
+} autotune_config_t;
+
+int autotune_run(matrix_t *data, int k, const char *profile, autotune_config_t *out,
+                 int *cached, MPI_Comm comm);
+void autotune_apply(const autotune_config_t *cfg);
+
+#endif
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mpi.h>
+
+#include "matrix.h"
+#include "knn.h"
+#include "codec.h"
+#include "sparse.h"
+#include "range_search.h"
+#include "nn_descent.h"
+#include "rng.h"
+
+/* make check: small self-contained checks of the encoders and search kernels.
+ * Every case prints one line; the exit status is the number of failed cases. Run under
+ * mpirun, the local cases run on rank 0 and the distributed ones on every rank. */
+
+static int failures = 0;
+
+static void report(const char *name, int ok) {
+    printf("%-48s %s\n", name, ok ? "OK" : "FALLO");
+    if (!ok) failures++;
+}
+
+static double *random_values(size_t n, uint64_t seed, double scale) {
+    double *v = (double*) malloc(sizeof(double) * (n > 0 ? n : 1));
+    uint64_t rng = seed;
+    for (size_t i = 0; i < n; ++i) v[i] = floor(rng_uniform(&rng) * scale * 100.0) / 100.0;
+    return v;
+}
+
+static int codec_roundtrip(int mode, double max_err) {
+    int rows = 400, cols = 6;
+    double *vals = random_values((size_t) rows * cols, 11 + mode, 200.0);
+    double *back = (double*) malloc(sizeof(double) * rows * cols);
+    size_t len = 0;
+    char *buf = codec_encode_doubles(vals, rows, cols, mode, max_err, &len);
+    int ok = buf && codec_decode_doubles(buf, len, back, rows, cols) == 0;
+    for (int i = 0; ok && i < rows * cols; ++i)
+        ok = mode == CODEC_FLOAT16 ? fabs(back[i] - vals[i]) <= max_err : back[i] == vals[i];
+    free(buf); free(vals); free(back);
+    return ok;
+}
+
+static void check_codec(void) {
+    report("codec: doubles sin comprimir", codec_roundtrip(CODEC_RAW, 0.0));
+    report("codec: doubles sin pérdida", codec_roundtrip(CODEC_LOSSLESS, 0.0));
+    report("codec: doubles float16 dentro de max_err", codec_roundtrip(CODEC_FLOAT16, 0.1));
+
+    /* candidate lists: sorted distances, unfilled slots and negative deltas */
+    int count = 700;
+    struct KNN_Pair *pairs = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * count);
+    uint64_t rng = 5;
+    for (int i = 0; i < count; ++i) {
+        pairs[i].distance = i < count - 3 ? i * 0.25 : 1e300;
+        pairs[i].index = i < count - 3 ? (int) rng_below(&rng, 1000000) : -1;
+    }
+    size_t len = 0;
+    int32_t n = 0;
+    char *buf = knn_pairs_encode(pairs, count, &len);
+    struct KNN_Pair *back = buf ? knn_pairs_decode(buf, len, &n) : NULL;
+    int ok = back && n == count;
+    for (int i = 0; ok && i < count; ++i)
+        ok = back[i].distance == pairs[i].distance && back[i].index == pairs[i].index;
+    report("codec: listas de candidatos ida y vuelta", ok);
+    free(back);
+
+    /* a list cut inside its varints must be rejected, not decoded from garbage */
+    back = buf ? knn_pairs_decode(buf, 6, &n) : NULL;
+    report("codec: lista truncada rechazada", buf && !back);
+    free(back);
+    free(buf);
+    free(pairs);
+
+    int fields = 9;
+    double *recs = random_values((size_t) count * fields, 17, 150.0);
+    double *recs_back = (double*) malloc(sizeof(double) * count * fields);
+    for (int i = 0; i < count; ++i) {
+        recs[i * fields] = i * 0.5;
+        recs[i * fields + 1] = (double) (i * 7 % 1000);
+    }
+    recs[(count - 1) * fields + 8] = NAN;
+    buf = codec_encode_records(recs, count, fields, &len);
+    ok = buf && codec_decode_records(buf, len, recs_back, count, fields) == 0;
+    for (int i = 0; ok && i < count * fields; ++i)
+        ok = recs_back[i] == recs[i] || (isnan(recs[i]) && isnan(recs_back[i]));
+    report("codec: registros de candidatos ida y vuelta", ok);
+    free(buf); free(recs); free(recs_back);
+}
+
+/* same neighbours and (up to the norm expansion's rounding) distances */
+static int same_lists(struct KNN_Pair **a, struct KNN_Pair **b, int points, int k) {
+    if (!a || !b) return 0;
+    for (int p = 0; p < points; ++p)
+        for (int j = 0; j < k; ++j)
+            if (a[p][j].index != b[p][j].index || fabs(a[p][j].distance - b[p][j].distance) > 1e-9)
+                return 0;
+    return 1;
+}
+
+static void check_sparse(void) {
+    /* about 70% zeros, continuous values so that no two distances tie */
+    int rows = 300, cols = 20, k = 5, queries = 25;
+    matrix_t *dense = matrix_create(rows, cols);
+    matrix_t *points = matrix_create(queries, cols);
+    uint64_t rng = 23;
+    int64_t nnz = 0;
+    for (int r = 0; r < rows; ++r)
+        for (int c = 0; c < cols; ++c)
+            if (rng_uniform(&rng) < 0.3) { dense->data[r][c] = rng_uniform(&rng) * 10.0; nnz++; }
+    for (int q = 0; q < queries; ++q)
+        for (int c = 0; c < cols; ++c) points->data[q][c] = rng_uniform(&rng) * 10.0;
+
+    sparse_t *csr = sparse_create(rows, cols, nnz);
+    int64_t e = 0;
+    for (int r = 0; r < rows; ++r) {
+        csr->row_start[r] = e;
+        for (int c = 0; c < cols; ++c)
+            if (dense->data[r][c] != 0.0) { csr->col_idx[e] = c; csr->values[e++] = dense->data[r][c]; }
+    }
+    csr->row_start[rows] = e;
+    sparse_compute_norms(csr);
+
+    struct KNN_Pair **want = knn_search_self(dense, k, 100);
+    struct KNN_Pair **got = sparse_knn_search_self(csr, k, 100);
+    report("dispersa: auto-join igual que la densa", same_lists(want, got, rows, k));
+    KNN_Pair_destroy_table(want, rows);
+    KNN_Pair_destroy_table(got, rows);
+
+    want = knn_search(dense, points, k, 0);
+    got = sparse_knn_search_dense(csr, points, k, 0);
+    report("dispersa: queries densas igual que la densa", same_lists(want, got, queries, k));
+    KNN_Pair_destroy_table(want, queries);
+    KNN_Pair_destroy_table(got, queries);
+
+    sparse_destroy(csr);
+    matrix_destroy(dense);
+    matrix_destroy(points);
+}
+
+static void check_range(void) {
+    /* 4 columns so that one of them is only checked by the exact distance */
+    int rows = 2000, cols = 4, queries = 40;
+    double radius = 7.5, r2 = radius * radius;
+    matrix_t *data = matrix_create(rows, cols);
+    matrix_t *points = matrix_create(queries, cols);
+    uint64_t rng = 31;
+    for (int r = 0; r < rows; ++r)
+        for (int c = 0; c < cols; ++c) data->data[r][c] = floor(rng_uniform(&rng) * 50.0);
+    for (int q = 0; q < queries; ++q)
+        for (int c = 0; c < cols; ++c) points->data[q][c] = rng_uniform(&rng) * 50.0;
+
+    range_grid_t *g = range_grid_build(data, cols, 0.0);
+    range_result_t *res = g ? range_search(g, points, radius, 0) : NULL;
+    int ok = res && res->queries == queries;
+    struct KNN_Pair *want = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * rows);
+    for (int q = 0; ok && q < queries; ++q) {
+        int n = 0;
+        for (int r = 0; r < rows; ++r) {
+            double d2 = 0.0;
+            for (int c = 0; c < cols; ++c) {
+                double diff = points->data[q][c] - data->data[r][c];
+                d2 += diff * diff;
+            }
+            if (d2 <= r2) { want[n].distance = sqrt(d2); want[n].index = r; n++; }
+        }
+        /* brute force is in row order, so a stable pass by distance gives (distance, index) */
+        for (int i = 1; i < n; ++i) {
+            struct KNN_Pair x = want[i];
+            int j = i;
+            while (j > 0 && want[j-1].distance > x.distance) { want[j] = want[j-1]; --j; }
+            want[j] = x;
+        }
+        ok = res->start[q+1] - res->start[q] == n;
+        for (int i = 0; ok && i < n; ++i)
+            ok = res->index[res->start[q] + i] == want[i].index &&
+                 fabs(res->distance[res->start[q] + i] - want[i].distance) <= 1e-12;
+    }
+    report("rango: rejilla igual que la fuerza bruta", ok);
+
+    free(want);
+    range_result_destroy(res);
+    range_grid_destroy(g);
+    matrix_destroy(data);
+    matrix_destroy(points);
+}
+
+/* majority vote over labeled rows, counted against the true labels */
+static int correct_votes(matrix_t *labeled, const double *truth) {
+    matrix_t *pred = knn_classify(labeled);
+    int correct = 0;
+    for (int p = 0; p < matrix_get_rows(pred); ++p)
+        correct += matrix_get_cell(pred, p, 0) == truth[p];
+    matrix_destroy(pred);
+    return correct;
+}
+
+static void check_nn_descent(int rank, int tasks) {
+    /* every rank builds the same rows and keeps a contiguous chunk; rows are in random order,
+     * so with several ranks most neighbours live on another rank */
+    int rows = 1200, cols = 4, k = 7;
+    matrix_t *all = matrix_create(rows, cols);
+    double *truth = (double*) malloc(sizeof(double) * rows);
+    uint64_t rng = 41;
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) all->data[r][c] = rng_uniform(&rng) * 10.0;
+        truth[r] = all->data[r][0] + all->data[r][1] > 10.0;
+    }
+    int first = (int) ((long) rows * rank / tasks);
+    int count = (int) ((long) rows * (rank + 1) / tasks) - first;
+    matrix_t *chunk = matrix_create(count, cols);
+    matrix_t *labels = matrix_create(count, 1);
+    for (int r = 0; r < count; ++r) {
+        memcpy(chunk->data[r], all->data[first + r], sizeof(double) * cols);
+        labels->data[r][0] = truth[first + r];
+    }
+    matrix_t *all_labels = matrix_create(rows, 1);
+    for (int r = 0; r < rows; ++r) all_labels->data[r][0] = truth[r];
+
+    /* exact lists of this chunk over every row, as one process would find them */
+    struct KNN_Pair **full = knn_search_self(all, k, 0);
+    struct KNN_Pair **approx = nn_descent(chunk, k, first, 0.001, 12345, NULL, MPI_COMM_WORLD);
+    matrix_t *labeled = approx ? nn_descent_labeling(approx, count, k, labels, first, MPI_COMM_WORLD) : NULL;
+    long local[5] = { 0, 0, 0, 0, !approx || !labeled };
+    if (approx && labeled) {
+        matrix_t *exact = knn_labeling(full + first, count, k, NULL, NULL, all_labels, 0);
+        for (int p = 0; p < count; ++p)
+            for (int j = 0; j < k; ++j) {
+                int g = approx[p][j].index;
+                for (int e = 0; e < k; ++e) local[0] += full[first + p][e].index == g;
+                /* every neighbour's label is known, wherever its row lives */
+                if (g < 0 || matrix_get_cell(labeled, p, j) != truth[g]) local[4] = 1;
+            }
+        local[1] = (long) count * k;
+        local[2] = correct_votes(labeled, truth + first);
+        local[3] = correct_votes(exact, truth + first);
+        matrix_destroy(exact);
+    }
+    long sum[5];
+    MPI_Allreduce(local, sum, 5, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0) {
+        char name[64];
+        double recall = sum[1] ? (double) sum[0] / sum[1] : 0.0;
+        snprintf(name, sizeof(name), "nn-descent (%d procesos): etiquetas remotas", tasks);
+        report(name, sum[4] == 0);
+        /* same vote as the exact lists up to the neighbours the approximation missed */
+        snprintf(name, sizeof(name), "nn-descent (%d procesos): precisión exacta", tasks);
+        report(name, recall >= 0.95 && fabs((double) (sum[2] - sum[3])) <= (1.0 - recall) * rows);
+    }
+
+    KNN_Pair_destroy_table(full, rows);
+    KNN_Pair_destroy_table(approx, count);
+    matrix_destroy(labeled);
+    matrix_destroy(all);
+    matrix_destroy(all_labels);
+    matrix_destroy(chunk);
+    matrix_destroy(labels);
+    free(truth);
+}
+
+int main(int argc, char *argv[]) {
+    int rank = 0, tasks = 1;
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &tasks);
+    if (rank == 0) {
+        check_codec();
+        check_sparse();
+        check_range();
+    }
+    check_nn_descent(rank, tasks);
+    if (rank == 0) printf("%s: %d caso(s) fallido(s)\n", failures ? "FALLO" : "OK", failures);
+    MPI_Finalize();
+    return failures;
+}
@@ -0,0 +1,349 @@
+#include "codec.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+static codec_stats_t stats;
+
+codec_stats_t codec_get_stats(void) { return stats; }
+void codec_reset_stats(void) { memset(&stats, 0, sizeof(stats)); }
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* varints and zigzag for signed deltas */
+static size_t put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) { p[n++] = (unsigned char) (v | 0x80); v >>= 7; }
+    p[n++] = (unsigned char) v;
+    return n;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    uint64_t out = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char b = *p++;
+        out |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) { *v = out; return p; }
+    }
+    return NULL;
+}
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63); }
+static int64_t unzigzag(uint64_t v) { return (int64_t) (v >> 1) ^ -(int64_t) (v & 1); }
+
+/* zero-run coding: repeated [varint zeros][varint literals][literal bytes] */
+static size_t rle_bound(size_t n) { return n + n / 2 + 32; }
+
+static size_t rle_encode(const unsigned char *in, size_t n, unsigned char *out) {
+    size_t i = 0, o = 0;
+    while (i < n) {
+        size_t zeros = 0;
+        while (i + zeros < n && in[i + zeros] == 0) zeros++;
+        size_t lit = i + zeros, end = lit;
+        /* a literal run absorbs single zeros and stops before a pair of them */
+        while (end < n && !(in[end] == 0 && (end + 1 == n || in[end + 1] == 0))) end++;
+        o += put_varint(out + o, zeros);
+        o += put_varint(out + o, end - lit);
+        memcpy(out + o, in + lit, end - lit);
+        o += end - lit;
+        i = end;
+    }
+    return o;
+}
+
+static int rle_decode(const unsigned char *in, size_t n, unsigned char *out, size_t expect) {
+    const unsigned char *p = in, *end = in + n;
+    size_t o = 0;
+    while (p < end) {
+        uint64_t zeros, lit;
+        if (!(p = get_varint(p, end, &zeros)) || !(p = get_varint(p, end, &lit))) return -1;
+        if (o + zeros + lit > expect || (size_t) (end - p) < lit) return -1;
+        memset(out + o, 0, zeros);
+        o += zeros;
+        memcpy(out + o, p, lit);
+        o += lit;
+        p += lit;
+    }
+    return o == expect ? 0 : -1;
+}
+
+/* byte plane b of every width-byte word goes to out[b * n ...] */
+static void shuffle(const unsigned char *in, size_t n, int width, unsigned char *out) {
+    for (size_t i = 0; i < n; ++i)
+        for (int b = 0; b < width; ++b) out[b * n + i] = in[i * width + b];
+}
+
+static void unshuffle(const unsigned char *in, size_t n, int width, unsigned char *out) {
+    for (size_t i = 0; i < n; ++i)
+        for (int b = 0; b < width; ++b) out[i * width + b] = in[b * n + i];
+}
+
+/* IEEE half precision, round to nearest even; out-of-range values saturate to inf */
+static uint16_t to_half(double v) {
+    float f = (float) v;
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t) ((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = x & 0x7FFFFF;
+    if (((x >> 23) & 0xFF) == 0xFF) return (uint16_t) (sign | 0x7C00 | (mant ? 0x200 : 0));
+    if (exp >= 31) return (uint16_t) (sign | 0x7C00);
+    if (exp <= 0) {
+        if (exp < -10) return (uint16_t) sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1))) half++;
+        return (uint16_t) (sign | half);
+    }
+    uint32_t half = sign | ((uint32_t) exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++;
+    return (uint16_t) half;
+}
+
+static double from_half(uint16_t h) {
+    int exp = (h >> 10) & 0x1F;
+    int mant = h & 0x3FF;
+    double v;
+    if (exp == 0) v = ldexp(mant, -24);
+    else if (exp == 31) v = mant ? NAN : INFINITY;
+    else v = ldexp(mant | 0x400, exp - 25);
+    return (h & 0x8000) ? -v : v;
+}
+
+/* XOR-with-predecessor words in column-major order, shuffled and run-length coded */
+static size_t encode_words(const double *vals, int32_t rows, int32_t cols, int width, unsigned char *out) {
+    size_t n = (size_t) rows * cols;
+    unsigned char *words = (unsigned char*) malloc(n * width + 1);
+    unsigned char *planes = (unsigned char*) malloc(n * width + 1);
+    if (!words || !planes) { free(words); free(planes); return 0; }
+    uint64_t prev = 0;
+    size_t w = 0;
+    for (int32_t c = 0; c < cols; ++c) {
+        for (int32_t r = 0; r < rows; ++r, ++w) {
+            uint64_t bits;
+            if (width == 8) memcpy(&bits, &vals[(size_t) r * cols + c], 8);
+            else bits = to_half(vals[(size_t) r * cols + c]);
+            uint64_t x = bits ^ prev;
+            prev = bits;
+            memcpy(words + w * width, &x, width);
+        }
+    }
+    shuffle(words, n, width, planes);
+    size_t len = rle_encode(planes, n * width, out);
+    free(words);
+    free(planes);
+    return len;
+}
+
+static int decode_words(const unsigned char *in, size_t len, double *vals, int32_t rows, int32_t cols, int width) {
+    size_t n = (size_t) rows * cols;
+    unsigned char *words = (unsigned char*) malloc(n * width + 1);
+    unsigned char *planes = (unsigned char*) malloc(n * width + 1);
+    if (!words || !planes || rle_decode(in, len, planes, n * width) != 0) {
+        free(words); free(planes);
+        return -1;
+    }
+    unshuffle(planes, n, width, words);
+    uint64_t prev = 0;
+    size_t w = 0;
+    for (int32_t c = 0; c < cols; ++c) {
+        for (int32_t r = 0; r < rows; ++r, ++w) {
+            uint64_t x = 0;
+            memcpy(&x, words + w * width, width);
+            prev ^= x;
+            if (width == 8) memcpy(&vals[(size_t) r * cols + c], &prev, 8);
+            else vals[(size_t) r * cols + c] = from_half((uint16_t) prev);
+        }
+    }
+    free(words);
+    free(planes);
+    return 0;
+}
+
+/* codec_encode_doubles: row-major rows x cols values -> [codec byte][payload] */
+char *codec_encode_doubles(const double *vals, int32_t rows, int32_t cols, int mode,
+                           double max_err, size_t *bytec) {
+    double t0 = now();
+    size_t n = (size_t) rows * cols;
+    size_t raw = sizeof(double) * n;
+    if (raw < CODEC_MIN_BYTES) mode = CODEC_RAW;
+    if (mode == CODEC_FLOAT16) {
+        for (size_t i = 0; i < n; ++i) {
+            if (!(fabs(from_half(to_half(vals[i])) - vals[i]) <= max_err)) { mode = CODEC_LOSSLESS; break; }
+        }
+    }
+
+    char *buf = (char*) malloc(1 + (mode == CODEC_RAW ? raw : rle_bound(raw)));
+    if (!buf) return NULL;
+    buf[0] = (char) mode;
+    size_t len;
+    if (mode == CODEC_RAW) {
+        memcpy(buf + 1, vals, raw);
+        len = raw;
+    } else {
+        len = encode_words(vals, rows, cols, mode == CODEC_FLOAT16 ? 2 : 8, (unsigned char*) buf + 1);
+        /* incompressible payloads go raw */
+        if (len == 0 || len >= raw) {
+            buf[0] = CODEC_RAW;
+            memcpy(buf + 1, vals, raw);
+            len = raw;
+        }
+    }
+    *bytec = 1 + len;
+
+    stats.messages++;
+    if (buf[0] != CODEC_RAW) stats.compressed++;
+    stats.raw_bytes += raw;
+    stats.wire_bytes += *bytec;
+    stats.encode_seconds += now() - t0;
+    return buf;
+}
+
+int codec_decode_doubles(const char *bytes, size_t bytec, double *vals, int32_t rows, int32_t cols) {
+    double t0 = now();
+    size_t raw = sizeof(double) * rows * cols;
+    int rc = -1;
+    if (bytec >= 1) {
+        const unsigned char *payload = (const unsigned char*) bytes + 1;
+        switch (bytes[0]) {
+        case CODEC_RAW:
+            if (bytec - 1 == raw) { memcpy(vals, payload, raw); rc = 0; }
+            break;
+        case CODEC_LOSSLESS:
+            rc = decode_words(payload, bytec - 1, vals, rows, cols, 8);
+            break;
+        case CODEC_FLOAT16:
+            rc = decode_words(payload, bytec - 1, vals, rows, cols, 2);
+            break;
+        }
+    }
+    stats.decode_seconds += now() - t0;
+    return rc;
+}
+
+/* knn_pairs_encode: [int32 count][varint zigzag index deltas][encoded distances] */
+char *knn_pairs_encode(struct KNN_Pair *pairs, int32_t count, size_t *bytec) {
+    double t0 = now();
+    size_t cap = sizeof(int32_t) + (size_t) count * 10;
+    unsigned char *head = (unsigned char*) malloc(cap);
+    double *dists = (double*) malloc(sizeof(double) * ((size_t) count + 1));
+    if (!head || !dists) { free(head); free(dists); return NULL; }
+    memcpy(head, &count, sizeof(int32_t));
+    size_t o = sizeof(int32_t);
+    int64_t prev = 0;
+    for (int32_t i = 0; i < count; ++i) {
+        o += put_varint(head + o, zigzag((int64_t) pairs[i].index - prev));
+        prev = pairs[i].index;
+        dists[i] = pairs[i].distance;
+    }
+    stats.encode_seconds += now() - t0;
+
+    size_t dlen;
+    char *body = codec_encode_doubles(dists, count, 1, CODEC_LOSSLESS, 0.0, &dlen);
+    free(dists);
+    char *buf = body ? (char*) malloc(o + dlen) : NULL;
+    if (buf) {
+        memcpy(buf, head, o);
+        memcpy(buf + o, body, dlen);
+        *bytec = o + dlen;
+        stats.raw_bytes += sizeof(int32_t) * ((size_t) count + 1);
+        stats.wire_bytes += o;
+    }
+    free(head);
+    free(body);
+    return buf;
+}
+
+struct KNN_Pair *knn_pairs_decode(char *bytes, size_t bytec, int32_t *count) {
+    double t0 = now();
+    if (bytec < sizeof(int32_t)) return NULL;
+    int32_t n;
+    memcpy(&n, bytes, sizeof(int32_t));
+    if (n < 0) return NULL;
+    struct KNN_Pair *pairs = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * ((size_t) n + 1));
+    double *dists = (double*) malloc(sizeof(double) * ((size_t) n + 1));
+    if (!pairs || !dists) { free(pairs); free(dists); return NULL; }
+    const unsigned char *p = (const unsigned char*) bytes + sizeof(int32_t);
+    const unsigned char *end = (const unsigned char*) bytes + bytec;
+    int64_t prev = 0;
+    for (int32_t i = 0; i < n && p; ++i) {
+        uint64_t v = 0;
+        if (!(p = get_varint(p, end, &v))) break;
+        prev += unzigzag(v);
+        pairs[i].index = (int) prev;
+    }
+    stats.decode_seconds += now() - t0;
+    if (!p || codec_decode_doubles((const char*) p, end - p, dists, n, 1) != 0) {
+        free(pairs); free(dists);
+        return NULL;
+    }
+    for (int32_t i = 0; i < n; ++i) pairs[i].distance = dists[i];
+    free(dists);
+    *count = n;
+    return pairs;
+}
+
+/* codec_encode_records: [uint32 pairs length][knn_pairs_encode of (distance, index)]
+ * [payload columns 2 .. fields-1, lossless] */
+char *codec_encode_records(const double *records, int32_t count, int32_t fields, size_t *bytec) {
+    if (count < 0 || fields < 2) return NULL;
+    struct KNN_Pair *pairs = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * ((size_t) count + 1));
+    double *payload = (double*) malloc(sizeof(double) * ((size_t) count * (fields - 2) + 1));
+    if (!pairs || !payload) { free(pairs); free(payload); return NULL; }
+    for (int32_t i = 0; i < count; ++i) {
+        const double *rec = records + (size_t) i * fields;
+        pairs[i].distance = rec[0];
+        pairs[i].index = (int) rec[1];
+        memcpy(payload + (size_t) i * (fields - 2), rec + 2, sizeof(double) * (fields - 2));
+    }
+    size_t plen = 0, dlen = 0;
+    char *head = knn_pairs_encode(pairs, count, &plen);
+    char *body = head ? codec_encode_doubles(payload, count, fields - 2, CODEC_LOSSLESS, 0.0, &dlen) : NULL;
+    free(pairs);
+    free(payload);
+    uint32_t hlen = (uint32_t) plen;
+    char *buf = body ? (char*) malloc(sizeof(hlen) + plen + dlen) : NULL;
+    if (buf) {
+        memcpy(buf, &hlen, sizeof(hlen));
+        memcpy(buf + sizeof(hlen), head, plen);
+        memcpy(buf + sizeof(hlen) + plen, body, dlen);
+        *bytec = sizeof(hlen) + plen + dlen;
+    }
+    free(head);
+    free(body);
+    return buf;
+}
+
+int codec_decode_records(const char *bytes, size_t bytec, double *records, int32_t count, int32_t fields) {
+    uint32_t hlen;
+    if (fields < 2 || bytec < sizeof(hlen)) return -1;
+    memcpy(&hlen, bytes, sizeof(hlen));
+    if (hlen > bytec - sizeof(hlen)) return -1;
+    int32_t n = 0;
+    struct KNN_Pair *pairs = knn_pairs_decode((char*) bytes + sizeof(hlen), hlen, &n);
+    if (!pairs || n != count) { free(pairs); return -1; }
+    double *payload = (double*) malloc(sizeof(double) * ((size_t) count * (fields - 2) + 1));
+    if (!payload || codec_decode_doubles(bytes + sizeof(hlen) + hlen, bytec - sizeof(hlen) - hlen,
+                                         payload, count, fields - 2) != 0) {
+        free(pairs); free(payload);
+        return -1;
+    }
+    for (int32_t i = 0; i < count; ++i) {
+        double *rec = records + (size_t) i * fields;
+        rec[0] = pairs[i].distance;
+        rec[1] = (double) pairs[i].index;
+        memcpy(rec + 2, payload + (size_t) i * (fields - 2), sizeof(double) * (fields - 2));
+    }
+    free(pairs);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* Wire formats for inter-rank payloads. Every message starts with one codec byte:
+ *   CODEC_RAW      plain little-endian values
+ *   CODEC_LOSSLESS doubles XORed with their predecessor (column-major), byte-shuffled
+ *                  and zero-run coded
+ *   CODEC_FLOAT16  like lossless but on IEEE half precision; only used when every value
+ *                  round-trips within max_err, otherwise the message falls back to lossless
+ * Messages below CODEC_MIN_BYTES are always sent raw.
+ */
+#define CODEC_RAW 0
+#define CODEC_LOSSLESS 1
+#define CODEC_FLOAT16 2
+
+#define CODEC_MIN_BYTES 4096
+
+typedef struct codec_stats_t {
+    long messages;
+    long compressed;        /* messages not sent raw */
+    size_t raw_bytes;       /* size the payloads would have had uncompressed */
+    size_t wire_bytes;
+    double encode_seconds;
+    double decode_seconds;
+} codec_stats_t;
+
+char *codec_encode_doubles(const double *vals, int32_t rows, int32_t cols, int mode,
+                           double max_err, size_t *bytec);
+int codec_decode_doubles(const char *bytes, size_t bytec, double *vals, int32_t rows, int32_t cols);
+
+char *knn_pairs_encode(struct KNN_Pair *pairs, int32_t count, size_t *bytec);
+struct KNN_Pair *knn_pairs_decode(char *bytes, size_t bytec, int32_t *count);
+
+/* candidate records of `fields` doubles (distance, index, payload...) as sent between
+ * ranks: (distance, index) through knn_pairs_encode, the payload losslessly */
+char *codec_encode_records(const double *records, int32_t count, int32_t fields, size_t *bytec);
+int codec_decode_records(const char *bytes, size_t bytec, double *records, int32_t count, int32_t fields);
+
+codec_stats_t codec_get_stats(void);
+void codec_reset_stats(void);
+
+#endif
@@ -0,0 +1,397 @@
+#include "dedup.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+static uint64_t hash_row(const double *row, int cols) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (int c = 0; c < cols; ++c) {
+        double v = row[c] + 0.0;   /* -0.0 and 0.0 hash alike */
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        h ^= bits + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    return h;
+}
+
+static int rows_equal(const double *a, const double *b, int cols) {
+    for (int c = 0; c < cols; ++c)
+        if (a[c] != b[c]) return 0;
+    return 1;
+}
+
+static int int_asc_comp(const void *a, const void *b) {
+    int x = *(const int*) a, y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+/* dedup_create: groups identical rows of data through an open-addressing hash table and,
+ * when labels is given, builds a (label, count) histogram per unique point.
+ */
+dedup_t *dedup_create(matrix_t *data, matrix_t *labels) {
+    int rows = matrix_get_rows(data);
+    int cols = matrix_get_cols(data);
+    dedup_t *dd = (dedup_t*) calloc(1, sizeof(dedup_t));
+    if (!dd) return NULL;
+    dd->rows = rows;
+
+    size_t capacity = 16;
+    while (capacity < (size_t) rows * 2) capacity <<= 1;
+    int *slots = (int*) malloc(sizeof(int) * capacity);
+    int *first = (int*) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    dd->unique_of = (int*) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    if (!slots || !first || !dd->unique_of) {
+        free(slots);
+        free(first);
+        dedup_destroy(dd);
+        return NULL;
+    }
+    memset(slots, -1, sizeof(int) * capacity);
+
+    int uniques = 0;
+    for (int i = 0; i < rows; ++i) {
+        size_t s = hash_row(data->data[i], cols) & (capacity - 1);
+        while (slots[s] >= 0 && !rows_equal(data->data[first[slots[s]]], data->data[i], cols))
+            s = (s + 1) & (capacity - 1);
+        if (slots[s] < 0) {
+            slots[s] = uniques;
+            first[uniques++] = i;
+        }
+        dd->unique_of[i] = slots[s];
+    }
+    free(slots);
+    dd->uniques = uniques;
+
+    dd->unique = matrix_create(uniques, cols);
+    dd->member_start = (int*) calloc(uniques + 1, sizeof(int));
+    dd->members = (int*) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    dd->hist_start = (int*) calloc(uniques + 1, sizeof(int));
+    dd->hist_label = (int*) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    dd->hist_count = (int*) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    if (!dd->unique || !dd->member_start || !dd->members || !dd->hist_start ||
+        !dd->hist_label || !dd->hist_count) {
+        free(first);
+        dedup_destroy(dd);
+        return NULL;
+    }
+    for (int u = 0; u < uniques; ++u)
+        memcpy(dd->unique->data[u], data->data[first[u]], sizeof(double) * cols);
+    free(first);
+
+    /* members in ascending row order */
+    for (int i = 0; i < rows; ++i) dd->member_start[dd->unique_of[i] + 1]++;
+    for (int u = 0; u < uniques; ++u) dd->member_start[u+1] += dd->member_start[u];
+    int *fill = (int*) malloc(sizeof(int) * (uniques > 0 ? uniques : 1));
+    if (!fill) { dedup_destroy(dd); return NULL; }
+    memcpy(fill, dd->member_start, sizeof(int) * uniques);
+    for (int i = 0; i < rows; ++i) dd->members[fill[dd->unique_of[i]]++] = i;
+    free(fill);
+
+    /* label histograms; unlabeled or out-of-range rows are left out, as in the vote */
+    int pairs = 0;
+    for (int u = 0; u < uniques; ++u) {
+        dd->hist_start[u] = pairs;
+        for (int m = dd->member_start[u]; labels && m < dd->member_start[u+1]; ++m) {
+            double v = matrix_get_cell(labels, dd->members[m], 0);
+            if (isnan(v) || (int) v < 0 || (int) v >= DEDUP_LABELS) continue;
+            int lab = (int) v, h = dd->hist_start[u];
+            while (h < pairs && dd->hist_label[h] != lab) ++h;
+            if (h == pairs) {
+                dd->hist_label[pairs] = lab;
+                dd->hist_count[pairs++] = 0;
+            }
+            dd->hist_count[h]++;
+        }
+    }
+    dd->hist_start[uniques] = pairs;
+    return dd;
+}
+
+void dedup_destroy(dedup_t *dd) {
+    if (!dd) return;
+    if (dd->lists) {
+        for (int u = 0; u < dd->uniques; ++u) free(dd->lists[u]);
+        free(dd->lists);
+    }
+    free(dd->list_len);
+    matrix_destroy(dd->unique);
+    free(dd->unique_of);
+    free(dd->member_start);
+    free(dd->members);
+    free(dd->hist_start);
+    free(dd->hist_label);
+    free(dd->hist_count);
+    free(dd);
+}
+
+/* list order: squared distance, then the unique's smallest member row */
+static inline int entry_before(dedup_t *dd, double d, int u, const dedup_entry_t *e) {
+    if (d != e->sq_dist) return d < e->sq_dist;
+    return dd->members[dd->member_start[u]] < dd->members[dd->member_start[e->unique]];
+}
+
+/* dedup_search: weighted kNN over the unique points. A list keeps the nearest uniques until
+ * their multiplicities reach k + 1 (the point itself is a member of its own unique), plus
+ * every unique tied at that boundary distance, so that dedup_expand can reproduce the
+ * (distance, index) order of knn_search_self exactly.
+ */
+int dedup_search(dedup_t *dd, int k) {
+    int U = dd->uniques;
+    int cols = matrix_get_cols(dd->unique);
+    int need = k + 1;
+    dd->k = k;
+    dd->lists = (dedup_entry_t**) calloc(U > 0 ? U : 1, sizeof(dedup_entry_t*));
+    dd->list_len = (int*) calloc(U > 0 ? U : 1, sizeof(int));
+    if (!dd->lists || !dd->list_len) return -1;
+    int failed = 0;
+
+    #pragma omp parallel
+    {
+        int cap = 2 * need + 16;
+        dedup_entry_t *list = (dedup_entry_t*) malloc(sizeof(dedup_entry_t) * cap);
+        if (!list) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int u = 0; u < U; ++u) {
+            if (!list) continue;
+            const double *a = dd->unique->data[u];
+            int len = 0, full = 0;
+            double boundary = INFINITY;
+            for (int v = 0; v < U; ++v) {
+                const double *b = dd->unique->data[v];
+                double d = 0.0;
+                int c = 0;
+                for (; c < cols; ++c) {
+                    double diff = a[c] - b[c];
+                    d += diff * diff;
+                    if (full && d > boundary) break;
+                }
+                if (c < cols) continue;
+
+                if (len == cap) {
+                    dedup_entry_t *grown = (dedup_entry_t*) realloc(list, sizeof(dedup_entry_t) * cap * 2);
+                    if (!grown) {
+                        #pragma omp atomic write
+                        failed = 1;
+                        break;
+                    }
+                    list = grown;
+                    cap *= 2;
+                }
+                int pos = len;
+                while (pos > 0 && entry_before(dd, d, v, &list[pos-1])) {
+                    list[pos] = list[pos-1];
+                    --pos;
+                }
+                list[pos].sq_dist = d;
+                list[pos].unique = v;
+                ++len;
+
+                /* drop whole distance groups beyond the first one that completes k + 1 */
+                int weight = 0;
+                for (int e = 0; e < len; ++e) {
+                    weight += dedup_multiplicity(dd, list[e].unique);
+                    if (weight >= need) {
+                        full = 1;
+                        boundary = list[e].sq_dist;
+                        while (e + 1 < len && list[e+1].sq_dist == boundary) ++e;
+                        len = e + 1;
+                        break;
+                    }
+                }
+            }
+            dd->lists[u] = (dedup_entry_t*) malloc(sizeof(dedup_entry_t) * (len > 0 ? len : 1));
+            if (!dd->lists[u]) {
+                #pragma omp atomic write
+                failed = 1;
+                continue;
+            }
+            memcpy(dd->lists[u], list, sizeof(dedup_entry_t) * len);
+            dd->list_len[u] = len;
+        }
+        free(list);
+    }
+    return failed ? -1 : 0;
+}
+
+/* Walks the distance groups of unique u's list for member row p. Groups that fit in the
+ * remaining budget are reported whole (take < 0); the boundary group reports the `take`
+ * smallest member rows other than p in picked, ascending.
+ */
+typedef void (*dedup_group_fn)(dedup_t *dd, int p, const dedup_entry_t *group, int count,
+                               int take, const int *picked, void *ctx);
+
+static void dedup_walk(dedup_t *dd, int u, int p, int k, int *scratch, dedup_group_fn fn, void *ctx) {
+    const dedup_entry_t *list = dd->lists[u];
+    int len = dd->list_len[u];
+    int left = k;
+    for (int g = 0; g < len && left > 0; ) {
+        int end = g, members = 0;
+        while (end < len && list[end].sq_dist == list[g].sq_dist) {
+            members += dedup_multiplicity(dd, list[end].unique) - (list[end].unique == u);
+            ++end;
+        }
+        if (members <= left) {
+            fn(dd, p, list + g, end - g, -1, NULL, ctx);
+            left -= members;
+        } else {
+            /* the smallest rows of the group are among the left + 1 first of each unique */
+            int n = 0;
+            for (int e = g; e < end; ++e) {
+                int v = list[e].unique, taken = 0;
+                for (int m = dd->member_start[v]; m < dd->member_start[v+1] && taken < left; ++m) {
+                    if (dd->members[m] == p) continue;
+                    scratch[n++] = dd->members[m];
+                    ++taken;
+                }
+            }
+            qsort(scratch, n, sizeof(int), int_asc_comp);
+            fn(dd, p, list + g, end - g, left, scratch, ctx);
+            left = 0;
+        }
+        g = end;
+    }
+}
+
+/* room for the boundary group: at most k rows from each unique of a list */
+static size_t scratch_size(dedup_t *dd) {
+    int longest = 1;
+    for (int u = 0; u < dd->uniques; ++u)
+        if (dd->list_len[u] > longest) longest = dd->list_len[u];
+    return (size_t) longest * (dd->k > 0 ? dd->k : 1);
+}
+
+typedef struct expand_ctx_t {
+    struct KNN_Pair *row;
+    int filled;
+    int i_offset;
+} expand_ctx_t;
+
+static void expand_group(dedup_t *dd, int p, const dedup_entry_t *group, int count,
+                         int take, const int *picked, void *ctx) {
+    expand_ctx_t *x = (expand_ctx_t*) ctx;
+    double dist = sqrt(group[0].sq_dist);
+    int start = x->filled;
+    if (take >= 0) {
+        for (int t = 0; t < take; ++t) {
+            x->row[x->filled].distance = dist;
+            x->row[x->filled++].index = x->i_offset + picked[t];
+        }
+        return;
+    }
+    for (int e = 0; e < count; ++e) {
+        int v = group[e].unique;
+        for (int m = dd->member_start[v]; m < dd->member_start[v+1]; ++m) {
+            if (dd->members[m] == p) continue;
+            x->row[x->filled].distance = dist;
+            x->row[x->filled++].index = x->i_offset + dd->members[m];
+        }
+    }
+    if (count > 1)
+        qsort(x->row + start, x->filled - start, sizeof(struct KNN_Pair), KNN_Pair_asc_comp_by_index);
+}
+
+/* dedup_expand: per original row kNN table, identical to knn_search_self on the full chunk */
+struct KNN_Pair **dedup_expand(dedup_t *dd, int i_offset) {
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(dd->rows, dd->k);
+    if (!results) return NULL;
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        int *scratch = (int*) malloc(sizeof(int) * scratch_size(dd));
+        if (!scratch) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        #pragma omp for schedule(dynamic, 64)
+        for (int p = 0; p < dd->rows; ++p) {
+            if (!scratch) continue;
+            expand_ctx_t x = { results[p], 0, i_offset };
+            dedup_walk(dd, dd->unique_of[p], p, dd->k, scratch, expand_group, &x);
+        }
+        free(scratch);
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: dedup_expand: out of memory\n");
+        KNN_Pair_destroy_table(results, dd->rows);
+        return NULL;
+    }
+    return results;
+}
+
+typedef struct vote_ctx_t {
+    int counts[DEDUP_LABELS];
+    matrix_t *labels;
+} vote_ctx_t;
+
+static void vote_group(dedup_t *dd, int p, const dedup_entry_t *group, int count,
+                       int take, const int *picked, void *ctx) {
+    vote_ctx_t *x = (vote_ctx_t*) ctx;
+    if (take >= 0) {
+        for (int t = 0; t < take; ++t) {
+            double v = matrix_get_cell(x->labels, picked[t], 0);
+            if (!isnan(v) && (int) v >= 0 && (int) v < DEDUP_LABELS) x->counts[(int) v]++;
+        }
+        return;
+    }
+    /* whole uniques vote with their histograms; p's own label is taken back out */
+    for (int e = 0; e < count; ++e) {
+        int v = group[e].unique;
+        for (int h = dd->hist_start[v]; h < dd->hist_start[v+1]; ++h)
+            x->counts[dd->hist_label[h]] += dd->hist_count[h];
+        if (v == dd->unique_of[p]) {
+            double own = matrix_get_cell(x->labels, p, 0);
+            if (!isnan(own) && (int) own >= 0 && (int) own < DEDUP_LABELS) x->counts[(int) own]--;
+        }
+    }
+}
+
+/* dedup_classify: majority vote (ties to the lowest label) of the k <= dd->k nearest over the
+ * weighted unique lists, giving the same prediction as voting over the expanded kNN table
+ */
+matrix_t *dedup_classify(dedup_t *dd, matrix_t *labels, int k) {
+    if (k > dd->k) k = dd->k;
+    matrix_t *out = matrix_create(dd->rows, 1);
+    if (!out) return NULL;
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        int *scratch = (int*) malloc(sizeof(int) * scratch_size(dd));
+        if (!scratch) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        vote_ctx_t x;
+        x.labels = labels;
+        #pragma omp for schedule(dynamic, 64)
+        for (int p = 0; p < dd->rows; ++p) {
+            if (!scratch) continue;
+            memset(x.counts, 0, sizeof(x.counts));
+            dedup_walk(dd, dd->unique_of[p], p, k, scratch, vote_group, &x);
+            int best = 0, bestc = 0;
+            for (int c = 0; c < DEDUP_LABELS; ++c) {
+                if (x.counts[c] > bestc) {
+                    best = c;
+                    bestc = x.counts[c];
+                }
+            }
+            matrix_set_cell(out, p, 0, (double) best);
+        }
+        free(scratch);
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: dedup_classify: out of memory\n");
+        matrix_destroy(out);
+        return NULL;
+    }
+    return out;
+}
@@ -0,0 +1,48 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "matrix.h"
+#include "knn.h"
+
+/* labels counted in the per-unique histograms, matching the classifier in main */
+#define DEDUP_LABELS 256
+/* below this rows / uniques ratio the plain self-join is cheaper than the weighted search */
+#define DEDUP_MIN_RATIO 1.25
+
+/* one entry of a unique point's weighted neighbour list */
+typedef struct dedup_entry_t {
+    double sq_dist;
+    int unique;
+} dedup_entry_t;
+
+/* Exact-duplicate collapsing of a local chunk. Members of each unique are kept in
+ * ascending row order, so members[member_start[u]] is the unique's smallest row.
+ */
+typedef struct dedup_t {
+    int rows;
+    int uniques;
+    matrix_t *unique;        /* uniques x cols, first copy of each vector */
+    int *unique_of;          /* rows: unique of every original row */
+    int *member_start;       /* uniques + 1 */
+    int *members;            /* rows, grouped by unique */
+    int *hist_start;         /* uniques + 1 */
+    int *hist_label;         /* (label, count) pairs of every unique */
+    int *hist_count;
+    dedup_entry_t **lists;   /* weighted neighbour list per unique, filled by dedup_search */
+    int *list_len;
+    int k;
+} dedup_t;
+
+dedup_t *dedup_create(matrix_t *data, matrix_t *labels);
+void dedup_destroy(dedup_t *dd);
+
+static inline int dedup_multiplicity(dedup_t *dd, int u) {
+    return dd->member_start[u+1] - dd->member_start[u];
+}
+
+/* dedup_search returns -1 and the other two NULL when an allocation fails */
+int dedup_search(dedup_t *dd, int k);
+struct KNN_Pair **dedup_expand(dedup_t *dd, int i_offset);
+matrix_t *dedup_classify(dedup_t *dd, matrix_t *labels, int k);
+
+#endif
@@ -1,12 +1,13 @@
 #include "matrix.h"
 #include "knn.h"
+#include "sparse.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <mpi.h>
 #include <string.h>
 
 /* simplified distributed knn: here we implement a helper that for each process
- * computes knn of its local_data vs local_data (removing self), producing table rows x k.
+ * computes knn of its local_data vs local_data (excluding self), producing table rows x k.
  * Real distribution (ring passing) is more complex; this keeps interface compatible.
  */
 
@@ -14,22 +15,16 @@ struct KNN_Pair **knn_search_distributed(matrix_t *local_data, int k,
                                          int prev_task, int next_task,
                                          int tasks_num)
 {
-    int rows = matrix_get_rows(local_data);
-    /* compute knn on local_data vs local_data (k+1 to skip self) */
-    struct KNN_Pair **res = knn_search(local_data, local_data, k+1, matrix_get_chunk_offset(local_data));
-    struct KNN_Pair **out = KNN_Pair_create_empty_table(rows, k);
-    for (int i = 0; i < rows; ++i) {
-        int filled = 0;
-        for (int j = 0; j < k+1 && filled < k; ++j) {
-            if (res[i][j].index == matrix_get_chunk_offset(local_data) + i) continue;
-            out[i][filled].distance = res[i][j].distance;
-            out[i][filled].index = res[i][j].index;
-            filled++;
-        }
-        while (filled < k) { out[i][filled].distance = 1e300; out[i][filled].index = -1; filled++; }
-    }
-    KNN_Pair_destroy_table(res, rows);
-    return out;
+    /* symmetric self-join: each pair is computed once and self-matches never enter the lists */
+    return knn_search_self(local_data, k, matrix_get_chunk_offset(local_data));
+}
+
+/* same contract as knn_search_distributed for CSR chunks */
+struct KNN_Pair **knn_search_distributed_sparse(sparse_t *local_data, int k,
+                                                int prev_task, int next_task,
+                                                int tasks_num)
+{
+    return sparse_knn_search_self(local_data, k, local_data->chunk_offset);
 }
 
 /* knn_labeling_distributed: simplified version that only uses local labels.
@@ -3,6 +3,7 @@
 
 #include "matrix.h"
 #include "knn.h"
+#include "sparse.h"
 
 struct KNN_Pair **knn_search_distributed(
     matrix_t *local_data,
@@ -12,6 +13,14 @@ struct KNN_Pair **knn_search_distributed(
     int tasks_num
 );
 
+struct KNN_Pair **knn_search_distributed_sparse(
+    sparse_t *local_data,
+    int k,
+    int prev_task,
+    int next_task,
+    int tasks_num
+);
+
 matrix_t *knn_labeling_distributed(
     struct KNN_Pair **knns,
     int points,
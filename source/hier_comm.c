@@ -0,0 +1,176 @@
+#include "hier_comm.h"
+#include "shared_matrix.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+hier_comm_t *hier_comm_create(MPI_Comm comm) {
+    hier_comm_t *h = (hier_comm_t*) calloc(1, sizeof(hier_comm_t));
+    if (!h) return NULL;
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    h->comm = comm;
+
+    const char *rpn = getenv("HIER_RANKS_PER_NODE");
+    if (rpn && atoi(rpn) > 0)
+        MPI_Comm_split(comm, rank / atoi(rpn), rank, &h->node);
+    else
+        h->node = shared_node_comm(comm);
+    MPI_Comm_rank(h->node, &h->node_rank);
+    MPI_Comm_size(h->node, &h->node_size);
+    MPI_Comm_split(comm, h->node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &h->leaders);
+
+    /* leaders learn the node count and whether they are the root's node, then tell their node */
+    int info[2] = { 0, 0 };
+    if (h->leaders != MPI_COMM_NULL) {
+        int leader_rank = 0;
+        MPI_Comm_rank(h->leaders, &leader_rank);
+        MPI_Comm_size(h->leaders, &info[0]);
+        info[1] = leader_rank == 0;
+    }
+    MPI_Bcast(info, 2, MPI_INT, 0, h->node);
+    h->nodes = info[0];
+    h->on_root_node = info[1];
+    return h;
+}
+
+void hier_comm_destroy(hier_comm_t *h) {
+    if (!h) return;
+    if (h->leaders != MPI_COMM_NULL) MPI_Comm_free(&h->leaders);
+    MPI_Comm_free(&h->node);
+    free(h);
+}
+
+/* one collective call: a payload at each level where this rank is not the root, and the
+ * flat estimate for the same call */
+static void hier_count(hier_comm_t *h, int count, MPI_Datatype type) {
+    int size = 0;
+    MPI_Type_size(type, &size);
+    long bytes = (long) size * count;
+    if (h->node_rank != 0) {
+        h->node_messages++;
+        h->node_bytes += bytes;
+    }
+    if (h->leaders != MPI_COMM_NULL && !h->on_root_node) {
+        h->inter_messages++;
+        h->inter_bytes += bytes;
+    }
+    if (!h->on_root_node) {
+        h->flat_messages++;
+        h->flat_bytes += bytes;
+    }
+}
+
+/* broadcast from rank 0: across leaders, then inside every node */
+int hier_bcast(hier_comm_t *h, void *buf, int count, MPI_Datatype type) {
+    hier_count(h, count, type);
+    if (h->leaders != MPI_COMM_NULL) MPI_Bcast(buf, count, type, 0, h->leaders);
+    return MPI_Bcast(buf, count, type, 0, h->node);
+}
+
+/* reduce to rank 0: inside every node onto its leader, then across leaders.
+ * op must be commutative, since ranks are combined out of comm order. */
+int hier_reduce(hier_comm_t *h, const void *sendbuf, void *recvbuf, int count,
+                MPI_Datatype type, MPI_Op op) {
+    hier_count(h, count, type);
+    MPI_Aint lb = 0, extent = 0;
+    MPI_Type_get_extent(type, &lb, &extent);
+    void *partial = h->node_rank == 0 ? malloc((size_t) extent * (count > 0 ? count : 1)) : NULL;
+    if (h->node_rank == 0 && !partial) return MPI_ERR_NO_MEM;
+    MPI_Reduce(sendbuf, partial, count, type, op, 0, h->node);
+    int err = MPI_SUCCESS;
+    if (h->leaders != MPI_COMM_NULL) {
+        int leader_rank = 0;
+        MPI_Comm_rank(h->leaders, &leader_rank);
+        if (leader_rank == 0) {
+            err = MPI_Reduce(MPI_IN_PLACE, partial, count, type, op, 0, h->leaders);
+            memcpy(recvbuf, partial, (size_t) extent * count);
+        } else {
+            err = MPI_Reduce(partial, NULL, count, type, op, 0, h->leaders);
+        }
+    }
+    free(partial);
+    return err;
+}
+
+/* allreduce as a reduce to rank 0 followed by a broadcast; sendbuf may be MPI_IN_PLACE */
+int hier_allreduce(hier_comm_t *h, const void *sendbuf, void *recvbuf, int count,
+                   MPI_Datatype type, MPI_Op op) {
+    void *copy = NULL;
+    if (sendbuf == MPI_IN_PLACE) {
+        MPI_Aint lb = 0, extent = 0;
+        MPI_Type_get_extent(type, &lb, &extent);
+        copy = malloc((size_t) extent * (count > 0 ? count : 1));
+        if (!copy) return MPI_ERR_NO_MEM;
+        memcpy(copy, recvbuf, (size_t) extent * count);
+        sendbuf = copy;
+    }
+    int err = hier_reduce(h, sendbuf, recvbuf, count, type, op);
+    free(copy);
+    if (err != MPI_SUCCESS) return err;
+    return hier_bcast(h, recvbuf, count, type);
+}
+
+int hier_barrier(hier_comm_t *h) {
+    MPI_Barrier(h->node);
+    if (h->leaders != MPI_COMM_NULL) MPI_Barrier(h->leaders);
+    return MPI_Barrier(h->node);
+}
+
+/* list of k records of `fields` doubles, as expected by hier_topk_op; free both types */
+void hier_topk_type(int k, int fields, MPI_Datatype *record, MPI_Datatype *list) {
+    MPI_Type_contiguous(fields, MPI_DOUBLE, record);
+    MPI_Type_contiguous(k, *record, list);
+    MPI_Type_commit(list);
+}
+
+/* MPI_Op over lists from hier_topk_type (records sorted by field 0, then field 1): keeps
+ * the k best of both lists. k and fields are read back from how the datatype was built. */
+void hier_topk_op(void *in, void *inout, int *len, MPI_Datatype *type) {
+    int ints[1], nint, naddr, ntypes, combiner;
+    MPI_Aint addrs[1];
+    MPI_Datatype record;
+    MPI_Type_get_envelope(*type, &nint, &naddr, &ntypes, &combiner);
+    if (combiner != MPI_COMBINER_CONTIGUOUS) {
+        fprintf(stderr, "ERROR: hier_topk_op: datatype not built by hier_topk_type\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Type_get_contents(*type, 1, 0, 1, ints, addrs, &record);
+    int k = ints[0], size = 0;
+    MPI_Type_size(record, &size);
+    int fields = size / (int) sizeof(double);
+    MPI_Type_get_envelope(record, &nint, &naddr, &ntypes, &combiner);
+    if (combiner != MPI_COMBINER_NAMED) MPI_Type_free(&record);
+
+    double *merged = (double*) malloc(sizeof(double) * fields * k);
+    if (!merged) {
+        fprintf(stderr, "ERROR: hier_topk_op: out of memory\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int l = 0; l < *len; ++l) {
+        double *a = (double*) in + (size_t) l * k * fields;
+        double *b = (double*) inout + (size_t) l * k * fields;
+        for (int i = 0, ia = 0, ib = 0; i < k; ++i) {
+            int take_a = ib >= k || (ia < k && (a[ia * fields] < b[ib * fields] ||
+                         (a[ia * fields] == b[ib * fields] && a[ia * fields + 1] <= b[ib * fields + 1])));
+            double *src = take_a ? a + (size_t) fields * ia++ : b + (size_t) fields * ib++;
+            memcpy(merged + (size_t) fields * i, src, sizeof(double) * fields);
+        }
+        memcpy(b, merged, sizeof(double) * fields * k);
+    }
+    free(merged);
+}
+
+/* hier_reduce_topk: merges every rank's sorted list of k records (distance, index, ...)
+ * into the global k best on rank 0 (out, k x fields) */
+int hier_reduce_topk(hier_comm_t *h, const double *records, double *out, int k, int fields) {
+    MPI_Datatype record, list;
+    MPI_Op op;
+    hier_topk_type(k, fields, &record, &list);
+    MPI_Op_create(hier_topk_op, 1, &op);
+    int err = hier_reduce(h, records, out, 1, list, op);
+    MPI_Op_free(&op);
+    MPI_Type_free(&list);
+    MPI_Type_free(&record);
+    return err;
+}
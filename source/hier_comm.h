@@ -0,0 +1,46 @@
+#ifndef HIER_COMM_H
+#define HIER_COMM_H
+
+#include <mpi.h>
+
+/* Two-level communicators: ranks of a node, and one leader (node rank 0) per node.
+ * Collectives go through the node first, so only leaders exchange messages across nodes.
+ * The root of every collective is rank 0 of comm, which is always leader 0.
+ * HIER_RANKS_PER_NODE=<n> in the environment groups ranks in blocks of n instead of by
+ * shared memory, to try the layout on a single machine.
+ */
+typedef struct hier_comm_t {
+    MPI_Comm comm;
+    MPI_Comm node;
+    MPI_Comm leaders;      /* MPI_COMM_NULL on non-leaders */
+    int node_rank;
+    int node_size;
+    int nodes;
+    int on_root_node;      /* this rank shares a node with the root */
+    /* payloads delivered inside a node and between leaders: each collective step counts one
+     * on every rank but its root (sent by a reduce, received by a broadcast), which summed
+     * over the ranks is the n - 1 messages of the usual tree algorithms */
+    long node_messages;
+    long node_bytes;
+    long inter_messages;
+    long inter_bytes;
+    long flat_messages;    /* estimate: one payload per rank off the root's node with flat collectives */
+    long flat_bytes;
+} hier_comm_t;
+
+hier_comm_t *hier_comm_create(MPI_Comm comm);
+void hier_comm_destroy(hier_comm_t *h);
+
+int hier_bcast(hier_comm_t *h, void *buf, int count, MPI_Datatype type);
+int hier_reduce(hier_comm_t *h, const void *sendbuf, void *recvbuf, int count,
+                MPI_Datatype type, MPI_Op op);
+int hier_allreduce(hier_comm_t *h, const void *sendbuf, void *recvbuf, int count,
+                   MPI_Datatype type, MPI_Op op);
+int hier_barrier(hier_comm_t *h);
+
+/* top-k merge of sorted (distance, index, ...) record lists, usable with any reduction */
+void hier_topk_type(int k, int fields, MPI_Datatype *record, MPI_Datatype *list);
+void hier_topk_op(void *in, void *inout, int *len, MPI_Datatype *type);
+int hier_reduce_topk(hier_comm_t *h, const double *records, double *out, int k, int fields);
+
+#endif
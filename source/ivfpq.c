@@ -0,0 +1,270 @@
+#include "ivfpq.h"
+#include "rng.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+void ivfpq_default_params(ivfpq_params_t *params) {
+    params->nlist = 64;
+    params->m = 3;
+    params->nprobe = 8;
+    params->train_size = 20000;
+    params->iters = 10;
+    params->rerank = 4;
+    params->seed = 2024;
+}
+
+static int nearest(const double *x, const double *centroids, int count, int dims) {
+    int best = 0;
+    double best_d = INFINITY;
+    for (int c = 0; c < count; ++c) {
+        double d = knn_sq_dist(x, centroids + (size_t) c * dims, dims);
+        if (d < best_d) { best_d = d; best = c; }
+    }
+    return best;
+}
+
+/* Lloyd's k-means on n contiguous points; empty clusters are reseeded from random points */
+static void kmeans(const double *pts, int n, int dims, int count, int iters, uint64_t *rng,
+                   double *centroids) {
+    int *assign = (int*) malloc(sizeof(int) * n);
+    int *sizes = (int*) malloc(sizeof(int) * count);
+    if (!assign || !sizes) { free(assign); free(sizes); return; }
+    for (int c = 0; c < count; ++c)
+        memcpy(centroids + (size_t) c * dims, pts + (size_t) rng_below(rng, n) * dims,
+               sizeof(double) * dims);
+
+    for (int it = 0; it < iters; ++it) {
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; ++i)
+            assign[i] = nearest(pts + (size_t) i * dims, centroids, count, dims);
+
+        memset(centroids, 0, sizeof(double) * count * dims);
+        memset(sizes, 0, sizeof(int) * count);
+        for (int i = 0; i < n; ++i) {
+            double *c = centroids + (size_t) assign[i] * dims;
+            for (int d = 0; d < dims; ++d) c[d] += pts[(size_t) i * dims + d];
+            sizes[assign[i]]++;
+        }
+        for (int c = 0; c < count; ++c) {
+            double *cen = centroids + (size_t) c * dims;
+            if (sizes[c] == 0) {
+                memcpy(cen, pts + (size_t) rng_below(rng, n) * dims, sizeof(double) * dims);
+                continue;
+            }
+            for (int d = 0; d < dims; ++d) cen[d] /= sizes[c];
+        }
+    }
+    free(assign);
+    free(sizes);
+}
+
+static inline const double *codeword(ivfpq_t *ix, int s, int c) {
+    int dsub = ix->sub_start[s+1] - ix->sub_start[s];
+    return ix->codebooks + (size_t) ix->ksub * ix->sub_start[s] + (size_t) c * dsub;
+}
+
+/* ivfpq_build: trains coarse centroids and per-subspace codebooks on a sample of data and
+ * encodes every row as (list, m code bytes). data must outlive the index for re-ranking.
+ */
+ivfpq_t *ivfpq_build(matrix_t *data, ivfpq_params_t *params) {
+    int rows = matrix_get_rows(data);
+    int dims = matrix_get_cols(data);
+    if (rows < 1) return NULL;
+    int m = params->m < 1 ? 1 : (params->m > dims ? dims : params->m);
+    int train = params->train_size > 0 && params->train_size < rows ? params->train_size : rows;
+    int nlist = params->nlist < train ? params->nlist : train;
+    if (nlist < 1) nlist = 1;
+
+    ivfpq_t *ix = (ivfpq_t*) calloc(1, sizeof(ivfpq_t));
+    if (!ix) return NULL;
+    ix->rows = rows;
+    ix->dims = dims;
+    ix->nlist = nlist;
+    ix->m = m;
+    ix->ksub = train < 256 ? train : 256;
+    ix->data = data;
+    ix->sub_start = (int*) malloc(sizeof(int) * (m + 1));
+    ix->coarse = (double*) malloc(sizeof(double) * nlist * dims);
+    ix->codebooks = (double*) malloc(sizeof(double) * ix->ksub * dims);
+    ix->list_start = (int*) calloc(nlist + 1, sizeof(int));
+    ix->list_rows = (int*) malloc(sizeof(int) * rows);
+    ix->codes = (uint8_t*) malloc((size_t) rows * m);
+    double *sample = (double*) malloc(sizeof(double) * (size_t) train * dims);
+    double *sub = (double*) malloc(sizeof(double) * (size_t) train * dims);
+    int *list_of = (int*) malloc(sizeof(int) * rows);
+    uint8_t *row_codes = (uint8_t*) malloc((size_t) rows * m);
+    if (!ix->sub_start || !ix->coarse || !ix->codebooks || !ix->list_start || !ix->list_rows ||
+        !ix->codes || !sample || !sub || !list_of || !row_codes) {
+        free(sample); free(sub); free(list_of); free(row_codes);
+        ivfpq_destroy(ix);
+        return NULL;
+    }
+    /* subspaces split the columns as evenly as possible */
+    for (int s = 0; s <= m; ++s) ix->sub_start[s] = s * dims / m;
+
+    uint64_t rng = params->seed;
+    for (int i = 0; i < train; ++i)
+        memcpy(sample + (size_t) i * dims, data->data[rng_below(&rng, rows)], sizeof(double) * dims);
+    kmeans(sample, train, dims, nlist, params->iters, &rng, ix->coarse);
+
+    /* codebooks are trained on the residuals to the coarse centroid */
+    for (int i = 0; i < train; ++i) {
+        double *x = sample + (size_t) i * dims;
+        const double *c = ix->coarse + (size_t) nearest(x, ix->coarse, nlist, dims) * dims;
+        for (int d = 0; d < dims; ++d) x[d] -= c[d];
+    }
+    for (int s = 0; s < m; ++s) {
+        int lo = ix->sub_start[s], dsub = ix->sub_start[s+1] - lo;
+        for (int i = 0; i < train; ++i)
+            memcpy(sub + (size_t) i * dsub, sample + (size_t) i * dims + lo, sizeof(double) * dsub);
+        kmeans(sub, train, dsub, ix->ksub, params->iters, &rng,
+               ix->codebooks + (size_t) ix->ksub * lo);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < rows; ++i) {
+        double residual[dims];
+        int l = nearest(data->data[i], ix->coarse, nlist, dims);
+        list_of[i] = l;
+        for (int d = 0; d < dims; ++d) residual[d] = data->data[i][d] - ix->coarse[(size_t) l * dims + d];
+        for (int s = 0; s < m; ++s) {
+            int lo = ix->sub_start[s], dsub = ix->sub_start[s+1] - lo;
+            row_codes[(size_t) i * m + s] =
+                (uint8_t) nearest(residual + lo, ix->codebooks + (size_t) ix->ksub * lo, ix->ksub, dsub);
+        }
+    }
+
+    /* group codes by list */
+    for (int i = 0; i < rows; ++i) ix->list_start[list_of[i] + 1]++;
+    for (int l = 0; l < nlist; ++l) ix->list_start[l+1] += ix->list_start[l];
+    int *fill = (int*) malloc(sizeof(int) * nlist);
+    if (fill) {
+        memcpy(fill, ix->list_start, sizeof(int) * nlist);
+        for (int i = 0; i < rows; ++i) {
+            int pos = fill[list_of[i]]++;
+            ix->list_rows[pos] = i;
+            memcpy(ix->codes + (size_t) pos * m, row_codes + (size_t) i * m, m);
+        }
+    }
+    free(fill);
+    free(sample);
+    free(sub);
+    free(list_of);
+    free(row_codes);
+    if (!fill) { ivfpq_destroy(ix); return NULL; }
+    return ix;
+}
+
+void ivfpq_destroy(ivfpq_t *ix) {
+    if (!ix) return;
+    free(ix->sub_start);
+    free(ix->coarse);
+    free(ix->codebooks);
+    free(ix->list_start);
+    free(ix->list_rows);
+    free(ix->codes);
+    free(ix);
+}
+
+/* bytes held by the index itself (codes, row ids, centroids, codebooks) */
+size_t ivfpq_memory(ivfpq_t *ix) {
+    return (size_t) ix->rows * ix->m + sizeof(int) * ((size_t) ix->rows + ix->nlist + 1 + ix->m + 1)
+         + sizeof(double) * ((size_t) ix->nlist * ix->dims + (size_t) ix->ksub * ix->dims);
+}
+
+/* ivfpq_search: scans the nprobe closest lists with per-query lookup tables (asymmetric
+ * distances), then re-ranks the best rerank * k candidates against the original rows.
+ */
+struct KNN_Pair **ivfpq_search(ivfpq_t *ix, matrix_t *points, int k, int i_offset,
+                               int nprobe, int rerank) {
+    int P = matrix_get_rows(points);
+    int dims = ix->dims, m = ix->m, ksub = ix->ksub;
+    if (nprobe > ix->nlist) nprobe = ix->nlist;
+    if (nprobe < 1) nprobe = 1;
+    int shortlist = rerank > 0 ? rerank * k : k;
+
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(P, k);
+    if (!results) return NULL;
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        struct KNN_Pair *probes = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * nprobe);
+        struct KNN_Pair *cands = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * shortlist);
+        double *lut = (double*) malloc(sizeof(double) * m * ksub);
+        double *residual = (double*) malloc(sizeof(double) * dims);
+        int ok = probes && cands && lut && residual;
+        if (!ok) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int p = 0; p < P; ++p) {
+            if (!ok) continue;
+            const double *q = points->data[p];
+            for (int j = 0; j < nprobe; ++j) { probes[j].distance = INFINITY; probes[j].index = -1; }
+            for (int l = 0; l < ix->nlist; ++l)
+                knn_push(probes, nprobe, knn_sq_dist(q, ix->coarse + (size_t) l * dims, dims), l);
+            for (int j = 0; j < shortlist; ++j) { cands[j].distance = INFINITY; cands[j].index = -1; }
+
+            for (int j = 0; j < nprobe; ++j) {
+                int l = probes[j].index;
+                for (int d = 0; d < dims; ++d) residual[d] = q[d] - ix->coarse[(size_t) l * dims + d];
+                for (int s = 0; s < m; ++s) {
+                    int lo = ix->sub_start[s], dsub = ix->sub_start[s+1] - lo;
+                    for (int c = 0; c < ksub; ++c)
+                        lut[s * ksub + c] = knn_sq_dist(residual + lo, codeword(ix, s, c), dsub);
+                }
+                for (int pos = ix->list_start[l]; pos < ix->list_start[l+1]; ++pos) {
+                    const uint8_t *code = ix->codes + (size_t) pos * m;
+                    double dist = 0.0;
+                    for (int s = 0; s < m; ++s) dist += lut[s * ksub + code[s]];
+                    knn_push(cands, shortlist, dist, ix->list_rows[pos]);
+                }
+            }
+
+            /* the shortlist is already in (distance, index) order; re-ranked distances are
+             * pushed again so that ties keep that order */
+            for (int j = 0; j < shortlist && cands[j].index >= 0; ++j) {
+                if (rerank <= 0 && j >= k) break;
+                double dist = rerank > 0 ? knn_sq_dist(q, ix->data->data[cands[j].index], dims)
+                                         : cands[j].distance;
+                knn_push(results[p], k, sqrt(dist), i_offset + cands[j].index);
+            }
+        }
+        free(probes);
+        free(cands);
+        free(lut);
+        free(residual);
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: ivfpq_search: out of memory\n");
+        KNN_Pair_destroy_table(results, P);
+        return NULL;
+    }
+    return results;
+}
+
+/* all-kNN of the indexed rows against themselves, self-match dropped */
+struct KNN_Pair **ivfpq_search_self(ivfpq_t *ix, int k, int i_offset, int nprobe, int rerank) {
+    int rows = ix->rows;
+    struct KNN_Pair **res = ivfpq_search(ix, ix->data, k + 1, i_offset, nprobe, rerank);
+    struct KNN_Pair **out = KNN_Pair_create_empty_table(rows, k);
+    if (!res || !out) {
+        KNN_Pair_destroy_table(res, rows);
+        KNN_Pair_destroy_table(out, rows);
+        return NULL;
+    }
+    for (int i = 0; i < rows; ++i) {
+        int filled = 0;
+        for (int j = 0; j < k + 1 && filled < k; ++j) {
+            if (res[i][j].index == i_offset + i) continue;
+            out[i][filled++] = res[i][j];
+        }
+    }
+    KNN_Pair_destroy_table(res, rows);
+    return out;
+}
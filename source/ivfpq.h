@@ -0,0 +1,46 @@
+#ifndef IVFPQ_H
+#define IVFPQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* IVF-PQ: coarse k-means lists plus product-quantised residuals (one byte per subspace) */
+typedef struct ivfpq_params_t {
+    int nlist;        /* coarse centroids */
+    int m;            /* PQ subspaces, one code byte each */
+    int nprobe;       /* lists scanned per query */
+    int train_size;   /* rows sampled for k-means */
+    int iters;        /* k-means iterations */
+    int rerank;       /* ADC candidates re-ranked exactly, as a multiple of k (0 = none) */
+    uint64_t seed;
+} ivfpq_params_t;
+
+typedef struct ivfpq_t {
+    int rows;
+    int dims;
+    int nlist;
+    int m;
+    int ksub;            /* centroids per subspace */
+    int *sub_start;      /* m + 1 column boundaries */
+    double *coarse;      /* nlist x dims */
+    double *codebooks;   /* subspace s, centroid c at ksub * sub_start[s] + c * dsub */
+    int *list_start;     /* nlist + 1 */
+    int *list_rows;      /* local row of every code, grouped by list */
+    uint8_t *codes;      /* rows x m, in list order */
+    matrix_t *data;      /* original vectors for re-ranking, not owned */
+} ivfpq_t;
+
+void ivfpq_default_params(ivfpq_params_t *params);
+
+ivfpq_t *ivfpq_build(matrix_t *data, ivfpq_params_t *params);
+void ivfpq_destroy(ivfpq_t *index);
+
+size_t ivfpq_memory(ivfpq_t *index);
+
+struct KNN_Pair **ivfpq_search(ivfpq_t *index, matrix_t *points, int k, int i_offset,
+                               int nprobe, int rerank);
+struct KNN_Pair **ivfpq_search_self(ivfpq_t *index, int k, int i_offset, int nprobe, int rerank);
+
+#endif
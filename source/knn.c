@@ -1,4 +1,6 @@
 #include "knn.h"
+#include "knn_kernels.h"
+#include "rng.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
@@ -6,7 +8,7 @@
 
 /* helpers for KNN_Pair table */
 struct KNN_Pair **KNN_Pair_create_empty_table(int points, int k) {
-    struct KNN_Pair **table = (struct KNN_Pair**) malloc(sizeof(struct KNN_Pair*) * points);
+    struct KNN_Pair **table = (struct KNN_Pair**) malloc(sizeof(struct KNN_Pair*) * (points > 0 ? points : 1));
     if (!table) return NULL;
     for (int i = 0; i < points; ++i) {
         table[i] = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * k);
@@ -37,47 +39,269 @@ int KNN_Pair_asc_comp_by_index(const void *a, const void *b) {
     return ((struct KNN_Pair*)a)->index - ((struct KNN_Pair*)b)->index;
 }
 
-/* knn_search: use only first two columns for coords (x,y). That avoids using label column. */
+/* knn_search: distance over the query columns, so a trailing label column in data is ignored. */
 struct KNN_Pair **knn_search(matrix_t *data, matrix_t *points, int k, int i_offset) {
+    return knn_search_bounded(data, points, k, i_offset, 1e300);
+}
+
+/* knn_search_bounded: like knn_search, but only neighbours at distance <= bound enter the
+ * lists; unfilled slots keep index -1 and distance 1e300.
+ */
+struct KNN_Pair **knn_search_bounded(matrix_t *data, matrix_t *points, int k, int i_offset,
+                                     double bound) {
     if (!data || !points || k < 1) return NULL;
 
     int data_rows = matrix_get_rows(data);
     int P = matrix_get_rows(points);
     int dims = matrix_get_cols(points);
-    if (dims < 2) dims = 2;
+    if (dims > matrix_get_cols(data)) dims = matrix_get_cols(data);
 
     struct KNN_Pair **results = KNN_Pair_create_empty_table(P, k);
     if (!results) return NULL;
+    /* slack so that rounding never drops a neighbour sitting exactly on the bound */
+    if (bound < 1e300) {
+        for (int p = 0; p < P; ++p)
+            for (int j = 0; j < k; ++j) results[p][j].distance = bound * (1.0 + 1e-9);
+    }
+
+    knn_kernel_fn kernel = knn_kernel_lookup(dims, k);
+    if (kernel) {
+        kernel(data, points, results, i_offset);
+    } else {
+        // Paralelismo
+        #pragma omp parallel for schedule(static)
+        for (int p = 0; p < P; ++p) {
+
+            struct KNN_Pair *local_knn = results[p];
+
+            for (int d = 0; d < data_rows; ++d) {
+
+                // Calcula distancia euclidiana
+                double dist = 0.0;
+                for (int c = 0; c < dims; ++c) {
+                    double diff = matrix_get_cell(points, p, c)
+                                 - matrix_get_cell(data, d, c);
+                    dist += diff * diff;
+                }
+                dist = sqrt(dist);
+
+                if (dist < local_knn[k-1].distance) {
+                    local_knn[k-1].distance = dist;
+                    local_knn[k-1].index = i_offset + d;
+
+                    qsort(local_knn, k, sizeof(struct KNN_Pair), KNN_Pair_asc_comp);
+                }
+            }
+        }
+    }
+
+    if (bound < 1e300) {
+        for (int p = 0; p < P; ++p)
+            for (int j = 0; j < k; ++j)
+                if (results[p][j].index == -1) results[p][j].distance = 1e300;
+    }
+
+    return results;
+}
+
+/* pushes every pair of tiles a <= b into both rows' lists; a == b only visits i < j */
+static void knn_self_tile(matrix_t *data, struct KNN_Pair **results, int k, int i_offset,
+                          int tile, int a, int b) {
+    int rows = matrix_get_rows(data);
+    int dims = matrix_get_cols(data);
+    int a_end = (a + 1) * tile < rows ? (a + 1) * tile : rows;
+    int b_end = (b + 1) * tile < rows ? (b + 1) * tile : rows;
+    for (int i = a * tile; i < a_end; ++i) {
+        int j = (a == b) ? i + 1 : b * tile;
+        for (; j < b_end; ++j) {
+            double dist = knn_sq_dist(data->data[i], data->data[j], dims);
+            knn_push(results[i], k, dist, i_offset + j);
+            knn_push(results[j], k, dist, i_offset + i);
+        }
+    }
+}
+
+/* tile rows of the self-join, KNN_SELF_TILE unless tuned */
+static int knn_self_tile_rows = KNN_SELF_TILE;
+
+void knn_set_self_tile(int rows) {
+    knn_self_tile_rows = rows > 0 ? rows : KNN_SELF_TILE;
+}
+
+int knn_get_self_tile(void) {
+    return knn_self_tile_rows;
+}
 
-    // Paralelismo
-    #pragma omp parallel for schedule(static)
-    for (int p = 0; p < P; ++p) {
+/* squared distance between the bounding boxes of tiles a and b */
+static double knn_tile_gap(const double *lo, const double *hi, int dims, int a, int b) {
+    double gap = 0.0;
+    for (int c = 0; c < dims; ++c) {
+        double d = 0.0;
+        if (hi[a * dims + c] < lo[b * dims + c]) d = lo[b * dims + c] - hi[a * dims + c];
+        else if (hi[b * dims + c] < lo[a * dims + c]) d = lo[a * dims + c] - hi[b * dims + c];
+        gap += d * d;
+    }
+    return gap;
+}
 
-        struct KNN_Pair *local_knn = results[p];
+/* worst k-th (squared) distance among the rows of tile t */
+static double knn_tile_kth(struct KNN_Pair **results, int k, int rows, int tile, int t) {
+    int end = (t + 1) * tile < rows ? (t + 1) * tile : rows;
+    double worst = 0.0;
+    for (int i = t * tile; i < end; ++i)
+        if (results[i][k-1].distance > worst) worst = results[i][k-1].distance;
+    return worst;
+}
+
+/* joins tiles a and b unless their boxes are farther apart than both tiles' k-th
+ * distances; the gap is a lower bound of every pair's distance, so nothing is lost */
+static void knn_self_pair(matrix_t *data, struct KNN_Pair **results, int k, int i_offset,
+                          int tile, const double *lo, const double *hi, int a, int b) {
+    if (lo && a != b) {
+        int rows = matrix_get_rows(data);
+        double gap = knn_tile_gap(lo, hi, matrix_get_cols(data), a, b);
+        if (gap > knn_tile_kth(results, k, rows, tile, a) &&
+            gap > knn_tile_kth(results, k, rows, tile, b))
+            return;
+    }
+    knn_self_tile(data, results, k, i_offset, tile, a, b);
+}
 
-        for (int d = 0; d < data_rows; ++d) {
+/* knn_search_self: all-kNN of data against itself, excluding self-pairs.
+ * Each distance is computed once and pushed into both rows' lists. Tile pairs are
+ * scheduled round-robin so that the pairs of one round touch disjoint rows, which
+ * lets threads update the lists without locks. Ties are broken by lower index.
+ * Diagonal and adjacent tiles go first so that, on spatially ordered rows, the lists
+ * are tight early and far tile pairs can be skipped by their bounding boxes.
+ */
+struct KNN_Pair **knn_search_self(matrix_t *data, int k, int i_offset) {
+    if (!data || k < 1) return NULL;
 
-            // Calcula distancia euclidiana
-            double dist = 0.0;
-            for (int c = 0; c < 2; ++c) {
-                double diff = matrix_get_cell(points, p, c)
-                             - matrix_get_cell(data, d, c);
-                dist += diff * diff;
+    int rows = matrix_get_rows(data);
+    int dims = matrix_get_cols(data);
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(rows, k);
+    if (!results) return NULL;
+
+    int tile = knn_self_tile_rows;
+    int tiles = (rows + tile - 1) / tile;
+    /* circle method needs an even count; pairs against the dummy tile are skipped */
+    int slots = tiles + (tiles & 1);
+    /* per-tile bounding boxes; without them every pair is joined */
+    double *lo = (double*) malloc(sizeof(double) * (tiles > 0 ? tiles : 1) * dims);
+    double *hi = (double*) malloc(sizeof(double) * (tiles > 0 ? tiles : 1) * dims);
+    if (!lo || !hi) { free(lo); free(hi); lo = hi = NULL; }
+
+    #pragma omp parallel
+    {
+        if (lo) {
+            #pragma omp for schedule(static)
+            for (int t = 0; t < tiles; ++t) {
+                int end = (t + 1) * tile < rows ? (t + 1) * tile : rows;
+                for (int c = 0; c < dims; ++c) {
+                    lo[t * dims + c] = INFINITY;
+                    hi[t * dims + c] = -INFINITY;
+                }
+                for (int i = t * tile; i < end; ++i) {
+                    for (int c = 0; c < dims; ++c) {
+                        double v = data->data[i][c];
+                        if (v < lo[t * dims + c]) lo[t * dims + c] = v;
+                        if (v > hi[t * dims + c]) hi[t * dims + c] = v;
+                    }
+                }
             }
-            dist = sqrt(dist);
+        }
+
+        #pragma omp for schedule(dynamic)
+        for (int t = 0; t < tiles; ++t)
+            knn_self_tile(data, results, k, i_offset, tile, t, t);
 
-            if (local_knn[k-1].index == -1 || dist < local_knn[k-1].distance) {
-                local_knn[k-1].distance = dist;
-                local_knn[k-1].index = i_offset + d;
+        /* neighbouring tiles in two phases, (even, odd) then (odd, even) */
+        for (int phase = 0; phase < 2; ++phase) {
+            #pragma omp for schedule(dynamic)
+            for (int t = phase; t < tiles - 1; t += 2)
+                knn_self_tile(data, results, k, i_offset, tile, t, t + 1);
+        }
 
-                qsort(local_knn, k, sizeof(struct KNN_Pair), KNN_Pair_asc_comp);
+        for (int r = 0; r < slots - 1; ++r) {
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < slots / 2; ++i) {
+                int a, b;
+                if (i == 0) { a = r; b = slots - 1; }
+                else { a = (r + i) % (slots - 1); b = (r - i + slots - 1) % (slots - 1); }
+                if (a > b) { int tmp = a; a = b; b = tmp; }
+                if (b < tiles && b != a + 1)
+                    knn_self_pair(data, results, k, i_offset, tile, lo, hi, a, b);
             }
         }
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < k; ++j)
+                if (results[i][j].index != -1) results[i][j].distance = sqrt(results[i][j].distance);
     }
 
+    free(lo);
+    free(hi);
     return results;
 }
 
+/* knn_search_self_scan: all-kNN by scanning every row against the whole chunk (k + 1,
+ * self dropped). Each distance is computed twice, but rows are independent and the
+ * specialised kernels apply; equal distances may be ordered differently than the self-join.
+ */
+struct KNN_Pair **knn_search_self_scan(matrix_t *data, int k, int i_offset) {
+    if (!data || k < 1) return NULL;
+    int rows = matrix_get_rows(data);
+    struct KNN_Pair **res = knn_search(data, data, k + 1, i_offset);
+    struct KNN_Pair **out = KNN_Pair_create_empty_table(rows, k);
+    if (!res || !out) {
+        KNN_Pair_destroy_table(res, rows);
+        KNN_Pair_destroy_table(out, rows);
+        return NULL;
+    }
+    for (int i = 0; i < rows; ++i) {
+        int filled = 0;
+        for (int j = 0; j < k + 1 && filled < k; ++j) {
+            if (res[i][j].index == i_offset + i || res[i][j].index < 0) continue;
+            out[i][filled++] = res[i][j];
+        }
+    }
+    KNN_Pair_destroy_table(res, rows);
+    return out;
+}
+
+/* knn_recall: compares approx against the exact lists of a random sample of rows */
+void knn_recall(matrix_t *data, struct KNN_Pair **approx, int k, int i_offset,
+                int samples, uint64_t seed, long *hits, long *total) {
+    int rows = matrix_get_rows(data);
+    *hits = 0;
+    *total = 0;
+    if (rows <= 1) return;
+    if (samples > rows) samples = rows;
+    matrix_t *queries = matrix_create(samples, matrix_get_cols(data));
+    int *picked = (int*) malloc(sizeof(int) * (samples > 0 ? samples : 1));
+    if (!queries || !picked) { matrix_destroy(queries); free(picked); return; }
+    uint64_t rng = seed;
+    for (int s = 0; s < samples; ++s) {
+        picked[s] = (int) rng_below(&rng, rows);
+        memcpy(queries->data[s], data->data[picked[s]], sizeof(double) * matrix_get_cols(data));
+    }
+    struct KNN_Pair **exact = knn_search(data, queries, k + 1, i_offset);
+    for (int s = 0; s < samples && exact; ++s) {
+        int self = i_offset + picked[s];
+        for (int j = 0, used = 0; j < k + 1 && used < k; ++j) {
+            if (exact[s][j].index == self || exact[s][j].index < 0) continue;
+            used++;
+            (*total)++;
+            for (int a = 0; a < k; ++a)
+                if (approx[picked[s]][a].index == exact[s][j].index) { (*hits)++; break; }
+        }
+    }
+    KNN_Pair_destroy_table(exact, samples);
+    matrix_destroy(queries);
+    free(picked);
+}
+
 /* knn_labeling: for each knn pair pick label from labels matrix if available (labels expected in column 0) */
 matrix_t *knn_labeling(struct KNN_Pair **knns, int points, int k,
                        matrix_t *previous, int *cur_indexes,
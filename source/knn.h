@@ -3,6 +3,9 @@
 
 #include "matrix.h"
 
+/* rows per tile in the symmetric self-join */
+#define KNN_SELF_TILE 64
+
 struct KNN_Pair {
     double distance;
     int index;
@@ -14,7 +17,40 @@ void KNN_Pair_destroy_table(struct KNN_Pair **table, int rows);
 int KNN_Pair_asc_comp(const void *a, const void *b);
 int KNN_Pair_asc_comp_by_index(const void *a, const void *b);
 
+/* insert into a list kept sorted by (distance, index); pairs that do not beat the tail are dropped */
+static inline void knn_push(struct KNN_Pair *list, int k, double dist, int index) {
+    struct KNN_Pair *last = &list[k-1];
+    if (dist > last->distance || (dist == last->distance && index > last->index)) return;
+    int j = k - 1;
+    while (j > 0 && (list[j-1].distance > dist ||
+                     (list[j-1].distance == dist && list[j-1].index > index))) {
+        list[j] = list[j-1];
+        --j;
+    }
+    list[j].distance = dist;
+    list[j].index = index;
+}
+
+static inline double knn_sq_dist(const double *a, const double *b, int dims) {
+    double dist = 0.0;
+    for (int c = 0; c < dims; ++c) {
+        double diff = a[c] - b[c];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
 struct KNN_Pair **knn_search(matrix_t *data, matrix_t *points, int k, int i_offset);
+struct KNN_Pair **knn_search_bounded(matrix_t *data, matrix_t *points, int k, int i_offset,
+                                     double bound);
+struct KNN_Pair **knn_search_self(matrix_t *data, int k, int i_offset);
+struct KNN_Pair **knn_search_self_scan(matrix_t *data, int k, int i_offset);
+
+void knn_set_self_tile(int rows);
+int knn_get_self_tile(void);
+
+void knn_recall(matrix_t *data, struct KNN_Pair **approx, int k, int i_offset,
+                int samples, uint64_t seed, long *hits, long *total);
 
 matrix_t *knn_labeling(struct KNN_Pair **knns, int points, int k,
                        matrix_t *previous, int *cur_indexes,
@@ -0,0 +1,135 @@
+#include "knn_eval.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+knn_eval_t *knn_eval_create(int k_max, int folds) {
+    if (k_max < 1 || folds < 1) return NULL;
+    knn_eval_t *ev = (knn_eval_t*) malloc(sizeof(knn_eval_t));
+    if (!ev) return NULL;
+    ev->k_max = k_max;
+    ev->folds = folds;
+    ev->plain = (long*) calloc((size_t) folds * k_max, sizeof(long));
+    ev->weighted = (long*) calloc((size_t) folds * k_max, sizeof(long));
+    ev->evaluated = (long*) calloc((size_t) folds * k_max, sizeof(long));
+    if (!ev->plain || !ev->weighted || !ev->evaluated) {
+        knn_eval_destroy(ev);
+        return NULL;
+    }
+    return ev;
+}
+
+void knn_eval_destroy(knn_eval_t *ev) {
+    if (!ev) return;
+    free(ev->plain);
+    free(ev->weighted);
+    free(ev->evaluated);
+    free(ev);
+}
+
+/* neighbours to search so that, once same-fold neighbours are dropped, about k_max remain */
+int knn_eval_search_k(int k_max, int folds) {
+    if (folds <= 1) return k_max;
+    return (k_max * folds + folds - 2) / (folds - 1) + 2;
+}
+
+/* knn_eval_accumulate: walks each neighbour list once, growing the vote as k' grows.
+ * With cross-validation a point's fold is its index % folds, and neighbours from the
+ * same fold are skipped since they would be in the held-out set. knns and labeled are
+ * parallel (points x k_search), truth holds the local labels in column 0.
+ */
+int knn_eval_accumulate(knn_eval_t *ev, struct KNN_Pair **knns, matrix_t *labeled,
+                        int k_search, matrix_t *truth, int i_offset) {
+    int points = matrix_get_rows(truth);
+    int k_max = ev->k_max, folds = ev->folds;
+    size_t cells = (size_t) folds * k_max;
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        long *plain = (long*) calloc(cells, sizeof(long));
+        long *weighted = (long*) calloc(cells, sizeof(long));
+        long *evaluated = (long*) calloc(cells, sizeof(long));
+        int ok = plain && weighted && evaluated;
+        if (!ok) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+
+        #pragma omp for schedule(static)
+        for (int p = 0; p < points; ++p) {
+            if (!ok) continue;
+            int counts[KNN_EVAL_LABELS] = {0};
+            double weights[KNN_EVAL_LABELS] = {0.0};
+            int best = 0, bestc = 0, wbest = 0;
+            double wbestv = 0.0;
+            int fold = (i_offset + p) % folds;
+            int expected = (int) matrix_get_cell(truth, p, 0);
+            long *row_plain = plain + (size_t) fold * k_max;
+            long *row_weighted = weighted + (size_t) fold * k_max;
+            long *row_evaluated = evaluated + (size_t) fold * k_max;
+
+            int used = 0;
+            for (int j = 0; j < k_search && used < k_max; ++j) {
+                if (knns[p][j].index < 0) break;
+                if (folds > 1 && knns[p][j].index % folds == fold) continue;
+                double v = matrix_get_cell(labeled, p, j);
+                if (!isnan(v)) {
+                    int lab = (int) v;
+                    if (lab >= 0 && lab < KNN_EVAL_LABELS) {
+                        /* only lab changed, so the winner is either the old one or lab;
+                         * ties go to the lowest label */
+                        counts[lab]++;
+                        if (counts[lab] > bestc || (counts[lab] == bestc && lab < best)) {
+                            best = lab;
+                            bestc = counts[lab];
+                        }
+                        weights[lab] += 1.0 / (knns[p][j].distance + KNN_EVAL_EPS);
+                        if (weights[lab] > wbestv || (weights[lab] == wbestv && lab < wbest)) {
+                            wbest = lab;
+                            wbestv = weights[lab];
+                        }
+                    }
+                }
+                row_evaluated[used]++;
+                if (best == expected) row_plain[used]++;
+                if (wbest == expected) row_weighted[used]++;
+                used++;
+            }
+        }
+
+        #pragma omp critical
+        if (ok) {
+            for (size_t c = 0; c < cells; ++c) {
+                ev->plain[c] += plain[c];
+                ev->weighted[c] += weighted[c];
+                ev->evaluated[c] += evaluated[c];
+            }
+        }
+        free(plain);
+        free(weighted);
+        free(evaluated);
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: knn_eval_accumulate: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* sums the counters of every rank into root */
+void knn_eval_reduce(knn_eval_t *ev, int root, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    int cells = ev->folds * ev->k_max;
+    if (rank == root) {
+        MPI_Reduce(MPI_IN_PLACE, ev->plain, cells, MPI_LONG, MPI_SUM, root, comm);
+        MPI_Reduce(MPI_IN_PLACE, ev->weighted, cells, MPI_LONG, MPI_SUM, root, comm);
+        MPI_Reduce(MPI_IN_PLACE, ev->evaluated, cells, MPI_LONG, MPI_SUM, root, comm);
+    } else {
+        MPI_Reduce(ev->plain, NULL, cells, MPI_LONG, MPI_SUM, root, comm);
+        MPI_Reduce(ev->weighted, NULL, cells, MPI_LONG, MPI_SUM, root, comm);
+        MPI_Reduce(ev->evaluated, NULL, cells, MPI_LONG, MPI_SUM, root, comm);
+    }
+}
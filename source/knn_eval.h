@@ -0,0 +1,33 @@
+#ifndef KNN_EVAL_H
+#define KNN_EVAL_H
+
+#include <mpi.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* labels are voted in [0, KNN_EVAL_LABELS), matching the classifier in main */
+#define KNN_EVAL_LABELS 256
+#define KNN_EVAL_EPS 1e-12
+
+/* Accuracy of every k' <= k_max from one search. Counters are laid out folds x k_max,
+ * entry [f * k_max + k' - 1]; folds == 1 evaluates the plain leave-one-out classifier.
+ */
+typedef struct knn_eval_t {
+    int k_max;
+    int folds;
+    long *plain;      /* correct majority votes */
+    long *weighted;   /* correct 1/distance votes */
+    long *evaluated;  /* points with at least k' usable neighbours */
+} knn_eval_t;
+
+knn_eval_t *knn_eval_create(int k_max, int folds);
+void knn_eval_destroy(knn_eval_t *ev);
+
+int knn_eval_search_k(int k_max, int folds);
+
+/* returns -1 (counters incomplete) when a thread could not allocate its counters */
+int knn_eval_accumulate(knn_eval_t *ev, struct KNN_Pair **knns, matrix_t *labeled,
+                        int k_search, matrix_t *truth, int i_offset);
+void knn_eval_reduce(knn_eval_t *ev, int root, MPI_Comm comm);
+
+#endif
@@ -0,0 +1,148 @@
+#include "knn_graph.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+size_t knn_graph_record_size(int k) {
+    size_t size = sizeof(double) * (k + 1) + sizeof(int32_t) * k;
+    return (size + 7) & ~(size_t) 7;
+}
+
+/* (row id, local row) pairs, sorted by id */
+static int cmp_id_pair(const void *a, const void *b) {
+    int32_t x = ((const int32_t*) a)[0], y = ((const int32_t*) b)[0];
+    return (x > y) - (x < y);
+}
+
+/* knn_graph_write: every rank writes the records of its rows with one collective MPI-IO call.
+ * Rows still in file order land at chunk_offset; repartitioned rows are scattered to their
+ * original ids through an indexed file view. knns indices refer to the rows of refs (the
+ * matrix that was searched, chunk_offset based) and are translated to original ids.
+ */
+int knn_graph_write(const char *filename, struct KNN_Pair **knns, matrix_t *predicted,
+                    matrix_t *data, matrix_t *refs, int k, MPI_Comm comm) {
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    int32_t rows = matrix_get_rows(data);
+    int32_t offset = matrix_get_chunk_offset(data);
+    int32_t total = 0;
+    MPI_Allreduce(&rows, &total, 1, MPI_INT32_T, MPI_SUM, comm);
+
+    size_t rs = knn_graph_record_size(k);
+    int32_t *order = (int32_t*) malloc(sizeof(int32_t) * 2 * (rows > 0 ? rows : 1));
+    char *buf = (char*) calloc(rows > 0 ? rows : 1, rs);
+    if (!order || !buf) { free(order); free(buf); return -1; }
+    for (int32_t i = 0; i < rows; ++i) {
+        order[2*i] = matrix_get_row_id(data, i);
+        order[2*i + 1] = i;
+    }
+    /* file views need ascending displacements */
+    if (data->row_ids) qsort(order, rows, sizeof(int32_t) * 2, cmp_id_pair);
+
+    for (int32_t r = 0; r < rows; ++r) {
+        int32_t i = order[2*r + 1];
+        char *rec = buf + (size_t) r * rs;
+        double *dist = (double*) rec;
+        int32_t *idx = (int32_t*) (rec + sizeof(double) * (k + 1));
+        for (int j = 0; j < k; ++j) {
+            int32_t local = knns[i][j].index - matrix_get_chunk_offset(refs);
+            dist[j] = knns[i][j].distance;
+            idx[j] = (knns[i][j].index >= 0 && local >= 0 && local < matrix_get_rows(refs))
+                   ? matrix_get_row_id(refs, local) : knns[i][j].index;
+        }
+        dist[k] = matrix_get_cell(predicted, i, 0);
+    }
+
+    MPI_File fh;
+    if (MPI_File_open(comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                      MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        if (rank == 0) fprintf(stderr, "ERROR: knn_graph_write: cannot open %s\n", filename);
+        free(order); free(buf);
+        return -1;
+    }
+    MPI_File_set_size(fh, (MPI_Offset) (KNN_GRAPH_HEADER + (size_t) total * rs));
+
+    if (rank == 0) {
+        char header[KNN_GRAPH_HEADER];
+        int32_t fields[3] = { KNN_GRAPH_VERSION, total, k };
+        memcpy(header, "KNNG", 4);
+        memcpy(header + 4, fields, sizeof(fields));
+        MPI_File_write_at(fh, 0, header, KNN_GRAPH_HEADER, MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    MPI_Datatype record;
+    MPI_Type_contiguous((int) rs, MPI_BYTE, &record);
+    MPI_Type_commit(&record);
+    int rc;
+    if (!data->row_ids) {
+        rc = MPI_File_write_at_all(fh, (MPI_Offset) (KNN_GRAPH_HEADER + (size_t) offset * rs),
+                                   buf, rows, record, MPI_STATUS_IGNORE);
+    } else {
+        int *displs = (int*) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+        for (int32_t r = 0; r < rows; ++r) displs[r] = order[2*r];
+        MPI_Datatype scattered;
+        MPI_Type_create_indexed_block(rows, 1, displs, record, &scattered);
+        MPI_Type_commit(&scattered);
+        MPI_File_set_view(fh, KNN_GRAPH_HEADER, record, scattered, "native", MPI_INFO_NULL);
+        rc = MPI_File_write_all(fh, buf, rows, record, MPI_STATUS_IGNORE);
+        MPI_Type_free(&scattered);
+        free(displs);
+    }
+    MPI_Type_free(&record);
+    MPI_File_close(&fh);
+    free(order);
+    free(buf);
+    return rc == MPI_SUCCESS ? 0 : -1;
+}
+
+/* knn_graph_open: maps a graph file read-only; records are read in place */
+knn_graph_t *knn_graph_open(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { fprintf(stderr, "ERROR: knn_graph_open: cannot open %s\n", filename); return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < KNN_GRAPH_HEADER) { close(fd); return NULL; }
+    char *map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    int32_t fields[3];
+    memcpy(fields, map + 4, sizeof(fields));
+    size_t rs = knn_graph_record_size(fields[2]);
+    if (memcmp(map, "KNNG", 4) != 0 || fields[0] != KNN_GRAPH_VERSION || fields[2] < 1 ||
+        (size_t) st.st_size < KNN_GRAPH_HEADER + (size_t) fields[1] * rs) {
+        fprintf(stderr, "ERROR: knn_graph_open: %s is not a valid graph file\n", filename);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    knn_graph_t *g = (knn_graph_t*) malloc(sizeof(knn_graph_t));
+    if (!g) { munmap(map, st.st_size); return NULL; }
+    g->points = fields[1];
+    g->k = fields[2];
+    g->record_size = rs;
+    g->length = st.st_size;
+    g->map = map;
+    return g;
+}
+
+void knn_graph_close(knn_graph_t *g) {
+    if (!g) return;
+    munmap(g->map, g->length);
+    free(g);
+}
+
+double knn_graph_label(knn_graph_t *g, int32_t point) {
+    const double *rec = (const double*) (g->map + KNN_GRAPH_HEADER + (size_t) point * g->record_size);
+    return rec[g->k];
+}
+
+int32_t knn_graph_neighbor(knn_graph_t *g, int32_t point, int32_t j, double *distance) {
+    if (point < 0 || point >= g->points || j < 0 || j >= g->k) return -1;
+    const char *rec = g->map + KNN_GRAPH_HEADER + (size_t) point * g->record_size;
+    if (distance) *distance = ((const double*) rec)[j];
+    return ((const int32_t*) (rec + sizeof(double) * (g->k + 1)))[j];
+}
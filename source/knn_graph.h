@@ -0,0 +1,38 @@
+#ifndef KNN_GRAPH_H
+#define KNN_GRAPH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mpi.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* Binary all-kNN graph file:
+ *   header: "KNNG", int32 version, int32 points, int32 k
+ *   one record per original row id: double distance[k], double label, int32 index[k]
+ *   (records padded to 8 bytes). Neighbour indices are original global row ids.
+ */
+#define KNN_GRAPH_VERSION 1
+#define KNN_GRAPH_HEADER 16
+
+typedef struct knn_graph_t {
+    int32_t points;
+    int32_t k;
+    size_t record_size;
+    size_t length;
+    char *map;
+} knn_graph_t;
+
+size_t knn_graph_record_size(int k);
+
+int knn_graph_write(const char *filename, struct KNN_Pair **knns, matrix_t *predicted,
+                    matrix_t *data, matrix_t *refs, int k, MPI_Comm comm);
+
+knn_graph_t *knn_graph_open(const char *filename);
+void knn_graph_close(knn_graph_t *g);
+
+double knn_graph_label(knn_graph_t *g, int32_t point);
+/* -1 when point or j lies outside the graph */
+int32_t knn_graph_neighbor(knn_graph_t *g, int32_t point, int32_t j, double *distance);
+
+#endif
@@ -0,0 +1,104 @@
+#include "knn_kernels.h"
+#include <stdlib.h>
+#include <math.h>
+
+/* Kernels specialised at compile time for dims in 2..16 and k in {1,3,5,7,10,16,32}.
+ * Every wrapper below inlines knn_kernel_point with constant D and K, so the distance
+ * loop is fully unrolled and the top-k list lives in locals (registers for small k).
+ * The list is kept sorted with a fixed compare-swap pass instead of qsort.
+ */
+
+#define KNN_KERNEL_DIMS(X, K) \
+    X(2, K) X(3, K) X(4, K) X(5, K) X(6, K) X(7, K) X(8, K) X(9, K) \
+    X(10, K) X(11, K) X(12, K) X(13, K) X(14, K) X(15, K) X(16, K)
+
+#define KNN_KERNEL_ALL(X) \
+    KNN_KERNEL_DIMS(X, 1) KNN_KERNEL_DIMS(X, 3) KNN_KERNEL_DIMS(X, 5) \
+    KNN_KERNEL_DIMS(X, 7) KNN_KERNEL_DIMS(X, 10) KNN_KERNEL_DIMS(X, 16) \
+    KNN_KERNEL_DIMS(X, 32)
+
+static inline __attribute__((always_inline))
+void knn_kernel_point(matrix_t *data, const double *point, struct KNN_Pair *result,
+                      int i_offset, const int D, const int K) {
+    int data_rows = matrix_get_rows(data);
+    double q[KNN_KERNEL_MAX_D];
+    double best_d[KNN_KERNEL_MAX_K];
+    int best_i[KNN_KERNEL_MAX_K];
+
+    #pragma GCC unroll 16
+    for (int c = 0; c < D; ++c) q[c] = point[c];
+    /* compare squared distances; the list may already hold candidates */
+    #pragma GCC unroll 32
+    for (int j = 0; j < K; ++j) {
+        best_d[j] = result[j].distance * result[j].distance;
+        best_i[j] = result[j].index;
+    }
+
+    for (int d = 0; d < data_rows; ++d) {
+        const double *row = data->data[d];
+        double dist = 0.0;
+        #pragma GCC unroll 16
+        for (int c = 0; c < D; ++c) {
+            double diff = q[c] - row[c];
+            dist += diff * diff;
+        }
+        if (dist < best_d[K-1]) {
+            best_d[K-1] = dist;
+            best_i[K-1] = i_offset + d;
+            /* sift the new entry down; strict < keeps equal distances in scan order */
+            #pragma GCC unroll 32
+            for (int j = K - 1; j > 0; --j) {
+                double lo = best_d[j-1], hi = best_d[j];
+                int lo_i = best_i[j-1], hi_i = best_i[j];
+                int swap = hi < lo;
+                best_d[j-1] = swap ? hi : lo;
+                best_d[j] = swap ? lo : hi;
+                best_i[j-1] = swap ? hi_i : lo_i;
+                best_i[j] = swap ? lo_i : hi_i;
+            }
+        }
+    }
+
+    #pragma GCC unroll 32
+    for (int j = 0; j < K; ++j) {
+        if (best_i[j] == -1) continue;
+        result[j].distance = sqrt(best_d[j]);
+        result[j].index = best_i[j];
+    }
+}
+
+#define KNN_KERNEL_DEFINE(D, K) \
+    static void knn_kernel_##D##_##K(matrix_t *data, matrix_t *points, \
+                                     struct KNN_Pair **results, int i_offset) { \
+        int P = matrix_get_rows(points); \
+        _Pragma("omp parallel for schedule(static)") \
+        for (int p = 0; p < P; ++p) \
+            knn_kernel_point(data, points->data[p], results[p], i_offset, D, K); \
+    }
+
+KNN_KERNEL_ALL(KNN_KERNEL_DEFINE)
+
+#define KNN_KERNEL_ENTRY(D, K) { D, K, knn_kernel_##D##_##K },
+
+static const struct {
+    int dims;
+    int k;
+    knn_kernel_fn fn;
+} knn_kernels[] = {
+    KNN_KERNEL_ALL(KNN_KERNEL_ENTRY)
+};
+
+/* lets the autotuner compare against the generic loop */
+static int knn_kernels_enabled = 1;
+
+void knn_kernels_enable(int on) {
+    knn_kernels_enabled = on;
+}
+
+knn_kernel_fn knn_kernel_lookup(int dims, int k) {
+    if (!knn_kernels_enabled) return NULL;
+    int n = (int) (sizeof(knn_kernels) / sizeof(knn_kernels[0]));
+    for (int i = 0; i < n; ++i)
+        if (knn_kernels[i].dims == dims && knn_kernels[i].k == k) return knn_kernels[i].fn;
+    return NULL;
+}
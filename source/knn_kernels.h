@@ -0,0 +1,21 @@
+#ifndef KNN_KERNELS_H
+#define KNN_KERNELS_H
+
+#include "matrix.h"
+#include "knn.h"
+
+/* largest dims / k covered by the specialised kernels */
+#define KNN_KERNEL_MAX_D 16
+#define KNN_KERNEL_MAX_K 32
+
+/* fills an already initialised results table (P x k) for points against data */
+typedef void (*knn_kernel_fn)(matrix_t *data, matrix_t *points,
+                              struct KNN_Pair **results, int i_offset);
+
+/* returns the kernel specialised for (dims, k), or NULL if there is none */
+knn_kernel_fn knn_kernel_lookup(int dims, int k);
+
+/* on = 0 makes every lookup fall back to the generic search loop */
+void knn_kernels_enable(int on);
+
+#endif
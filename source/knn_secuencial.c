@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include "matrix.h"
+#include "metric.h"
 
 #define MAX_POINTS 10000000
 #define DIM 6   // 6 características
@@ -22,20 +24,16 @@ int compare_neighbors(const void *a, const void *b) {
     return (na->distance > nb->distance) - (na->distance < nb->distance);
 }
 
-// Distancia euclidiana en 6 dimensiones
-double distance(double q[], double p[]) {
-    double sum = 0.0;
-    for (int i = 0; i < DIM; i++) {
-        double diff = q[i] - p[i];
-        sum += diff * diff;
-    }
-    return sqrt(sum);
-}
-
 int main(int argc, char *argv[]) {
 
-    if (argc != 8) {
-        printf("Uso: ./knn_secuencial edad estatura peso glucosa frecuencia oxigeno k\n");
+    if (argc != 8 && argc != 9) {
+        printf("Uso: ./knn_secuencial edad estatura peso glucosa frecuencia oxigeno k [euclid|cosine|ip|wl2]\n");
+        return 1;
+    }
+
+    metric_kind_t kind = METRIC_EUCLIDEAN;
+    if (argc == 9 && metric_parse(argv[8], &kind) != 0) {
+        printf("ERROR: métrica desconocida %s\n", argv[8]);
         return 1;
     }
 
@@ -82,11 +80,21 @@ int main(int argc, char *argv[]) {
 
     Neighbor *neighbors = malloc(sizeof(Neighbor) * count);
 
-    // Calcular distancias
+    // Calcular distancias (normas y pesos de la métrica se precalculan una vez)
+    matrix_t *features = matrix_create(count, DIM);
+    for (int i = 0; i < count; i++)
+        for (int c = 0; c < DIM; c++)
+            matrix_set_cell(features, i, c, dataset[i].features[c]);
+    metric_t *metric = metric_create(kind, features, NULL, NULL);
+    double *dist = malloc(sizeof(double) * count);
+    metric_distances(metric, features, query, dist);
     for (int i = 0; i < count; i++) {
         neighbors[i].index = i;
-        neighbors[i].distance = distance(query, dataset[i].features);
+        neighbors[i].distance = dist[i];
     }
+    free(dist);
+    metric_destroy(metric);
+    matrix_destroy(features);
 
     // Ordenar por distancia
     qsort(neighbors, count, sizeof(Neighbor), compare_neighbors);
@@ -95,7 +103,7 @@ int main(int argc, char *argv[]) {
     printf("\nPunto ingresado:\n");
     for (int i = 0; i < DIM; i++)
         printf("%.3f ", query[i]);
-    printf("\nk = %d\n\n", k);
+    printf("\nk = %d, métrica = %s\n\n", k, metric_name(kind));
 
     printf("Vecinos más cercanos:\n");
     for (int i = 0; i < k; i++) {
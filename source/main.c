@@ -9,6 +9,18 @@
 #include "matrix.h"
 #include "knn.h"
 #include "distributed_knn.h"
+#include "partition.h"
+#include "codec.h"
+#include "knn_graph.h"
+#include "shared_matrix.h"
+#include "nn_descent.h"
+#include "ivfpq.h"
+#include "knn_eval.h"
+#include "dedup.h"
+#include "autotune.h"
+#include "metric.h"
+#include "sketch.h"
+#include "hier_comm.h"
 
 #define MPI_MASTER 0
 
@@ -18,20 +30,165 @@ double get_elapsed_time(struct timeval start, struct timeval stop) {
     return elapsed_time;
 }
 
+/* barrier over the node/leader communicators when they are in use */
+static void sync_all(hier_comm_t *hc) {
+    if (hc) hier_barrier(hc);
+    else MPI_Barrier(MPI_COMM_WORLD);
+}
+
+/* reductions to the master (or to every rank) over the node/leader communicators when they
+ * are in use; op must be commutative */
+static void reduce_master(hier_comm_t *hc, const void *send, void *recv, int count,
+                          MPI_Datatype type, MPI_Op op) {
+    if (hc) hier_reduce(hc, send, recv, count, type, op);
+    else MPI_Reduce(send, recv, count, type, op, MPI_MASTER, MPI_COMM_WORLD);
+}
+
+static void allreduce_all(hier_comm_t *hc, const void *send, void *recv, int count,
+                          MPI_Datatype type, MPI_Op op) {
+    if (hc) hier_allreduce(hc, send, recv, count, type, op);
+    else MPI_Allreduce(send, recv, count, type, op, MPI_COMM_WORLD);
+}
+
 int main(int argc, char *argv[]) {
 
     if (argc < 3) {
-        printf("Uso: %s <dataset_file> <k>\n", argv[0]);
+        printf("Uso: %s <dataset_file> <k> [--repartition] [--reorder] [--compress | --compress-f16 <max_err>] [--shared] [--nndescent <delta>] [--ivfpq <nlist,m,nprobe[,train[,rerank]]>] [--eval-sweep] [--cv <folds>] [--dedup] [--autotune [perfil]] [--hier] [--sparse] [--metric <euclid|cosine|ip|wl2>] [--weights <w1,...,wd>] [--sketch <s,c[,seed]>] [--save-graph <file>] [--load-graph <file>]\n", argv[0]);
         return -1;
     }
 
     char *dataset_fn = argv[1];
     int k = atoi(argv[2]);
+    int repartition = 0;
+    int reorder = 0;
+    int shared = 0;
+    int codec_mode = CODEC_RAW;
+    double codec_max_err = 0.0;
+    double nnd_delta = -1.0;
+    int use_ivfpq = 0;
+    ivfpq_params_t pq_params;
+    ivfpq_default_params(&pq_params);
+    int eval_sweep = 0;
+    int use_dedup = 0;
+    int autotune = 0;
+    int hier = 0;
+    int sparse = 0;
+    metric_kind_t metric_kind = METRIC_EUCLIDEAN;
+    char *weights_arg = NULL;
+    int sketch_dims = 0, sketch_factor = 0;
+    unsigned long long sketch_seed = 4242;
+    char *autotune_fn = NULL;
+    int cv_folds = 1;
+    char *save_graph_fn = NULL;
+    char *load_graph_fn = NULL;
+
+    for (int a = 3; a < argc; ++a) {
+        if (strcmp(argv[a], "--repartition") == 0) {
+            repartition = 1;
+        } else if (strcmp(argv[a], "--reorder") == 0) {
+            reorder = 1;
+        } else if (strcmp(argv[a], "--compress") == 0) {
+            codec_mode = CODEC_LOSSLESS;
+        } else if (strcmp(argv[a], "--compress-f16") == 0 && a + 1 < argc) {
+            codec_mode = CODEC_FLOAT16;
+            codec_max_err = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--shared") == 0) {
+            shared = 1;
+        } else if (strcmp(argv[a], "--nndescent") == 0 && a + 1 < argc) {
+            nnd_delta = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--ivfpq") == 0 && a + 1 < argc) {
+            use_ivfpq = 1;
+            if (sscanf(argv[++a], "%d,%d,%d,%d,%d", &pq_params.nlist, &pq_params.m,
+                       &pq_params.nprobe, &pq_params.train_size, &pq_params.rerank) < 3) {
+                fprintf(stderr, "ERROR: --ivfpq espera nlist,m,nprobe[,train[,rerank]]\n");
+                return -1;
+            }
+        } else if (strcmp(argv[a], "--sparse") == 0) {
+            sparse = 1;
+        } else if (strcmp(argv[a], "--metric") == 0 && a + 1 < argc) {
+            if (metric_parse(argv[++a], &metric_kind) != 0) {
+                fprintf(stderr, "ERROR: --metric espera euclid, cosine, ip o wl2\n");
+                return -1;
+            }
+        } else if (strcmp(argv[a], "--weights") == 0 && a + 1 < argc) {
+            weights_arg = argv[++a];
+        } else if (strcmp(argv[a], "--sketch") == 0 && a + 1 < argc) {
+            if (sscanf(argv[++a], "%d,%d,%llu", &sketch_dims, &sketch_factor, &sketch_seed) < 2 ||
+                sketch_dims < 1 || sketch_factor < 1) {
+                fprintf(stderr, "ERROR: --sketch espera s,c[,semilla] (dimensiones del sketch, factor de la lista corta y semilla de la proyección)\n");
+                return -1;
+            }
+        } else if (strcmp(argv[a], "--hier") == 0) {
+            hier = 1;
+        } else if (strcmp(argv[a], "--autotune") == 0) {
+            autotune = 1;
+            if (a + 1 < argc && strncmp(argv[a+1], "--", 2) != 0) autotune_fn = argv[++a];
+        } else if (strcmp(argv[a], "--dedup") == 0) {
+            use_dedup = 1;
+        } else if (strcmp(argv[a], "--eval-sweep") == 0) {
+            eval_sweep = 1;
+        } else if (strcmp(argv[a], "--cv") == 0 && a + 1 < argc) {
+            eval_sweep = 1;
+            cv_folds = atoi(argv[++a]);
+            if (cv_folds < 2) {
+                fprintf(stderr, "ERROR: --cv necesita al menos 2 folds\n");
+                return -1;
+            }
+        } else if (strcmp(argv[a], "--save-graph") == 0 && a + 1 < argc) {
+            save_graph_fn = argv[++a];
+        } else if (strcmp(argv[a], "--load-graph") == 0 && a + 1 < argc) {
+            load_graph_fn = argv[++a];
+        } else {
+            fprintf(stderr, "ERROR: opción desconocida %s\n", argv[a]);
+            return -1;
+        }
+    }
 
     if (k <= 0) {
         fprintf(stderr, "ERROR: k debe ser > 0\n");
         return -1;
     }
+    if (eval_sweep && load_graph_fn) {
+        fprintf(stderr, "ERROR: --eval-sweep/--cv necesitan la búsqueda, no se pueden usar con --load-graph\n");
+        return -1;
+    }
+    if (codec_mode != CODEC_RAW && !repartition) {
+        fprintf(stderr, "ERROR: --compress/--compress-f16 solo comprimen las filas de --repartition\n");
+        return -1;
+    }
+    if (shared && nnd_delta >= 0.0) {
+        fprintf(stderr, "ERROR: --nndescent no se combina con --shared\n");
+        return -1;
+    }
+    if (use_dedup && (shared || nnd_delta >= 0.0 || use_ivfpq)) {
+        fprintf(stderr, "ERROR: --dedup solo se aplica a la búsqueda exacta sin --shared\n");
+        return -1;
+    }
+    if (autotune && (shared || nnd_delta >= 0.0 || use_ivfpq || use_dedup || load_graph_fn)) {
+        fprintf(stderr, "ERROR: --autotune solo ajusta la búsqueda exacta distribuida\n");
+        return -1;
+    }
+    if (sparse && (repartition || reorder || shared || nnd_delta >= 0.0 || use_ivfpq || use_dedup ||
+                   autotune || save_graph_fn || load_graph_fn)) {
+        fprintf(stderr, "ERROR: --sparse solo admite la búsqueda exacta, --eval-sweep/--cv y --hier\n");
+        return -1;
+    }
+    if (weights_arg && metric_kind != METRIC_WEIGHTED_L2) {
+        fprintf(stderr, "ERROR: --weights solo se aplica a --metric wl2\n");
+        return -1;
+    }
+    if (metric_kind != METRIC_EUCLIDEAN &&
+        (shared || nnd_delta >= 0.0 || use_ivfpq || use_dedup || autotune || sparse || load_graph_fn)) {
+        fprintf(stderr, "ERROR: --metric solo se aplica a la búsqueda exacta densa\n");
+        return -1;
+    }
+    if (sketch_dims > 0 && (shared || nnd_delta >= 0.0 || use_ivfpq || use_dedup || autotune || sparse ||
+                            metric_kind != METRIC_EUCLIDEAN || load_graph_fn)) {
+        fprintf(stderr, "ERROR: --sketch reemplaza la búsqueda exacta densa euclidiana; no se combina con otros motores\n");
+        return -1;
+    }
+    /* en modo evaluación se busca una vez con k_max (más margen si hay folds) */
+    int k_search = eval_sweep ? knn_eval_search_k(k, cv_folds) : k;
 
     int tasks_num = 1;
     int rank = 0;
@@ -40,6 +197,8 @@ int main(int argc, char *argv[]) {
     MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
+    hier_comm_t *hc = hier ? hier_comm_create(MPI_COMM_WORLD) : NULL;
+
     int next_task = (rank + 1) % tasks_num;
     int prev_task = (rank == 0 ? tasks_num - 1 : rank - 1);
     
@@ -54,74 +213,487 @@ int main(int argc, char *argv[]) {
     // LOAD DATA + LABELS desde un solo archivo
     matrix_t *initial_data = NULL;
     matrix_t *labels = NULL;
+    sparse_t *sparse_data = NULL;
 
-    if (matrix_load_split_txt(dataset_fn, tasks_num, rank, &initial_data, &labels) != 0) {
+    if (sparse) {
+        // formato libsvm: "etiqueta índice:valor ..." en CSR
+        if (sparse_load_split_libsvm(dataset_fn, tasks_num, rank, &sparse_data, &labels) != 0) {
+            fprintf(stderr, "ERROR: rank %d no pudo cargar %s\n", rank, dataset_fn);
+            MPI_Finalize();
+            return -1;
+        }
+        double mem[3] = { (double) sparse_memory(sparse_data),
+                          (double) sparse_data->rows * sparse_data->cols * sizeof(double),
+                          (double) sparse_data->nnz };
+        double mem_total[3];
+        reduce_master(hc, mem, mem_total, 3, MPI_DOUBLE, MPI_SUM);
+        if (rank == MPI_MASTER) {
+            printf("Datos dispersos: %d columnas, %.0f no ceros (%.3f%%), %.2f MB en CSR frente a %.2f MB densos\n",
+                   sparse_data->cols, mem_total[2],
+                   mem_total[1] > 0 ? 100.0 * mem_total[2] * sizeof(double) / mem_total[1] : 0.0,
+                   mem_total[0] / 1e6, mem_total[1] / 1e6);
+        }
+    } else if (matrix_load_split_txt(dataset_fn, tasks_num, rank, &initial_data, &labels) != 0) {
         fprintf(stderr, "ERROR: rank %d no pudo cargar %s\n", rank, dataset_fn);
         MPI_Finalize();
         return -1;
     }
 
-    // KNN SEARCH
-    struct timeval t0, t1;
-    MPI_Barrier(MPI_COMM_WORLD);
-    gettimeofday(&t0, NULL);
+    // REPARTICIÓN ESPACIAL (opcional)
+    if (repartition) {
+        struct timeval r0, r1;
+        gettimeofday(&r0, NULL);
+        if (partition_redistribute_spatial(&initial_data, &labels, matrix_get_cols(initial_data),
+                                           codec_mode, codec_max_err, MPI_COMM_WORLD) != 0) {
+            fprintf(stderr, "ERROR: rank %d no pudo redistribuir los datos\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        partition_t *bounds = partition_gather_bounds(initial_data,
+                                                      matrix_get_cols(initial_data), MPI_COMM_WORLD);
+        gettimeofday(&r1, NULL);
+        codec_stats_t cs = codec_get_stats();
+        double cs_local[4] = { (double) cs.raw_bytes, (double) cs.wire_bytes,
+                               cs.encode_seconds, cs.decode_seconds };
+        double cs_total[4];
+        reduce_master(hc, cs_local, cs_total, 4, MPI_DOUBLE, MPI_SUM);
+        if (rank == MPI_MASTER && bounds) {
+            printf("Repartición espacial (Morton) tomó %.6f segundos\n", get_elapsed_time(r0, r1));
+            if (codec_mode != CODEC_RAW) {
+                printf("  compresión: %.0f -> %.0f bytes (%.1f%% ahorrado), codificar %.6f s, decodificar %.6f s\n",
+                       cs_total[0], cs_total[1],
+                       cs_total[0] > 0 ? 100.0 * (1.0 - cs_total[1] / cs_total[0]) : 0.0,
+                       cs_total[2], cs_total[3]);
+            }
+            for (int p = 0; p < bounds->parts; ++p) {
+                printf("  rank %d: %d filas, caja [", p, bounds->rows[p]);
+                for (int c = 0; c < bounds->dims; ++c)
+                    printf("%s%.1f..%.1f", c ? ", " : "",
+                           bounds->lo[p * bounds->dims + c], bounds->hi[p * bounds->dims + c]);
+                printf("]\n");
+            }
+            printf("\n");
+        }
+        partition_destroy(bounds);
+    }
 
-    struct KNN_Pair **results =
-        knn_search_distributed(initial_data, k, prev_task, next_task, tasks_num);
+    // REORDENAMIENTO LOCAL (opcional): filas y etiquetas en orden de la curva de Morton
+    if (reorder) {
+        double o0 = MPI_Wtime();
+        if (partition_reorder_local(&initial_data, &labels, matrix_get_cols(initial_data)) != 0) {
+            fprintf(stderr, "ERROR: rank %d no pudo reordenar sus filas\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        double reorder_time = MPI_Wtime() - o0, max_time = 0.0;
+        reduce_master(hc, &reorder_time, &max_time, 1, MPI_DOUBLE, MPI_MAX);
+        if (rank == MPI_MASTER)
+            printf("Reordenamiento local (Morton) tomó %.6f segundos\n", max_time);
+    }
 
-    MPI_Barrier(MPI_COMM_WORLD);
-    gettimeofday(&t1, NULL);
+    // DEDUPLICACIÓN (opcional): filas idénticas colapsadas al cargar, antes de la búsqueda
+    dedup_t *dd = NULL;
+    if (use_dedup && !load_graph_fn) {
+        double d0 = MPI_Wtime();
+        dd = dedup_create(initial_data, labels);
+        if (!dd) {
+            fprintf(stderr, "ERROR: rank %d no pudo deduplicar sus filas\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        int dedup_rows[2] = { dd->rows, dd->uniques }, totals[2] = {0, 0};
+        allreduce_all(hc, dedup_rows, totals, 2, MPI_INT, MPI_SUM);
+        if (totals[1] * DEDUP_MIN_RATIO > totals[0]) {
+            /* pocos duplicados: la búsqueda simétrica normal es más barata (decidido en
+             * conjunto, porque esa búsqueda es colectiva) */
+            dedup_destroy(dd);
+            dd = NULL;
+        }
+        double dedup_time = MPI_Wtime() - d0, max_time = 0.0;
+        reduce_master(hc, &dedup_time, &max_time, 1, MPI_DOUBLE, MPI_MAX);
+        if (rank == MPI_MASTER) {
+            printf("Deduplicación: %d puntos únicos de %d filas (ratio %.2fx), %.6f segundos\n",
+                   totals[1], totals[0], totals[1] ? (double) totals[0] / totals[1] : 0.0, max_time);
+        }
+    }
 
-    if (rank == MPI_MASTER) {
-        printf("KNN search (%d procesos) tomó %.6f segundos\n",
-               tasks_num, get_elapsed_time(t0, t1));
+    // AUTOAJUSTE (opcional): motor, tamaño de bloque, kernels e hilos, cacheado en un perfil
+    autotune_config_t tuned = { AUTOTUNE_ENGINE_SELF, KNN_SELF_TILE, 1, 1, 0.0 };
+    if (autotune) {
+        int cached = 0;
+        double a0 = MPI_Wtime();
+        autotune_run(initial_data, k_search, autotune_fn, &tuned, &cached, MPI_COMM_WORLD);
+        if (rank == MPI_MASTER) {
+            printf("Autoajuste (%s, %.6f segundos): motor %s, bloque %d, kernels %s, %d hilos\n",
+                   cached ? "perfil" : "medido", MPI_Wtime() - a0,
+                   tuned.engine == AUTOTUNE_ENGINE_SCAN ? "scan" : "self-join",
+                   tuned.tile, tuned.kernels ? "sí" : "no", tuned.threads);
+        }
+    }
+
+    // MÉTRICA (opcional): normas por fila o pesos por columna, precalculados una sola vez
+    metric_t *metric = NULL;
+    if (metric_kind != METRIC_EUCLIDEAN) {
+        double m0 = MPI_Wtime();
+        int dims = matrix_get_cols(initial_data);
+        double *moments = NULL, *weights = NULL;
+        if (weights_arg) {
+            /* pesos del usuario en lugar de la inversa de la varianza */
+            weights = (double*) malloc(sizeof(double) * dims);
+            if (!weights) {
+                fprintf(stderr, "ERROR: rank %d sin memoria para los pesos\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            if (metric_parse_weights(weights_arg, dims, weights) != 0) {
+                /* todos los procesos leen la misma lista y salen juntos */
+                if (rank == MPI_MASTER)
+                    fprintf(stderr, "ERROR: --weights espera %d pesos no negativos separados por comas\n", dims);
+                MPI_Finalize();
+                return -1;
+            }
+        } else if (metric_kind == METRIC_WEIGHTED_L2) {
+            /* varianzas globales, para que todos los procesos usen los mismos pesos */
+            moments = (double*) malloc(sizeof(double) * (1 + 2 * dims));
+            metric_moments(initial_data, dims, moments);
+            allreduce_all(hc, MPI_IN_PLACE, moments, 1 + 2 * dims, MPI_DOUBLE, MPI_SUM);
+        }
+        metric = metric_create(metric_kind, initial_data, moments, weights);
+        free(moments);
+        free(weights);
+        if (!metric) {
+            fprintf(stderr, "ERROR: rank %d no pudo preparar la métrica %s\n",
+                    rank, metric_name(metric_kind));
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        double metric_time = MPI_Wtime() - m0, max_time = 0.0;
+        reduce_master(hc, &metric_time, &max_time, 1, MPI_DOUBLE, MPI_MAX);
+        if (rank == MPI_MASTER)
+            printf("Métrica %s preparada en %.6f segundos\n", metric_name(metric_kind), max_time);
     }
 
-    // LABELING
-    matrix_t *labeled =
-        knn_labeling_distributed(results,
-                                 matrix_get_rows(initial_data),
-                                 k, labels,
-                                 prev_task, next_task, tasks_num);
+    // SKETCH (opcional): proyección aleatoria de las filas, con la misma semilla en todos los procesos
+    sketch_t *sketch = NULL;
+    double sketch_build_time = 0.0;
+    if (sketch_dims > 0) {
+        double s0 = MPI_Wtime();
+        sketch = sketch_build(initial_data, sketch_dims, (uint64_t) sketch_seed);
+        if (!sketch) {
+            fprintf(stderr, "ERROR: rank %d no pudo construir el sketch\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        sketch_build_time = MPI_Wtime() - s0;
+    }
 
-    KNN_Pair_destroy_table(results, matrix_get_rows(initial_data));
+    // MEMORIA COMPARTIDA POR NODO (opcional): las filas del nodo se leen en el sitio, sin copias entre procesos
+    MPI_Comm node_comm = MPI_COMM_NULL;
+    shared_matrix_t *shared_data = NULL;
+    shared_matrix_t *shared_labels = NULL;
+    if (shared) {
+        node_comm = shared_node_comm(MPI_COMM_WORLD);
+        shared_data = shared_matrix_from(initial_data, node_comm);
+        shared_labels = shared_matrix_from(labels, node_comm);
+        if (!shared_data || !shared_labels) {
+            fprintf(stderr, "ERROR: rank %d no pudo crear la ventana compartida\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        initial_data = shared_data->local;
+        labels = shared_labels->local;
+        int node_size = 1;
+        MPI_Comm_size(node_comm, &node_size);
+        if (rank == MPI_MASTER) {
+            int node_rows = matrix_get_rows(shared_data->node);
+            printf("Memoria compartida: %d procesos en el nodo, %d filas (%.2f MB) visibles sin copias\n\n",
+                   node_size, node_rows,
+                   node_rows * (matrix_get_cols(shared_data->node) + 1) * sizeof(double) / 1e6);
+        }
+    }
 
-    // CLASSIFY
-    MPI_Barrier(MPI_COMM_WORLD);
-    gettimeofday(&t0, NULL);
+    struct timeval t0, t1;
+    matrix_t *labeled = NULL;
+    matrix_t *classified = NULL;
+    int local_points = sparse ? sparse_data->rows : matrix_get_rows(initial_data);
 
-    int local_points = matrix_get_rows(labeled);
-    matrix_t *classified = matrix_create(local_points, 1);
+    if (load_graph_fn) {
+        // GRAFO KNN PERSISTIDO: reutiliza las etiquetas predichas sin recalcular la búsqueda
+        sync_all(hc);
+        gettimeofday(&t0, NULL);
+        knn_graph_t *graph = knn_graph_open(load_graph_fn);
+        int total_rows = 0;
+        allreduce_all(hc, &local_points, &total_rows, 1, MPI_INT, MPI_SUM);
+        if (!graph || graph->points != total_rows) {
+            fprintf(stderr, "ERROR: rank %d: %s no corresponde al dataset\n", rank, load_graph_fn);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if (graph->k != k) {
+            fprintf(stderr, "ERROR: rank %d: %s se guardó con k=%d, no con k=%d\n",
+                    rank, load_graph_fn, graph->k, k);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        classified = matrix_create(local_points, 1);
+        for (int i = 0; i < local_points; i++)
+            matrix_set_cell(classified, i, 0,
+                            knn_graph_label(graph, matrix_get_row_id(initial_data, i)));
+        knn_graph_close(graph);
+        sync_all(hc);
+        gettimeofday(&t1, NULL);
+        if (rank == MPI_MASTER) {
+            printf("Grafo KNN cargado de %s en %.6f segundos\n",
+                   load_graph_fn, get_elapsed_time(t0, t1));
+        }
+    } else {
+        // KNN SEARCH
+        sync_all(hc);
+        gettimeofday(&t0, NULL);
 
-    #pragma omp parallel for schedule(static)
-    for (int i = 0; i < local_points; i++) {
-        int label_counts[256] = {0};  
+        struct KNN_Pair **results = NULL;
+        int nnd_iters = 0;
+        ivfpq_t *pq_index = NULL;
+        double pq_build_time = 0.0;
+        if (shared)
+            results = knn_search_shared(shared_data, k_search);
+        else if (nnd_delta >= 0.0)
+            results = nn_descent(initial_data, k_search, matrix_get_chunk_offset(initial_data),
+                                 nnd_delta, 12345, &nnd_iters, MPI_COMM_WORLD);
+        else if (use_ivfpq) {
+            double b0 = MPI_Wtime();
+            pq_params.seed += rank;
+            pq_index = ivfpq_build(initial_data, &pq_params);
+            pq_build_time = MPI_Wtime() - b0;
+            if (pq_index)
+                results = ivfpq_search_self(pq_index, k_search, matrix_get_chunk_offset(initial_data),
+                                            pq_params.nprobe, pq_params.rerank);
+        }
+        else if (dd) {
+            /* búsqueda sobre los puntos únicos, con multiplicidad */
+            if (dedup_search(dd, k_search) != 0) {
+                fprintf(stderr, "ERROR: rank %d no pudo deduplicar sus filas\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            results = dedup_expand(dd, matrix_get_chunk_offset(initial_data));
+            if (!results) {
+                fprintf(stderr, "ERROR: rank %d no pudo expandir los vecinos deduplicados\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (sparse) {
+            results = knn_search_distributed_sparse(sparse_data, k_search, prev_task, next_task, tasks_num);
+            if (!results) {
+                fprintf(stderr, "ERROR: rank %d: la búsqueda dispersa falló\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        else if (sketch)
+            results = sketch_search_self(sketch, k_search, matrix_get_chunk_offset(initial_data), sketch_factor);
+        else if (metric)
+            results = metric_search_self(metric, initial_data, k_search, matrix_get_chunk_offset(initial_data));
+        else if (autotune && tuned.engine == AUTOTUNE_ENGINE_SCAN)
+            results = knn_search_self_scan(initial_data, k_search, matrix_get_chunk_offset(initial_data));
+        else
+            results = knn_search_distributed(initial_data, k_search, prev_task, next_task, tasks_num);
+
+        sync_all(hc);
+        gettimeofday(&t1, NULL);
 
-        for (int j = 0; j < k; j++) {
-            double v = matrix_get_cell(labeled, i, j);
-            if (!isnan(v)) {
-                int lab = (int)v;
-                if (lab >= 0 && lab < 256)
-                    label_counts[lab]++;
+        if (rank == MPI_MASTER) {
+            printf("KNN search (%d procesos) tomó %.6f segundos\n",
+                   tasks_num, get_elapsed_time(t0, t1));
+        }
+
+        // RECALL DE NN-DESCENT contra la búsqueda exacta global sobre una muestra
+        if (nnd_delta >= 0.0) {
+            long hits = 0, total = 0, total_hits = 0, total_all = 0;
+            int max_iters = 0;
+            nn_descent_recall(initial_data, results, k, matrix_get_chunk_offset(initial_data),
+                              100, 777 + rank, &hits, &total, MPI_COMM_WORLD);
+            reduce_master(hc, &hits, &total_hits, 1, MPI_LONG, MPI_SUM);
+            reduce_master(hc, &total, &total_all, 1, MPI_LONG, MPI_SUM);
+            reduce_master(hc, &nnd_iters, &max_iters, 1, MPI_INT, MPI_MAX);
+            if (rank == MPI_MASTER) {
+                printf("NN-Descent: %d iteraciones (delta=%g), recall@%d = %.2f%% sobre %ld vecinos\n",
+                       max_iters, nnd_delta, k,
+                       total_all ? 100.0 * total_hits / total_all : 0.0, total_all);
             }
         }
 
-        int best = 0, bestc = 0;
-        for (int c = 0; c < 256; c++) {
-            if (label_counts[c] > bestc) {
-                best = c;
-                bestc = label_counts[c];
+        // MEMORIA Y RECALL DE IVF-PQ
+        if (use_ivfpq && !shared && nnd_delta < 0.0) {
+            long hits = 0, total = 0, total_hits = 0, total_all = 0;
+            double local_bytes[3] = {0.0, 0.0, pq_build_time}, bytes[3] = {0.0, 0.0, 0.0};
+            if (pq_index) {
+                local_bytes[0] = (double) ivfpq_memory(pq_index);
+                local_bytes[1] = (double) local_points * matrix_get_cols(initial_data) * sizeof(double);
+            }
+            knn_recall(initial_data, results, k, matrix_get_chunk_offset(initial_data),
+                       100, 777 + rank, &hits, &total);
+            reduce_master(hc, &hits, &total_hits, 1, MPI_LONG, MPI_SUM);
+            reduce_master(hc, &total, &total_all, 1, MPI_LONG, MPI_SUM);
+            reduce_master(hc, local_bytes, bytes, 2, MPI_DOUBLE, MPI_SUM);
+            reduce_master(hc, &local_bytes[2], &bytes[2], 1, MPI_DOUBLE, MPI_MAX);
+            if (rank == MPI_MASTER) {
+                printf("IVF-PQ: nlist=%d m=%d nprobe=%d rerank=%d, construcción %.6f s\n",
+                       pq_params.nlist, pq_params.m, pq_params.nprobe, pq_params.rerank, bytes[2]);
+                printf("IVF-PQ: índice %.2f MB frente a %.2f MB sin comprimir (%.1fx)\n",
+                       bytes[0] / 1e6, bytes[1] / 1e6, bytes[0] > 0 ? bytes[1] / bytes[0] : 0.0);
+                printf("IVF-PQ: recall@%d = %.2f%% sobre %ld vecinos\n", k,
+                       total_all ? 100.0 * total_hits / total_all : 0.0, total_all);
             }
         }
-        matrix_set_cell(classified, i, 0, (double)best);
-    }
+        ivfpq_destroy(pq_index);
 
-    MPI_Barrier(MPI_COMM_WORLD);
-    gettimeofday(&t1, NULL);
+        // RECALL Y ACELERACIÓN DEL SKETCH frente a la fuerza bruta sobre una muestra
+        if (sketch) {
+            long hits = 0, total = 0, total_hits = 0, total_all = 0;
+            double local_stats[5] = { 0.0, 0.0, (double) sketch_memory(sketch), 0.0, sketch_build_time };
+            double stats[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+            local_stats[3] = sketch_benchmark(sketch, k_search, sketch_factor, 200, 999 + rank,
+                                              &local_stats[0], &local_stats[1]);
+            knn_recall(initial_data, results, k, matrix_get_chunk_offset(initial_data),
+                       100, 777 + rank, &hits, &total);
+            reduce_master(hc, &hits, &total_hits, 1, MPI_LONG, MPI_SUM);
+            reduce_master(hc, &total, &total_all, 1, MPI_LONG, MPI_SUM);
+            reduce_master(hc, local_stats, stats, 4, MPI_DOUBLE, MPI_SUM);
+            reduce_master(hc, &local_stats[4], &stats[4], 1, MPI_DOUBLE, MPI_MAX);
+            if (rank == MPI_MASTER) {
+                printf("Sketch: s=%d, lista corta %d*k, construcción %.6f s, %.2f MB\n",
+                       sketch_dims, sketch_factor, stats[4], stats[2] / 1e6);
+                printf("Sketch: recall@%d = %.2f%% sobre %ld vecinos; por query %.3f ms frente a %.3f ms de fuerza bruta (%.2fx)\n",
+                       k, total_all ? 100.0 * total_hits / total_all : 0.0, total_all,
+                       stats[3] > 0.0 ? stats[0] * 1000.0 / stats[3] : 0.0,
+                       stats[3] > 0.0 ? stats[1] * 1000.0 / stats[3] : 0.0,
+                       stats[0] > 0.0 ? stats[1] / stats[0] : 0.0);
+            }
+        }
+        sketch_destroy(sketch);
 
-    if (rank == MPI_MASTER) {
-        printf("Clasificación (OpenMP) tomó %.6f segundos\n",
-               get_elapsed_time(t0, t1));
+        // LABELING
+        if (shared) {
+            labeled = knn_labeling(results, local_points, k_search,
+                                   NULL, NULL, shared_labels->node, 0);
+        } else if (nnd_delta >= 0.0) {
+            /* los vecinos de NN-Descent pueden estar en cualquier proceso */
+            labeled = nn_descent_labeling(results, local_points, k_search, labels,
+                                          matrix_get_chunk_offset(initial_data), MPI_COMM_WORLD);
+            if (!labeled) {
+                fprintf(stderr, "ERROR: rank %d no pudo etiquetar los vecinos de NN-Descent\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        } else {
+            labeled =
+                knn_labeling_distributed(results,
+                                         local_points,
+                                         k_search, labels,
+                                         prev_task, next_task, tasks_num);
+        }
+
+        // EVALUACIÓN: precisión de cada k' <= k con la misma búsqueda
+        if (eval_sweep) {
+            double e0 = MPI_Wtime();
+            knn_eval_t *ev = knn_eval_create(k, cv_folds);
+            int self_offset = shared ? shared_data->local_start : matrix_get_chunk_offset(labels);
+            if (!ev || knn_eval_accumulate(ev, results, labeled, k_search, labels, self_offset) != 0) {
+                fprintf(stderr, "ERROR: rank %d no pudo evaluar sus vecinos\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            knn_eval_reduce(ev, MPI_MASTER, MPI_COMM_WORLD);
+            double eval_time = MPI_Wtime() - e0;
+            if (rank == MPI_MASTER) {
+                if (cv_folds > 1)
+                    printf("Validación cruzada con %d folds (búsqueda con k=%d)\n", cv_folds, k_search);
+                printf("  k   simple %%   ponderado %%   evaluados\n");
+                int best_k = 1;
+                double best_acc = -1.0;
+                for (int kk = 1; kk <= k; ++kk) {
+                    /* media y desviación entre folds (un solo fold = precisión global) */
+                    double sum_p = 0.0, sum_w = 0.0, sq_p = 0.0, sq_w = 0.0;
+                    long evaluated = 0;
+                    for (int f = 0; f < cv_folds; ++f) {
+                        long n = ev->evaluated[f * k + kk - 1];
+                        double ap = n ? 100.0 * ev->plain[f * k + kk - 1] / n : 0.0;
+                        double aw = n ? 100.0 * ev->weighted[f * k + kk - 1] / n : 0.0;
+                        sum_p += ap; sq_p += ap * ap;
+                        sum_w += aw; sq_w += aw * aw;
+                        evaluated += n;
+                    }
+                    double mp = sum_p / cv_folds, mw = sum_w / cv_folds;
+                    if (cv_folds > 1)
+                        printf("%3d   %6.2f ± %4.2f   %6.2f ± %4.2f   %ld\n", kk,
+                               mp, sqrt(fmax(sq_p / cv_folds - mp * mp, 0.0)),
+                               mw, sqrt(fmax(sq_w / cv_folds - mw * mw, 0.0)), evaluated);
+                    else
+                        printf("%3d   %6.2f     %6.2f        %ld\n", kk, mp, mw, evaluated);
+                    if (mp > best_acc) { best_acc = mp; best_k = kk; }
+                }
+                printf("Mejor k (voto simple) = %d con %.2f%%, evaluación tomó %.6f segundos\n",
+                       best_k, best_acc, eval_time);
+            }
+            knn_eval_destroy(ev);
+        }
+
+        // CLASSIFY
+        sync_all(hc);
+        gettimeofday(&t0, NULL);
+
+        if (dd) {
+            classified = dedup_classify(dd, labels, k);
+            if (!classified) {
+                fprintf(stderr, "ERROR: rank %d no pudo clasificar sus filas deduplicadas\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        } else {
+            classified = matrix_create(local_points, 1);
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < local_points; i++) {
+                int label_counts[256] = {0};  
+
+                for (int j = 0; j < k; j++) {
+                    double v = matrix_get_cell(labeled, i, j);
+                    if (!isnan(v)) {
+                        int lab = (int)v;
+                        if (lab >= 0 && lab < 256)
+                            label_counts[lab]++;
+                    }
+                }
+
+                int best = 0, bestc = 0;
+                for (int c = 0; c < 256; c++) {
+                    if (label_counts[c] > bestc) {
+                        best = c;
+                        bestc = label_counts[c];
+                    }
+                }
+                matrix_set_cell(classified, i, 0, (double)best);
+            }
+        }
+
+        sync_all(hc);
+        gettimeofday(&t1, NULL);
+
+        if (rank == MPI_MASTER) {
+            printf("Clasificación (OpenMP) tomó %.6f segundos\n",
+                   get_elapsed_time(t0, t1));
+        }
+
+        dedup_destroy(dd);
+
+        // GRAFO KNN (opcional): escritura paralela con MPI-IO
+        if (save_graph_fn) {
+            sync_all(hc);
+            gettimeofday(&t0, NULL);
+            if (knn_graph_write(save_graph_fn, results, classified, initial_data,
+                                shared ? shared_data->node : initial_data, k, MPI_COMM_WORLD) != 0) {
+                fprintf(stderr, "ERROR: rank %d no pudo escribir %s\n", rank, save_graph_fn);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            sync_all(hc);
+            gettimeofday(&t1, NULL);
+            int total_rows = 0;
+            reduce_master(hc, &local_points, &total_rows, 1, MPI_INT, MPI_SUM);
+            if (rank == MPI_MASTER) {
+                double secs = get_elapsed_time(t0, t1);
+                double mb = (KNN_GRAPH_HEADER + (double) total_rows * knn_graph_record_size(k)) / 1e6;
+                printf("Grafo KNN escrito en %s: %.2f MB en %.6f segundos (%.2f MB/s)\n",
+                       save_graph_fn, mb, secs, secs > 0.0 ? mb / secs : 0.0);
+            }
+        }
+
+        KNN_Pair_destroy_table(results, local_points);
     }
 
     // VERIFY LOCAL ACCURACY
@@ -135,16 +707,37 @@ int main(int argc, char *argv[]) {
     int total_correct = 0;
     int total_points = 0;
 
-    MPI_Reduce(&correct, &total_correct, 1, MPI_INT, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
-    MPI_Reduce(&local_points, &total_points, 1, MPI_INT, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
+    reduce_master(hc, &correct, &total_correct, 1, MPI_INT, MPI_SUM);
+    reduce_master(hc, &local_points, &total_points, 1, MPI_INT, MPI_SUM);
 
     if (rank == MPI_MASTER) {
         double acc = (double)total_correct / total_points * 100.0;
         printf("Accuracy final = %.2f%%\n", acc);
     }
 
-    matrix_destroy(initial_data);
-    matrix_destroy(labels);
+    if (hc) {
+        long traffic[6] = { hc->node_messages, hc->node_bytes, hc->inter_messages, hc->inter_bytes,
+                            hc->flat_messages, hc->flat_bytes };
+        long traffic_total[6] = { 0, 0, 0, 0, 0, 0 };
+        reduce_master(hc, traffic, traffic_total, 6, MPI_LONG, MPI_SUM);
+        if (rank == MPI_MASTER) {
+            printf("Tráfico de las colectivas (%d nodos): dentro de los nodos %ld mensajes, %ld bytes; "
+                   "entre nodos %ld mensajes, %ld bytes; con colectivas planas (estimado): %ld mensajes, %ld bytes\n",
+                   hc->nodes, traffic_total[0], traffic_total[1], traffic_total[2], traffic_total[3], traffic_total[4], traffic_total[5]);
+        }
+        hier_comm_destroy(hc);
+    }
+
+    if (shared) {
+        shared_matrix_destroy(shared_data);
+        shared_matrix_destroy(shared_labels);
+        MPI_Comm_free(&node_comm);
+    } else {
+        matrix_destroy(initial_data);
+        sparse_destroy(sparse_data);
+        matrix_destroy(labels);
+    }
+    metric_destroy(metric);
     matrix_destroy(labeled);
     matrix_destroy(classified);
 
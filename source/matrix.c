@@ -11,6 +11,7 @@ matrix_t *matrix_create(int32_t rows, int32_t cols) {
     m->rows = rows;
     m->cols = cols;
     m->chunk_offset = 0;
+    m->row_ids = NULL;
     m->data = (double**) malloc(sizeof(double*) * rows);
     if (!m->data) { free(m); return NULL; }
     for (int32_t i = 0; i < rows; ++i) {
@@ -30,6 +31,7 @@ void matrix_destroy(matrix_t *m) {
     if (!m) return;
     for (int32_t i = 0; i < m->rows; ++i) free(m->data[i]);
     free(m->data);
+    free(m->row_ids);
     free(m);
 }
 
@@ -37,6 +39,7 @@ void matrix_destroy(matrix_t *m) {
 int32_t matrix_get_rows(matrix_t *m) { return m->rows; }
 int32_t matrix_get_cols(matrix_t *m) { return m->cols; }
 int32_t matrix_get_chunk_offset(matrix_t *m) { return m->chunk_offset; }
+int32_t matrix_get_row_id(matrix_t *m, int32_t r) { return m->row_ids ? m->row_ids[r] : m->chunk_offset + r; }
 double matrix_get_cell(matrix_t *m, int32_t r, int32_t c) { return m->data[r][c]; }
 void matrix_set_cell(matrix_t *m, int32_t r, int32_t c, double value) { m->data[r][c] = value; }
 
@@ -9,6 +9,7 @@ typedef struct matrix_t {
     int32_t cols;
     double **data;
     int32_t chunk_offset;
+    int32_t *row_ids;   /* original global index per row, NULL while rows follow chunk_offset */
 } matrix_t;
 
 matrix_t *matrix_create(int32_t rows, int32_t cols);
@@ -17,6 +18,7 @@ void matrix_destroy(matrix_t *m);
 int32_t matrix_get_rows(matrix_t *m);
 int32_t matrix_get_cols(matrix_t *m);
 int32_t matrix_get_chunk_offset(matrix_t *m);
+int32_t matrix_get_row_id(matrix_t *m, int32_t r);
 
 double matrix_get_cell(matrix_t *m, int32_t r, int32_t c);
 void matrix_set_cell(matrix_t *m, int32_t r, int32_t c, double v);
@@ -0,0 +1,209 @@
+#include "metric.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+int metric_parse(const char *name, metric_kind_t *kind) {
+    if (strcmp(name, "euclid") == 0) *kind = METRIC_EUCLIDEAN;
+    else if (strcmp(name, "cosine") == 0) *kind = METRIC_COSINE;
+    else if (strcmp(name, "ip") == 0) *kind = METRIC_INNER_PRODUCT;
+    else if (strcmp(name, "wl2") == 0) *kind = METRIC_WEIGHTED_L2;
+    else return -1;
+    return 0;
+}
+
+const char *metric_name(metric_kind_t kind) {
+    switch (kind) {
+    case METRIC_COSINE: return "cosine";
+    case METRIC_INNER_PRODUCT: return "ip";
+    case METRIC_WEIGHTED_L2: return "wl2";
+    default: return "euclid";
+    }
+}
+
+void metric_moments(matrix_t *data, int32_t dims, double *moments) {
+    memset(moments, 0, sizeof(double) * (1 + 2 * dims));
+    int rows = matrix_get_rows(data);
+    moments[0] = rows;
+    for (int r = 0; r < rows; ++r) {
+        const double *x = data->data[r];
+        for (int c = 0; c < dims; ++c) {
+            moments[1 + c] += x[c];
+            moments[1 + dims + c] += x[c] * x[c];
+        }
+    }
+}
+
+int metric_parse_weights(const char *list, int32_t dims, double *weights) {
+    const char *p = list;
+    for (int32_t c = 0; c < dims; ++c) {
+        char *end = NULL;
+        weights[c] = strtod(p, &end);
+        if (end == p || !(weights[c] >= 0.0) || isinf(weights[c])) return -1;
+        if (*end != (c + 1 < dims ? ',' : '\0')) return -1;
+        p = end + 1;
+    }
+    return 0;
+}
+
+metric_t *metric_create(metric_kind_t kind, matrix_t *data, const double *moments,
+                        const double *weights) {
+    if (!data) return NULL;
+    metric_t *m = (metric_t*) calloc(1, sizeof(metric_t));
+    if (!m) return NULL;
+    m->kind = kind;
+    m->rows = matrix_get_rows(data);
+    m->dims = matrix_get_cols(data);
+
+    if (kind == METRIC_COSINE) {
+        m->inv_norms = (double*) malloc(sizeof(double) * (m->rows > 0 ? m->rows : 1));
+        if (!m->inv_norms) { metric_destroy(m); return NULL; }
+        for (int r = 0; r < m->rows; ++r) {
+            const double *x = data->data[r];
+            double n = 0.0;
+            for (int c = 0; c < m->dims; ++c) n += x[c] * x[c];
+            m->inv_norms[r] = n > 0.0 ? 1.0 / sqrt(n) : 0.0;
+        }
+    } else if (kind == METRIC_WEIGHTED_L2 && weights) {
+        m->weights = (double*) malloc(sizeof(double) * (m->dims > 0 ? m->dims : 1));
+        if (!m->weights) { metric_destroy(m); return NULL; }
+        memcpy(m->weights, weights, sizeof(double) * m->dims);
+    } else if (kind == METRIC_WEIGHTED_L2) {
+        double *local = NULL;
+        if (!moments) {
+            local = (double*) malloc(sizeof(double) * (1 + 2 * m->dims));
+            if (!local) { metric_destroy(m); return NULL; }
+            metric_moments(data, m->dims, local);
+            moments = local;
+        }
+        m->weights = (double*) malloc(sizeof(double) * (m->dims > 0 ? m->dims : 1));
+        if (!m->weights) { free(local); metric_destroy(m); return NULL; }
+        double n = moments[0];
+        for (int c = 0; c < m->dims; ++c) {
+            double mean = n > 0.0 ? moments[1 + c] / n : 0.0;
+            double var = n > 0.0 ? moments[1 + m->dims + c] / n - mean * mean : 0.0;
+            /* relative floor so that rounding on a constant column does not blow up */
+            m->weights[c] = var > 1e-12 * (mean * mean + 1e-300) ? 1.0 / var : 0.0;
+        }
+        free(local);
+    }
+    return m;
+}
+
+void metric_destroy(metric_t *m) {
+    if (!m) return;
+    free(m->inv_norms);
+    free(m->weights);
+    free(m);
+}
+
+/* one loop per metric: the switch runs once per query, never per pair */
+void metric_distances(const metric_t *m, matrix_t *data, const double *q, double *out) {
+    int rows = m->rows;
+    int dims = m->dims;
+
+    switch (m->kind) {
+    case METRIC_COSINE: {
+        double qn = 0.0;
+        for (int c = 0; c < dims; ++c) qn += q[c] * q[c];
+        double q_inv = qn > 0.0 ? 1.0 / sqrt(qn) : 0.0;
+        const double *inv = m->inv_norms;
+        for (int d = 0; d < rows; ++d) {
+            const double *x = data->data[d];
+            double dot = 0.0;
+            for (int c = 0; c < dims; ++c) dot += q[c] * x[c];
+            out[d] = 1.0 - dot * q_inv * inv[d];
+        }
+        break;
+    }
+    case METRIC_INNER_PRODUCT:
+        for (int d = 0; d < rows; ++d) {
+            const double *x = data->data[d];
+            double dot = 0.0;
+            for (int c = 0; c < dims; ++c) dot += q[c] * x[c];
+            out[d] = -dot;
+        }
+        break;
+    case METRIC_WEIGHTED_L2: {
+        const double *w = m->weights;
+        for (int d = 0; d < rows; ++d) {
+            const double *x = data->data[d];
+            double sum = 0.0;
+            for (int c = 0; c < dims; ++c) {
+                double diff = q[c] - x[c];
+                sum += w[c] * diff * diff;
+            }
+            out[d] = sqrt(sum);
+        }
+        break;
+    }
+    default:
+        for (int d = 0; d < rows; ++d) {
+            const double *x = data->data[d];
+            double sum = 0.0;
+            for (int c = 0; c < dims; ++c) {
+                double diff = q[c] - x[c];
+                sum += diff * diff;
+            }
+            out[d] = sqrt(sum);
+        }
+        break;
+    }
+}
+
+/* rows of queries against data; self_join drops each query's own row */
+static struct KNN_Pair **metric_scan(metric_t *m, matrix_t *data, matrix_t *queries, int k,
+                                     int i_offset, int self_join) {
+    int P = matrix_get_rows(queries);
+    int rows = m->rows;
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(P, k);
+    if (!results) return NULL;
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        double *dist = (double*) malloc(sizeof(double) * (rows > 0 ? rows : 1));
+        if (!dist) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        #pragma omp for schedule(static)
+        for (int p = 0; p < P; ++p) {
+            if (!dist) continue;
+            metric_distances(m, data, queries->data[p], dist);
+            struct KNN_Pair *list = results[p];
+            for (int d = 0; d < rows; ++d) {
+                if (self_join && d == p) continue;
+                if (dist[d] <= list[k-1].distance) knn_push(list, k, dist[d], i_offset + d);
+            }
+        }
+        free(dist);
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: metric_scan: out of memory for %d distances\n", rows);
+        KNN_Pair_destroy_table(results, P);
+        return NULL;
+    }
+    return results;
+}
+
+struct KNN_Pair **metric_search(metric_t *m, matrix_t *data, matrix_t *points, int k, int i_offset) {
+    if (!m || !data || !points || k < 1) return NULL;
+    if (m->kind == METRIC_EUCLIDEAN) return knn_search(data, points, k, i_offset);
+    if (matrix_get_rows(data) != m->rows || matrix_get_cols(points) < m->dims) {
+        fprintf(stderr, "ERROR: metric_search: metric was built for another matrix\n");
+        return NULL;
+    }
+    return metric_scan(m, data, points, k, i_offset, 0);
+}
+
+struct KNN_Pair **metric_search_self(metric_t *m, matrix_t *data, int k, int i_offset) {
+    if (!m || !data || k < 1) return NULL;
+    if (m->kind == METRIC_EUCLIDEAN) return knn_search_self(data, k, i_offset);
+    if (matrix_get_rows(data) != m->rows) {
+        fprintf(stderr, "ERROR: metric_search_self: metric was built for another matrix\n");
+        return NULL;
+    }
+    return metric_scan(m, data, data, k, i_offset, 1);
+}
@@ -0,0 +1,55 @@
+#ifndef METRIC_H
+#define METRIC_H
+
+#include "matrix.h"
+#include "knn.h"
+
+/* Distances reported by every metric are "smaller is closer":
+ *   euclid  sqrt(sum (a-b)^2)
+ *   cosine  1 - cos(a, b), in [0, 2]; rows of norm 0 sit at distance 1 of everything
+ *   ip      -<a, b>, so the largest inner product comes first
+ *   wl2     sqrt(sum w_c (a-b)^2), with user weights or by default w_c = 1 / var_c
+ *           (0 for constant columns)
+ */
+typedef enum metric_kind_t {
+    METRIC_EUCLIDEAN = 0,
+    METRIC_COSINE,
+    METRIC_INNER_PRODUCT,
+    METRIC_WEIGHTED_L2
+} metric_kind_t;
+
+/* Per-dataset state computed once at load time and bound to one matrix_t:
+ * inverse row norms for cosine, per-column weights for wl2.
+ */
+typedef struct metric_t {
+    metric_kind_t kind;
+    int32_t rows;
+    int32_t dims;
+    double *inv_norms;   /* rows, cosine only */
+    double *weights;     /* dims, wl2 only */
+} metric_t;
+
+int metric_parse(const char *name, metric_kind_t *kind);
+const char *metric_name(metric_kind_t kind);
+
+/* count, per-column sums and sums of squares (1 + 2*dims values), so that callers
+ * can add them up across ranks before metric_create */
+void metric_moments(matrix_t *data, int32_t dims, double *moments);
+
+/* "w1,w2,..." with exactly dims non-negative weights; 0 on success */
+int metric_parse_weights(const char *list, int32_t dims, double *weights);
+
+/* wl2 uses weights (dims values) when given; otherwise the inverse variances from moments,
+ * or from data alone when moments is NULL */
+metric_t *metric_create(metric_kind_t kind, matrix_t *data, const double *moments,
+                        const double *weights);
+void metric_destroy(metric_t *m);
+
+/* out[d] = distance from q to row d of data, the matrix m was created on */
+void metric_distances(const metric_t *m, matrix_t *data, const double *q, double *out);
+
+/* same contracts as knn_search and knn_search_self; euclid goes through those directly */
+struct KNN_Pair **metric_search(metric_t *m, matrix_t *data, matrix_t *points, int k, int i_offset);
+struct KNN_Pair **metric_search_self(metric_t *m, matrix_t *data, int k, int i_offset);
+
+#endif
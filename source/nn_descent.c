@@ -0,0 +1,604 @@
+#include "nn_descent.h"
+#include "rng.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+/* inserts (dist, index) as a new entry unless it is already listed or does not beat the tail */
+static int list_insert(struct KNN_Pair *list, char *is_new, int k, double dist, int index) {
+    if (dist > list[k-1].distance || (dist == list[k-1].distance && index > list[k-1].index)) return 0;
+    for (int j = 0; j < k; ++j) if (list[j].index == index) return 0;
+    int j = k - 1;
+    while (j > 0 && (list[j-1].distance > dist ||
+                     (list[j-1].distance == dist && list[j-1].index > index))) {
+        list[j] = list[j-1];
+        is_new[j] = is_new[j-1];
+        --j;
+    }
+    list[j].distance = dist;
+    list[j].index = index;
+    is_new[j] = 1;
+    return 1;
+}
+
+/* reservoir-samples value into a capped candidate list */
+static void sample_into(int *cands, int *count, int *seen, int cap, int value, uint64_t *rng) {
+    int s = (*seen)++;
+    if (*count < cap) { cands[(*count)++] = value; return; }
+    uint64_t r = rng_below(rng, (uint64_t) s + 1);
+    if (r < (uint64_t) cap) cands[r] = value;
+}
+
+/* per-row stream, so the sampling does not depend on the thread or rank count */
+static inline uint64_t row_seed(uint64_t seed, int iter, int g) {
+    uint64_t s = seed ^ ((uint64_t) (g + 1) * 0xD6E8FEB86659FD93ULL) ^ ((uint64_t) (iter + 1) << 40);
+    rng_next(&s);
+    return s;
+}
+
+/* global index layout: rank p holds [offset[p], offset[p] + count[p]) */
+typedef struct nnd_layout_t {
+    int tasks;
+    int rank;
+    int *offset;
+    int *count;
+} nnd_layout_t;
+
+/* gathers every rank's chunk; -1 on every rank when the chunks are not contiguous in rank order */
+static int layout_create(nnd_layout_t *L, int i_offset, int rows, const char *who, MPI_Comm comm) {
+    MPI_Comm_size(comm, &L->tasks);
+    MPI_Comm_rank(comm, &L->rank);
+    L->offset = (int*) malloc(sizeof(int) * L->tasks);
+    L->count = (int*) malloc(sizeof(int) * L->tasks);
+    if (!L->offset || !L->count) {
+        fprintf(stderr, "ERROR: %s: out of memory\n", who);
+        MPI_Abort(comm, 1);
+    }
+    MPI_Allgather(&i_offset, 1, MPI_INT, L->offset, 1, MPI_INT, comm);
+    MPI_Allgather(&rows, 1, MPI_INT, L->count, 1, MPI_INT, comm);
+    long total = 0;
+    int contiguous = 1;
+    for (int p = 0; p < L->tasks; ++p) {
+        if (L->offset[p] != total) contiguous = 0;
+        total += L->count[p];
+    }
+    if (!contiguous) {
+        /* every rank sees the same layout, so all of them return here */
+        if (L->rank == 0) fprintf(stderr, "ERROR: %s: chunks are not contiguous in rank order\n", who);
+        free(L->offset); free(L->count);
+        return -1;
+    }
+    return 0;
+}
+
+static int owner_of(const nnd_layout_t *L, int g) {
+    int lo = 0, hi = L->tasks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (L->offset[mid] <= g) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* all-to-all of records of width elements; send holds the records for rank 0, 1, ... in order.
+ * Returns the received records (grouped by source rank) and their count in *recv_total. */
+static void *exchange(const void *send, const int *send_n, int width, MPI_Datatype type,
+                      size_t type_size, int *recv_total, MPI_Comm comm) {
+    int tasks;
+    MPI_Comm_size(comm, &tasks);
+    int *counts = (int*) malloc(sizeof(int) * 4 * tasks);
+    if (!counts) return NULL;
+    int *sc = counts, *sd = counts + tasks, *rc = counts + 2 * tasks, *rd = counts + 3 * tasks;
+    for (int p = 0; p < tasks; ++p) sc[p] = send_n[p] * width;
+    MPI_Alltoall(sc, 1, MPI_INT, rc, 1, MPI_INT, comm);
+    int stot = 0, rtot = 0;
+    for (int p = 0; p < tasks; ++p) {
+        sd[p] = stot; stot += sc[p];
+        rd[p] = rtot; rtot += rc[p];
+    }
+    char *recv = (char*) malloc(type_size * (rtot > 0 ? rtot : 1));
+    if (!recv) {
+        fprintf(stderr, "ERROR: nn_descent: out of memory in exchange\n");
+        MPI_Abort(comm, 1);
+    }
+    MPI_Alltoallv(send, sc, sd, type, recv, rc, rd, type, comm);
+    *recv_total = rtot / width;
+    free(counts);
+    return recv;
+}
+
+/* vectors (and current tail distance) of the remote rows referenced by the local lists */
+typedef struct nnd_cache_t {
+    int n;
+    int *ids;         /* sorted global indices */
+    double *recs;     /* n x (dims + 1): row, then the owner's k-th squared distance */
+} nnd_cache_t;
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int*) a, y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+static const double *cache_find(const nnd_cache_t *c, int g, int dims) {
+    const int *hit = (const int*) bsearch(&g, c->ids, c->n, sizeof(int), cmp_int);
+    return hit ? c->recs + (size_t) (hit - c->ids) * (dims + 1) : NULL;
+}
+
+/* fetches the rows of every remote index in ids[0..n) in one batched request per rank */
+static void cache_fetch(nnd_cache_t *c, const nnd_layout_t *L, const int *ids, size_t n,
+                        matrix_t *data, struct KNN_Pair **lists, int k, MPI_Comm comm) {
+    int dims = matrix_get_cols(data);
+    int my_off = L->offset[L->rank], my_end = my_off + L->count[L->rank];
+    int *want = (int*) malloc(sizeof(int) * (n > 0 ? n : 1));
+    int *send_n = (int*) calloc(L->tasks, sizeof(int));
+    if (!want || !send_n) {
+        fprintf(stderr, "ERROR: nn_descent: out of memory fetching rows\n");
+        MPI_Abort(comm, 1);
+    }
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (ids[i] >= 0 && (ids[i] < my_off || ids[i] >= my_end)) want[m++] = ids[i];
+    qsort(want, m, sizeof(int), cmp_int);
+    size_t u = 0;
+    for (size_t i = 0; i < m; ++i)
+        if (u == 0 || want[u-1] != want[i]) want[u++] = want[i];
+    /* sorted ids are grouped by owner, and owners hold increasing offsets */
+    for (size_t i = 0; i < u; ++i) send_n[owner_of(L, want[i])]++;
+
+    int asked = 0;
+    int *req = (int*) exchange(want, send_n, 1, MPI_INT, sizeof(int), &asked, comm);
+    int w = dims + 1;
+    double *reply = (double*) malloc(sizeof(double) * (size_t) (asked > 0 ? asked : 1) * w);
+    if (!reply) {
+        fprintf(stderr, "ERROR: nn_descent: out of memory fetching rows\n");
+        MPI_Abort(comm, 1);
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < asked; ++i) {
+        int r = req[i] - my_off;
+        memcpy(reply + (size_t) i * w, data->data[r], sizeof(double) * dims);
+        reply[(size_t) i * w + dims] = lists ? lists[r][k-1].distance : 1e300;
+    }
+    /* the request counts per source become the reply counts per destination */
+    int *reply_n = (int*) malloc(sizeof(int) * L->tasks);
+    MPI_Alltoall(send_n, 1, MPI_INT, reply_n, 1, MPI_INT, comm);
+    int got = 0;
+    c->recs = (double*) exchange(reply, reply_n, w, MPI_DOUBLE, sizeof(double), &got, comm);
+    c->ids = want;
+    c->n = (int) u;
+    free(req); free(reply); free(reply_n); free(send_n);
+}
+
+static void cache_clear(nnd_cache_t *c) {
+    free(c->ids);
+    free(c->recs);
+    c->ids = NULL;
+    c->recs = NULL;
+    c->n = 0;
+}
+
+static inline const double *row_of(const nnd_layout_t *L, const nnd_cache_t *c, matrix_t *data, int g) {
+    int r = g - L->offset[L->rank];
+    if (r >= 0 && r < L->count[L->rank]) return data->data[r];
+    return cache_find(c, g, matrix_get_cols(data));
+}
+
+/* update for a remote list: (target, candidate, squared distance) */
+typedef struct nnd_update_t {
+    double target;
+    double index;
+    double dist;
+} nnd_update_t;
+
+typedef struct nnd_buffer_t {
+    nnd_update_t *items;
+    size_t n, cap;
+} nnd_buffer_t;
+
+static int buffer_push(nnd_buffer_t *b, int target, int index, double dist) {
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        nnd_update_t *items = (nnd_update_t*) realloc(b->items, sizeof(nnd_update_t) * cap);
+        if (!items) return -1;
+        b->items = items;
+        b->cap = cap;
+    }
+    b->items[b->n].target = target;
+    b->items[b->n].index = index;
+    b->items[b->n].dist = dist;
+    b->n++;
+    return 0;
+}
+
+/* nn_descent: approximate all-kNN of the rows spread over comm (self excluded). Lists start
+ * random over all ranks and are refined through neighbours of neighbours; every iteration
+ * runs three batched all-to-all exchanges: reverse candidates, the remote rows the local
+ * joins need, and the updates for lists owned by other ranks. The joins run in parallel with
+ * one lock per row. Indices are global (local row + i_offset), as in knn_search_distributed.
+ */
+struct KNN_Pair **nn_descent(matrix_t *data, int k, int i_offset, double delta,
+                             uint64_t seed, int *iters, MPI_Comm comm) {
+    int rows = matrix_get_rows(data);
+    int dims = matrix_get_cols(data);
+    if (iters) *iters = 0;
+
+    nnd_layout_t L;
+    if (layout_create(&L, i_offset, rows, "nn_descent", comm) != 0) return NULL;
+    long total = (long) L.offset[L.tasks - 1] + L.count[L.tasks - 1];
+
+    int cap = k;
+    int slots = rows > 0 ? rows : 1;
+    struct KNN_Pair **lists = KNN_Pair_create_empty_table(rows, k);
+    char *is_new = (char*) calloc((size_t) slots * k, 1);
+    int *new_c = (int*) malloc(sizeof(int) * (size_t) slots * 2 * cap);
+    int *old_c = (int*) malloc(sizeof(int) * (size_t) slots * 2 * cap);
+    int *new_n = (int*) malloc(sizeof(int) * slots);
+    int *old_n = (int*) malloc(sizeof(int) * slots);
+    int *fwd_new = (int*) malloc(sizeof(int) * slots);
+    int *fwd_old = (int*) malloc(sizeof(int) * slots);
+    int *bucket = (int*) malloc(sizeof(int) * (slots + 1));
+    int *send_n = (int*) malloc(sizeof(int) * L.tasks);
+    omp_lock_t *locks = (omp_lock_t*) malloc(sizeof(omp_lock_t) * slots);
+    if (!lists || !is_new || !new_c || !old_c || !new_n || !old_n || !fwd_new || !fwd_old ||
+        !bucket || !send_n || !locks) {
+        fprintf(stderr, "ERROR: nn_descent: out of memory\n");
+        MPI_Abort(comm, 1);
+    }
+    for (int i = 0; i < rows; ++i) omp_init_lock(&locks[i]);
+    nnd_cache_t cache = { 0, NULL, NULL };
+
+    /* random initial neighbours over all ranks; with too few rows every other row is taken */
+    int *init = new_c;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < rows; ++i) {
+        int g = i_offset + i;
+        int *pick = init + (size_t) i * k;
+        int n = 0;
+        if (total - 1 <= k) {
+            for (int j = 0; j < total && n < k; ++j) if (j != g) pick[n++] = j;
+        } else {
+            uint64_t rng = row_seed(seed, -1, g);
+            while (n < k) {
+                int j = (int) rng_below(&rng, (uint64_t) total);
+                int dup = (j == g);
+                for (int a = 0; a < n && !dup; ++a) dup = pick[a] == j;
+                if (!dup) pick[n++] = j;
+            }
+        }
+        for (int a = n; a < k; ++a) pick[a] = -1;
+    }
+    cache_fetch(&cache, &L, init, (size_t) rows * k, data, NULL, k, comm);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < rows; ++i) {
+        for (int a = 0; a < k; ++a) {
+            int j = init[(size_t) i * k + a];
+            if (j < 0) continue;
+            list_insert(lists[i], is_new + (size_t) i * k, k,
+                        knn_sq_dist(data->data[i], row_of(&L, &cache, data, j), dims), j);
+        }
+    }
+    cache_clear(&cache);
+
+    long threshold = (long) (delta * total * k);
+    int nthreads = omp_get_max_threads();
+    nnd_buffer_t *bufs = (nnd_buffer_t*) calloc(nthreads, sizeof(nnd_buffer_t));
+    if (!bufs) {
+        fprintf(stderr, "ERROR: nn_descent: out of memory\n");
+        MPI_Abort(comm, 1);
+    }
+    for (int iter = 0; iter < NN_DESCENT_MAX_ITERS; ++iter) {
+        /* forward candidates: new entries are sampled (and turned old), old ones kept */
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < rows; ++i) {
+            int *nc = new_c + (size_t) i * 2 * cap, *oc = old_c + (size_t) i * 2 * cap;
+            char *flags = is_new + (size_t) i * k;
+            int nn = 0, on = 0;
+            for (int j = 0; j < k; ++j) {
+                int v = lists[i][j].index;
+                if (v < 0) continue;
+                if (flags[j]) {
+                    if (nn < cap) { nc[nn++] = v; flags[j] = 0; }
+                } else {
+                    oc[on++] = v;
+                }
+            }
+            fwd_new[i] = new_n[i] = nn;
+            fwd_old[i] = old_n[i] = on;
+        }
+
+        /* reverse candidates: one batch of (target, source, is_new) per owner rank */
+        memset(send_n, 0, sizeof(int) * L.tasks);
+        size_t edges = 0;
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < fwd_new[i]; ++j) send_n[owner_of(&L, new_c[(size_t) i * 2 * cap + j])]++;
+            for (int j = 0; j < fwd_old[i]; ++j) send_n[owner_of(&L, old_c[(size_t) i * 2 * cap + j])]++;
+            edges += fwd_new[i] + fwd_old[i];
+        }
+        int *out = (int*) malloc(sizeof(int) * 3 * (edges > 0 ? edges : 1));
+        int *fill = (int*) malloc(sizeof(int) * L.tasks);
+        if (!out || !fill) {
+            fprintf(stderr, "ERROR: nn_descent: out of memory\n");
+            MPI_Abort(comm, 1);
+        }
+        for (int p = 0, at = 0; p < L.tasks; ++p) { fill[p] = at; at += send_n[p]; }
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < fwd_new[i] + fwd_old[i]; ++j) {
+                int v = j < fwd_new[i] ? new_c[(size_t) i * 2 * cap + j]
+                                       : old_c[(size_t) i * 2 * cap + j - fwd_new[i]];
+                int *e = out + (size_t) 3 * fill[owner_of(&L, v)]++;
+                e[0] = v;
+                e[1] = i_offset + i;
+                e[2] = j < fwd_new[i];
+            }
+        }
+        free(fill);
+        int received = 0;
+        int *in = (int*) exchange(out, send_n, 3, MPI_INT, sizeof(int), &received, comm);
+        free(out);
+
+        /* group the received edges by target row, then sample every row in parallel */
+        int *order = (int*) malloc(sizeof(int) * (received > 0 ? received : 1));
+        if (!order) {
+            fprintf(stderr, "ERROR: nn_descent: out of memory\n");
+            MPI_Abort(comm, 1);
+        }
+        memset(bucket, 0, sizeof(int) * (rows + 1));
+        for (int e = 0; e < received; ++e) bucket[in[3 * e] - i_offset + 1]++;
+        for (int i = 0; i < rows; ++i) bucket[i + 1] += bucket[i];
+        for (int e = 0; e < received; ++e) order[bucket[in[3 * e] - i_offset]++] = e;
+        for (int i = rows; i > 0; --i) bucket[i] = bucket[i - 1];
+        bucket[0] = 0;
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < rows; ++i) {
+            uint64_t rng = row_seed(seed, iter, i_offset + i);
+            int rn = 0, ro = 0, seen_n = 0, seen_o = 0;
+            int *nc = new_c + (size_t) i * 2 * cap + fwd_new[i];
+            int *oc = old_c + (size_t) i * 2 * cap + fwd_old[i];
+            for (int b = bucket[i]; b < bucket[i + 1]; ++b) {
+                const int *e = in + 3 * order[b];
+                if (e[2]) sample_into(nc, &rn, &seen_n, cap, e[1], &rng);
+                else sample_into(oc, &ro, &seen_o, cap, e[1], &rng);
+            }
+            new_n[i] = fwd_new[i] + rn;
+            old_n[i] = fwd_old[i] + ro;
+        }
+        free(order);
+        free(in);
+
+        /* every remote row a join touches, fetched in one batch */
+        size_t refs = (size_t) rows * 2 * cap;
+        int *touched = (int*) malloc(sizeof(int) * 2 * (refs > 0 ? refs : 1));
+        if (!touched) {
+            fprintf(stderr, "ERROR: nn_descent: out of memory\n");
+            MPI_Abort(comm, 1);
+        }
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < rows; ++i) {
+            int *t = touched + (size_t) i * 4 * cap;
+            for (int j = 0; j < 2 * cap; ++j) {
+                t[j] = j < new_n[i] ? new_c[(size_t) i * 2 * cap + j] : -1;
+                t[2 * cap + j] = j < old_n[i] ? old_c[(size_t) i * 2 * cap + j] : -1;
+            }
+        }
+        cache_fetch(&cache, &L, touched, 2 * refs, data, lists, k, comm);
+        free(touched);
+
+        /* local join: new x new and new x old pairs around every row; lists owned by other
+         * ranks get an update only if it beats their tail as of the fetch */
+        long updates = 0;
+        int failed = 0;
+        #pragma omp parallel reduction(+:updates)
+        {
+            nnd_buffer_t *buf = &bufs[omp_get_thread_num()];
+            buf->n = 0;
+            #pragma omp for schedule(dynamic, 64)
+            for (int i = 0; i < rows; ++i) {
+                int *nc = new_c + (size_t) i * 2 * cap, *oc = old_c + (size_t) i * 2 * cap;
+                for (int a = 0; a < new_n[i]; ++a) {
+                    int u = nc[a];
+                    const double *ru = row_of(&L, &cache, data, u);
+                    for (int b = a + 1; b < new_n[i] + old_n[i]; ++b) {
+                        int v = b < new_n[i] ? nc[b] : oc[b - new_n[i]];
+                        if (u == v) continue;
+                        const double *rv = row_of(&L, &cache, data, v);
+                        double dist = knn_sq_dist(ru, rv, dims);
+                        for (int side = 0; side < 2; ++side) {
+                            int t = side ? v : u, o = side ? u : v;
+                            const double *rt = side ? rv : ru;
+                            int r = t - i_offset;
+                            if (r >= 0 && r < rows) {
+                                omp_set_lock(&locks[r]);
+                                updates += list_insert(lists[r], is_new + (size_t) r * k, k, dist, o);
+                                omp_unset_lock(&locks[r]);
+                            } else if (dist < rt[dims] && buffer_push(buf, t, o, dist) != 0) {
+                                #pragma omp atomic write
+                                failed = 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        cache_clear(&cache);
+        if (failed) {
+            fprintf(stderr, "ERROR: nn_descent: out of memory buffering updates\n");
+            MPI_Abort(comm, 1);
+        }
+
+        /* remote updates, one batch per owner */
+        memset(send_n, 0, sizeof(int) * L.tasks);
+        size_t pending = 0;
+        for (int t = 0; t < nthreads; ++t) {
+            for (size_t e = 0; e < bufs[t].n; ++e) send_n[owner_of(&L, (int) bufs[t].items[e].target)]++;
+            pending += bufs[t].n;
+        }
+        nnd_update_t *upd = (nnd_update_t*) malloc(sizeof(nnd_update_t) * (pending > 0 ? pending : 1));
+        fill = (int*) malloc(sizeof(int) * L.tasks);
+        if (!upd || !fill) {
+            fprintf(stderr, "ERROR: nn_descent: out of memory\n");
+            MPI_Abort(comm, 1);
+        }
+        for (int p = 0, at = 0; p < L.tasks; ++p) { fill[p] = at; at += send_n[p]; }
+        for (int t = 0; t < nthreads; ++t)
+            for (size_t e = 0; e < bufs[t].n; ++e)
+                upd[fill[owner_of(&L, (int) bufs[t].items[e].target)]++] = bufs[t].items[e];
+        free(fill);
+        int arrived = 0;
+        nnd_update_t *got = (nnd_update_t*) exchange(upd, send_n, 3, MPI_DOUBLE, sizeof(double),
+                                                     &arrived, comm);
+        free(upd);
+        #pragma omp parallel for schedule(static) reduction(+:updates)
+        for (int e = 0; e < arrived; ++e) {
+            int r = (int) got[e].target - i_offset;
+            omp_set_lock(&locks[r]);
+            updates += list_insert(lists[r], is_new + (size_t) r * k, k, got[e].dist, (int) got[e].index);
+            omp_unset_lock(&locks[r]);
+        }
+        free(got);
+
+        long all_updates = 0;
+        MPI_Allreduce(&updates, &all_updates, 1, MPI_LONG, MPI_SUM, comm);
+        if (iters) *iters = iter + 1;
+        if (all_updates <= threshold) break;
+    }
+
+    for (int t = 0; t < nthreads; ++t) free(bufs[t].items);
+    free(bufs);
+    for (int i = 0; i < rows; ++i) {
+        omp_destroy_lock(&locks[i]);
+        for (int j = 0; j < k; ++j)
+            if (lists[i][j].index >= 0) lists[i][j].distance = sqrt(lists[i][j].distance);
+    }
+    free(is_new); free(new_c); free(old_c); free(new_n); free(old_n);
+    free(fwd_new); free(fwd_old); free(bucket); free(send_n); free(locks);
+    free(L.offset); free(L.count);
+    return lists;
+}
+
+/* nn_descent_labeling: the lists span every rank, so the labels of neighbours held elsewhere
+ * are fetched from their owners in one batched request per rank, as the rows are during the
+ * joins; unfilled slots get NaN */
+matrix_t *nn_descent_labeling(struct KNN_Pair **lists, int points, int k, matrix_t *labels,
+                              int i_offset, MPI_Comm comm) {
+    nnd_layout_t L;
+    if (layout_create(&L, i_offset, matrix_get_rows(labels), "nn_descent_labeling", comm) != 0)
+        return NULL;
+    matrix_t *labeled = matrix_create(points, k);
+    int *ids = (int*) malloc(sizeof(int) * ((size_t) points * k > 0 ? (size_t) points * k : 1));
+    if (!labeled || !ids) {
+        fprintf(stderr, "ERROR: nn_descent_labeling: out of memory\n");
+        MPI_Abort(comm, 1);
+    }
+    for (int p = 0; p < points; ++p)
+        for (int j = 0; j < k; ++j) ids[(size_t) p * k + j] = lists[p][j].index;
+
+    nnd_cache_t cache = { 0, NULL, NULL };
+    cache_fetch(&cache, &L, ids, (size_t) points * k, labels, NULL, k, comm);
+    #pragma omp parallel for schedule(static)
+    for (int p = 0; p < points; ++p)
+        for (int j = 0; j < k; ++j) {
+            int g = lists[p][j].index;
+            const double *lab = g >= 0 ? row_of(&L, &cache, labels, g) : NULL;
+            matrix_set_cell(labeled, p, j, lab ? lab[0] : NAN);
+        }
+    cache_clear(&cache);
+    free(ids);
+    free(L.offset); free(L.count);
+    return labeled;
+}
+
+/* nn_descent_recall: exact lists of a sample of rows of every rank, searched over all ranks
+ * (every rank scans its chunk for all sampled rows and the candidates are merged) */
+void nn_descent_recall(matrix_t *data, struct KNN_Pair **approx, int k, int i_offset,
+                       int samples, uint64_t seed, long *hits, long *total, MPI_Comm comm) {
+    int rows = matrix_get_rows(data);
+    int dims = matrix_get_cols(data);
+    int tasks, rank;
+    MPI_Comm_size(comm, &tasks);
+    MPI_Comm_rank(comm, &rank);
+    *hits = 0;
+    *total = 0;
+    if (samples > rows) samples = rows;
+
+    int *per_rank = (int*) malloc(sizeof(int) * tasks);
+    int *displ = (int*) malloc(sizeof(int) * tasks);
+    int *cnt = (int*) malloc(sizeof(int) * tasks);
+    int *picked = (int*) malloc(sizeof(int) * (samples > 0 ? samples : 1));
+    double *mine = (double*) malloc(sizeof(double) * (size_t) (samples > 0 ? samples : 1) * dims);
+    if (!per_rank || !displ || !cnt || !picked || !mine) {
+        fprintf(stderr, "ERROR: nn_descent_recall: out of memory\n");
+        MPI_Abort(comm, 1);
+    }
+    uint64_t rng = seed;
+    for (int s = 0; s < samples; ++s) {
+        picked[s] = (int) rng_below(&rng, rows);
+        memcpy(mine + (size_t) s * dims, data->data[picked[s]], sizeof(double) * dims);
+    }
+    MPI_Allgather(&samples, 1, MPI_INT, per_rank, 1, MPI_INT, comm);
+    int all = 0, first = 0;
+    for (int p = 0; p < tasks; ++p) {
+        if (p == rank) first = all;
+        displ[p] = all * dims;
+        cnt[p] = per_rank[p] * dims;
+        all += per_rank[p];
+    }
+    if (all == 0) {
+        free(picked); free(mine); free(per_rank); free(displ); free(cnt);
+        return;
+    }
+    matrix_t *queries = matrix_create(all, dims);
+    double *flat = (double*) malloc(sizeof(double) * (size_t) all * dims);
+    if (!queries || !flat) {
+        fprintf(stderr, "ERROR: nn_descent_recall: out of memory\n");
+        MPI_Abort(comm, 1);
+    }
+    MPI_Allgatherv(mine, samples * dims, MPI_DOUBLE, flat, cnt, displ, MPI_DOUBLE, comm);
+    for (int q = 0; q < all; ++q) memcpy(queries->data[q], flat + (size_t) q * dims, sizeof(double) * dims);
+
+    /* k + 1 candidates per query and rank (the row itself is one of them) */
+    int w = k + 1;
+    struct KNN_Pair **part = knn_search(data, queries, w, i_offset);
+    double *cand = (double*) malloc(sizeof(double) * 2 * (size_t) all * w);
+    double *merged = (double*) malloc(sizeof(double) * 2 * (size_t) all * w * tasks);
+    if (!part || !cand || !merged) {
+        fprintf(stderr, "ERROR: nn_descent_recall: out of memory\n");
+        MPI_Abort(comm, 1);
+    }
+    for (int q = 0; q < all; ++q)
+        for (int j = 0; j < w; ++j) {
+            cand[2 * ((size_t) q * w + j)] = part[q][j].distance;
+            cand[2 * ((size_t) q * w + j) + 1] = part[q][j].index;
+        }
+    MPI_Allgather(cand, 2 * all * w, MPI_DOUBLE, merged, 2 * all * w, MPI_DOUBLE, comm);
+
+    struct KNN_Pair *exact = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * (size_t) w * tasks);
+    for (int s = 0; s < samples && exact; ++s) {
+        int q = first + s;
+        int n = 0;
+        for (int p = 0; p < tasks; ++p)
+            for (int j = 0; j < w; ++j) {
+                const double *c = merged + 2 * (((size_t) p * all + q) * w + j);
+                if (c[1] < 0) continue;
+                exact[n].distance = c[0];
+                exact[n].index = (int) c[1];
+                n++;
+            }
+        qsort(exact, n, sizeof(struct KNN_Pair), KNN_Pair_asc_comp);
+        int self = i_offset + picked[s];
+        for (int j = 0, used = 0; j < n && used < k; ++j) {
+            if (exact[j].index == self) continue;
+            used++;
+            (*total)++;
+            for (int a = 0; a < k; ++a)
+                if (approx[picked[s]][a].index == exact[j].index) { (*hits)++; break; }
+        }
+    }
+    free(exact);
+    KNN_Pair_destroy_table(part, all);
+    matrix_destroy(queries);
+    free(flat); free(cand); free(merged); free(mine);
+    free(picked); free(per_rank); free(displ); free(cnt);
+}
@@ -0,0 +1,26 @@
+#ifndef NN_DESCENT_H
+#define NN_DESCENT_H
+
+#include <stdint.h>
+#include <mpi.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* NN-Descent stops when an iteration changes fewer than delta * rows * k list entries */
+#define NN_DESCENT_MAX_ITERS 30
+
+/* Collective over comm: the graph spans the rows of every rank (chunks must be contiguous in
+ * rank order) and seed must be the same on all of them. */
+struct KNN_Pair **nn_descent(matrix_t *data, int k, int i_offset, double delta,
+                             uint64_t seed, int *iters, MPI_Comm comm);
+
+/* labels (rows x k) of the neighbours in lists, local or not; labels holds this rank's rows
+ * from i_offset, like the data given to nn_descent. Collective over comm. */
+matrix_t *nn_descent_labeling(struct KNN_Pair **lists, int points, int k, matrix_t *labels,
+                              int i_offset, MPI_Comm comm);
+
+/* recall of approx against the exact lists over all ranks, on samples rows per rank */
+void nn_descent_recall(matrix_t *data, struct KNN_Pair **approx, int k, int i_offset,
+                       int samples, uint64_t seed, long *hits, long *total, MPI_Comm comm);
+
+#endif
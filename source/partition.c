@@ -0,0 +1,410 @@
+#include "partition.h"
+#include "knn.h"
+#include "codec.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+/* samples per rank used to pick the Morton splitters */
+#define PARTITION_SAMPLES 256
+
+static void local_bounds(matrix_t *data, int32_t dims, double *lo, double *hi) {
+    for (int c = 0; c < dims; ++c) { lo[c] = INFINITY; hi[c] = -INFINITY; }
+    for (int r = 0; r < matrix_get_rows(data); ++r) {
+        for (int c = 0; c < dims; ++c) {
+            double v = matrix_get_cell(data, r, c);
+            if (v < lo[c]) lo[c] = v;
+            if (v > hi[c]) hi[c] = v;
+        }
+    }
+}
+
+partition_t *partition_gather_bounds(matrix_t *data, int32_t dims, MPI_Comm comm) {
+    int parts = 1;
+    MPI_Comm_size(comm, &parts);
+    partition_t *p = (partition_t*) malloc(sizeof(partition_t));
+    if (!p) return NULL;
+    p->parts = parts;
+    p->dims = dims;
+    p->lo = (double*) malloc(sizeof(double) * parts * dims);
+    p->hi = (double*) malloc(sizeof(double) * parts * dims);
+    p->rows = (int32_t*) malloc(sizeof(int32_t) * parts);
+    double *lo = (double*) malloc(sizeof(double) * dims);
+    double *hi = (double*) malloc(sizeof(double) * dims);
+    if (!p->lo || !p->hi || !p->rows || !lo || !hi) {
+        free(lo); free(hi);
+        partition_destroy(p);
+        return NULL;
+    }
+    local_bounds(data, dims, lo, hi);
+    int32_t rows = matrix_get_rows(data);
+    MPI_Allgather(lo, dims, MPI_DOUBLE, p->lo, dims, MPI_DOUBLE, comm);
+    MPI_Allgather(hi, dims, MPI_DOUBLE, p->hi, dims, MPI_DOUBLE, comm);
+    MPI_Allgather(&rows, 1, MPI_INT32_T, p->rows, 1, MPI_INT32_T, comm);
+    free(lo);
+    free(hi);
+    return p;
+}
+
+void partition_destroy(partition_t *p) {
+    if (!p) return;
+    free(p->lo);
+    free(p->hi);
+    free(p->rows);
+    free(p);
+}
+
+/* squared distance from q to the box of part (INFINITY for an empty part) */
+double partition_min_sq_dist(partition_t *p, int32_t part, const double *q) {
+    if (p->rows[part] == 0) return INFINITY;
+    const double *lo = p->lo + (size_t) part * p->dims;
+    const double *hi = p->hi + (size_t) part * p->dims;
+    double dist = 0.0;
+    for (int c = 0; c < p->dims; ++c) {
+        double diff = 0.0;
+        if (q[c] < lo[c]) diff = lo[c] - q[c];
+        else if (q[c] > hi[c]) diff = q[c] - hi[c];
+        dist += diff * diff;
+    }
+    return dist;
+}
+
+/* (distance, rank) pairs, so that the sort needs no shared comparator state */
+static int cmp_part_dist(const void *a, const void *b) {
+    const struct KNN_Pair *x = (const struct KNN_Pair*) a, *y = (const struct KNN_Pair*) b;
+    if (x->distance < y->distance) return -1;
+    if (x->distance > y->distance) return 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/* ranks sorted by distance from q to their box (ties by rank); sq_dists gets one entry per rank */
+int32_t *partition_order_by_distance(partition_t *p, const double *q, double *sq_dists) {
+    int32_t *order = (int32_t*) malloc(sizeof(int32_t) * p->parts);
+    struct KNN_Pair *pairs = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * p->parts);
+    if (!order || !pairs) { free(order); free(pairs); return NULL; }
+    for (int i = 0; i < p->parts; ++i) {
+        sq_dists[i] = partition_min_sq_dist(p, i, q);
+        pairs[i].distance = sq_dists[i];
+        pairs[i].index = i;
+    }
+    qsort(pairs, p->parts, sizeof(struct KNN_Pair), cmp_part_dist);
+    for (int i = 0; i < p->parts; ++i) order[i] = pairs[i].index;
+    free(pairs);
+    return order;
+}
+
+/* interleaves the quantised coordinates of row inside [lo, hi] into 63 bits */
+uint64_t partition_morton_code(const double *row, const double *lo, const double *hi, int32_t dims) {
+    int used = dims < 63 ? dims : 63;
+    int bits = used > 0 ? 63 / used : 0;
+    if (bits > 21) bits = 21;
+    uint64_t cells = (1ULL << bits) - 1;
+    uint64_t q[63];
+    for (int c = 0; c < used; ++c) {
+        double span = hi[c] - lo[c];
+        double t = span > 0.0 ? (row[c] - lo[c]) / span : 0.0;
+        if (t < 0.0) t = 0.0;
+        if (t > 1.0) t = 1.0;
+        q[c] = (uint64_t) (t * cells);
+    }
+    uint64_t code = 0;
+    for (int b = bits - 1; b >= 0; --b)
+        for (int c = 0; c < used; ++c)
+            code = (code << 1) | ((q[c] >> b) & 1ULL);
+    return code;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/* Alltoallv of row blocks through the codec: counts/displs are in rows of width doubles */
+static int shuffle_encoded(const double *send_rows, const int *send_counts, const int *send_displs,
+                           double *recv_rows, const int *recv_counts, const int *recv_displs,
+                           int32_t width, int codec_mode, double max_err, MPI_Comm comm) {
+    int parts = 1;
+    MPI_Comm_size(comm, &parts);
+    char **blocks = (char**) calloc(parts, sizeof(char*));
+    int *send_bytes = (int*) malloc(sizeof(int) * parts);
+    int *recv_bytes = (int*) malloc(sizeof(int) * parts);
+    int *send_off = (int*) malloc(sizeof(int) * parts);
+    int *recv_off = (int*) malloc(sizeof(int) * parts);
+    if (!blocks || !send_bytes || !recv_bytes || !send_off || !recv_off) {
+        free(blocks); free(send_bytes); free(recv_bytes); free(send_off); free(recv_off);
+        return -1;
+    }
+    int send_total = 0, recv_total = 0;
+    for (int i = 0; i < parts; ++i) {
+        size_t len = 0;
+        blocks[i] = codec_encode_doubles(send_rows + (size_t) send_displs[i] * width,
+                                         send_counts[i], width, codec_mode, max_err, &len);
+        send_bytes[i] = (int) len;
+        send_off[i] = send_total;
+        send_total += send_bytes[i];
+    }
+    MPI_Alltoall(send_bytes, 1, MPI_INT, recv_bytes, 1, MPI_INT, comm);
+    for (int i = 0; i < parts; ++i) { recv_off[i] = recv_total; recv_total += recv_bytes[i]; }
+
+    char *send_buf = (char*) malloc(send_total > 0 ? send_total : 1);
+    char *recv_buf = (char*) malloc(recv_total > 0 ? recv_total : 1);
+    int rc = (send_buf && recv_buf) ? 0 : -1;
+    for (int i = 0; i < parts; ++i) {
+        if (send_buf && blocks[i]) memcpy(send_buf + send_off[i], blocks[i], send_bytes[i]);
+        free(blocks[i]);
+    }
+    if (rc == 0) {
+        MPI_Alltoallv(send_buf, send_bytes, send_off, MPI_CHAR,
+                      recv_buf, recv_bytes, recv_off, MPI_CHAR, comm);
+        for (int i = 0; i < parts && rc == 0; ++i)
+            rc = codec_decode_doubles(recv_buf + recv_off[i], recv_bytes[i],
+                                      recv_rows + (size_t) recv_displs[i] * width,
+                                      recv_counts[i], width);
+    }
+    free(blocks); free(send_bytes); free(recv_bytes); free(send_off); free(recv_off);
+    free(send_buf); free(recv_buf);
+    return rc;
+}
+
+/* partition_redistribute_spatial: range-partitions rows by Morton code of their first dims
+ * columns and shuffles them (with labels, if given) with MPI_Alltoallv. Splitters come from
+ * a regular sample of every rank's codes. Afterwards chunk_offset is the exclusive prefix of
+ * the new row counts and row_ids keeps each row's original global index. Rows travel through
+ * the codec (see codec.h) unless codec_mode is CODEC_RAW.
+ */
+int partition_redistribute_spatial(matrix_t **data, matrix_t **labels, int32_t dims,
+                                   int codec_mode, double max_err, MPI_Comm comm) {
+    int parts = 1;
+    MPI_Comm_size(comm, &parts);
+    matrix_t *src = *data;
+    matrix_t *src_labels = labels ? *labels : NULL;
+    int32_t rows = matrix_get_rows(src);
+    int32_t dcols = matrix_get_cols(src);
+    int32_t lcols = src_labels ? matrix_get_cols(src_labels) : 0;
+    int32_t width = dcols + lcols;
+    if (dims > dcols) dims = dcols;
+
+    /* global box that the codes are quantised against */
+    double *lo = (double*) malloc(sizeof(double) * dims);
+    double *hi = (double*) malloc(sizeof(double) * dims);
+    uint64_t *codes = (uint64_t*) malloc(sizeof(uint64_t) * (rows > 0 ? rows : 1));
+    if (!lo || !hi || !codes) { free(lo); free(hi); free(codes); return -1; }
+    local_bounds(src, dims, lo, hi);
+    MPI_Allreduce(MPI_IN_PLACE, lo, dims, MPI_DOUBLE, MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, hi, dims, MPI_DOUBLE, MPI_MAX, comm);
+    for (int r = 0; r < rows; ++r)
+        codes[r] = partition_morton_code(src->data[r], lo, hi, dims);
+    free(lo);
+    free(hi);
+
+    /* regular sample of the sorted local codes */
+    int samples = rows < PARTITION_SAMPLES ? rows : PARTITION_SAMPLES;
+    uint64_t *sorted = (uint64_t*) malloc(sizeof(uint64_t) * (rows > 0 ? rows : 1));
+    uint64_t *sample = (uint64_t*) malloc(sizeof(uint64_t) * (samples > 0 ? samples : 1));
+    int *sample_counts = (int*) malloc(sizeof(int) * parts);
+    int *sample_displs = (int*) malloc(sizeof(int) * parts);
+    if (!sorted || !sample || !sample_counts || !sample_displs) {
+        free(codes); free(sorted); free(sample); free(sample_counts); free(sample_displs);
+        return -1;
+    }
+    memcpy(sorted, codes, sizeof(uint64_t) * rows);
+    qsort(sorted, rows, sizeof(uint64_t), cmp_u64);
+    for (int s = 0; s < samples; ++s)
+        sample[s] = sorted[(long) s * rows / samples];
+    free(sorted);
+
+    MPI_Allgather(&samples, 1, MPI_INT, sample_counts, 1, MPI_INT, comm);
+    int total_samples = 0;
+    for (int i = 0; i < parts; ++i) { sample_displs[i] = total_samples; total_samples += sample_counts[i]; }
+    uint64_t *all_samples = (uint64_t*) malloc(sizeof(uint64_t) * (total_samples > 0 ? total_samples : 1));
+    uint64_t *splitters = (uint64_t*) malloc(sizeof(uint64_t) * parts);
+    if (!all_samples || !splitters) {
+        free(codes); free(sample); free(sample_counts); free(sample_displs);
+        free(all_samples); free(splitters);
+        return -1;
+    }
+    MPI_Allgatherv(sample, samples, MPI_UINT64_T, all_samples, sample_counts, sample_displs,
+                   MPI_UINT64_T, comm);
+    qsort(all_samples, total_samples, sizeof(uint64_t), cmp_u64);
+    for (int i = 0; i < parts - 1; ++i)
+        splitters[i] = total_samples > 0 ? all_samples[(long) (i + 1) * total_samples / parts] : 0;
+    free(sample);
+    free(sample_counts);
+    free(sample_displs);
+    free(all_samples);
+
+    /* destination rank = number of splitters <= code */
+    int *dest = (int*) malloc(sizeof(int) * (rows > 0 ? rows : 1));
+    int *send_counts = (int*) calloc(parts, sizeof(int));
+    int *recv_counts = (int*) malloc(sizeof(int) * parts);
+    int *send_displs = (int*) malloc(sizeof(int) * parts);
+    int *recv_displs = (int*) malloc(sizeof(int) * parts);
+    int *fill = (int*) malloc(sizeof(int) * parts);
+    if (!dest || !send_counts || !recv_counts || !send_displs || !recv_displs || !fill) {
+        free(codes); free(splitters); free(dest); free(send_counts);
+        free(recv_counts); free(send_displs); free(recv_displs); free(fill);
+        return -1;
+    }
+    for (int r = 0; r < rows; ++r) {
+        int a = 0, b = parts - 1;
+        while (a < b) {
+            int m = (a + b) / 2;
+            if (splitters[m] <= codes[r]) a = m + 1; else b = m;
+        }
+        dest[r] = a;
+        send_counts[a]++;
+    }
+    free(codes);
+    free(splitters);
+
+    MPI_Alltoall(send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, comm);
+    int new_rows = 0;
+    for (int i = 0; i < parts; ++i) {
+        send_displs[i] = i == 0 ? 0 : send_displs[i-1] + send_counts[i-1];
+        recv_displs[i] = new_rows;
+        new_rows += recv_counts[i];
+    }
+
+    /* pack rows (data then label columns) and their global ids by destination */
+    double *send_rows = (double*) malloc(sizeof(double) * (size_t) (rows > 0 ? rows : 1) * width);
+    double *recv_rows = (double*) malloc(sizeof(double) * (size_t) (new_rows > 0 ? new_rows : 1) * width);
+    int32_t *send_ids = (int32_t*) malloc(sizeof(int32_t) * (rows > 0 ? rows : 1));
+    int32_t *recv_ids = (int32_t*) malloc(sizeof(int32_t) * (new_rows > 0 ? new_rows : 1));
+    matrix_t *out = matrix_create(new_rows, dcols);
+    matrix_t *out_labels = src_labels ? matrix_create(new_rows, lcols) : NULL;
+    if (!send_rows || !recv_rows || !send_ids || !recv_ids || !out || (src_labels && !out_labels)) {
+        free(dest); free(send_counts); free(recv_counts); free(send_displs); free(recv_displs);
+        free(fill); free(send_rows); free(recv_rows); free(send_ids); free(recv_ids);
+        matrix_destroy(out);
+        matrix_destroy(out_labels);
+        return -1;
+    }
+    memcpy(fill, send_displs, sizeof(int) * parts);
+    for (int r = 0; r < rows; ++r) {
+        int slot = fill[dest[r]]++;
+        double *rec = send_rows + (size_t) slot * width;
+        memcpy(rec, src->data[r], sizeof(double) * dcols);
+        if (src_labels) memcpy(rec + dcols, src_labels->data[r], sizeof(double) * lcols);
+        send_ids[slot] = matrix_get_row_id(src, r);
+    }
+    free(dest);
+
+    MPI_Alltoallv(send_ids, send_counts, send_displs, MPI_INT32_T,
+                  recv_ids, recv_counts, recv_displs, MPI_INT32_T, comm);
+    if (codec_mode == CODEC_RAW) {
+        for (int i = 0; i < parts; ++i) {
+            send_counts[i] *= width; send_displs[i] *= width;
+            recv_counts[i] *= width; recv_displs[i] *= width;
+        }
+        MPI_Alltoallv(send_rows, send_counts, send_displs, MPI_DOUBLE,
+                      recv_rows, recv_counts, recv_displs, MPI_DOUBLE, comm);
+    } else if (shuffle_encoded(send_rows, send_counts, send_displs, recv_rows, recv_counts,
+                               recv_displs, width, codec_mode, max_err, comm) != 0) {
+        fprintf(stderr, "ERROR: partition_redistribute_spatial: corrupt compressed payload\n");
+        MPI_Abort(comm, 1);
+    }
+    free(send_counts); free(recv_counts); free(send_displs); free(recv_displs);
+    free(fill); free(send_rows); free(send_ids);
+
+    for (int r = 0; r < new_rows; ++r) {
+        const double *rec = recv_rows + (size_t) r * width;
+        memcpy(out->data[r], rec, sizeof(double) * dcols);
+        if (out_labels) memcpy(out_labels->data[r], rec + dcols, sizeof(double) * lcols);
+    }
+    free(recv_rows);
+
+    int offset = 0;
+    MPI_Exscan(&new_rows, &offset, 1, MPI_INT, MPI_SUM, comm);
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    if (rank == 0) offset = 0;
+    out->chunk_offset = offset;
+    out->row_ids = recv_ids;
+    if (out_labels) {
+        out_labels->chunk_offset = offset;
+        out_labels->row_ids = (int32_t*) malloc(sizeof(int32_t) * (new_rows > 0 ? new_rows : 1));
+        if (out_labels->row_ids) memcpy(out_labels->row_ids, recv_ids, sizeof(int32_t) * new_rows);
+    }
+
+    matrix_destroy(src);
+    *data = out;
+    if (labels) {
+        matrix_destroy(src_labels);
+        *labels = out_labels;
+    }
+    return 0;
+}
+
+typedef struct code_row_t {
+    uint64_t code;
+    int32_t row;
+} code_row_t;
+
+static int cmp_code_row(const void *a, const void *b) {
+    const code_row_t *x = (const code_row_t*) a, *y = (const code_row_t*) b;
+    if (x->code != y->code) return (x->code > y->code) - (x->code < y->code);
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+/* partition_reorder_local: sorts the local rows (and labels in step) along the Morton curve
+ * of their own bounding box. Rows are copied into fresh allocations in curve order so that
+ * spatially close rows are also close in memory; row_ids keeps the original global index.
+ */
+int partition_reorder_local(matrix_t **data, matrix_t **labels, int32_t dims) {
+    matrix_t *src = *data;
+    matrix_t *src_labels = labels ? *labels : NULL;
+    int32_t rows = matrix_get_rows(src);
+    int32_t dcols = matrix_get_cols(src);
+    if (dims > dcols) dims = dcols;
+
+    double *lo = (double*) malloc(sizeof(double) * (dims > 0 ? dims : 1));
+    double *hi = (double*) malloc(sizeof(double) * (dims > 0 ? dims : 1));
+    code_row_t *order = (code_row_t*) malloc(sizeof(code_row_t) * (rows > 0 ? rows : 1));
+    matrix_t *out = matrix_create(rows, dcols);
+    matrix_t *out_labels = src_labels ? matrix_create(rows, matrix_get_cols(src_labels)) : NULL;
+    int32_t *ids = (int32_t*) malloc(sizeof(int32_t) * (rows > 0 ? rows : 1));
+    int32_t *label_ids = (int32_t*) malloc(sizeof(int32_t) * (rows > 0 ? rows : 1));
+    if (!lo || !hi || !order || !out || (src_labels && !out_labels) || !ids || !label_ids) {
+        free(lo); free(hi); free(order); free(ids); free(label_ids);
+        matrix_destroy(out);
+        matrix_destroy(out_labels);
+        return -1;
+    }
+
+    local_bounds(src, dims, lo, hi);
+    for (int r = 0; r < rows; ++r) {
+        order[r].code = partition_morton_code(src->data[r], lo, hi, dims);
+        order[r].row = r;
+    }
+    qsort(order, rows, sizeof(code_row_t), cmp_code_row);
+
+    for (int r = 0; r < rows; ++r) {
+        int32_t from = order[r].row;
+        memcpy(out->data[r], src->data[from], sizeof(double) * dcols);
+        ids[r] = matrix_get_row_id(src, from);
+        if (out_labels)
+            memcpy(out_labels->data[r], src_labels->data[from],
+                   sizeof(double) * matrix_get_cols(src_labels));
+    }
+    memcpy(label_ids, ids, sizeof(int32_t) * rows);
+    out->chunk_offset = matrix_get_chunk_offset(src);
+    out->row_ids = ids;
+    if (out_labels) {
+        out_labels->chunk_offset = matrix_get_chunk_offset(src_labels);
+        out_labels->row_ids = label_ids;
+    } else {
+        free(label_ids);
+    }
+    free(lo);
+    free(hi);
+    free(order);
+
+    matrix_destroy(src);
+    *data = out;
+    if (labels) {
+        matrix_destroy(src_labels);
+        *labels = out_labels;
+    }
+    return 0;
+}
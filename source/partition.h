@@ -0,0 +1,29 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <stdint.h>
+#include <mpi.h>
+#include "matrix.h"
+
+/* bounding box of the rows held by every rank, identical on all ranks */
+typedef struct partition_t {
+    int32_t parts;
+    int32_t dims;
+    double *lo;      /* parts x dims */
+    double *hi;      /* parts x dims */
+    int32_t *rows;   /* rows held by each rank */
+} partition_t;
+
+partition_t *partition_gather_bounds(matrix_t *data, int32_t dims, MPI_Comm comm);
+void partition_destroy(partition_t *p);
+
+double partition_min_sq_dist(partition_t *p, int32_t part, const double *q);
+int32_t *partition_order_by_distance(partition_t *p, const double *q, double *sq_dists);
+
+uint64_t partition_morton_code(const double *row, const double *lo, const double *hi, int32_t dims);
+
+int partition_redistribute_spatial(matrix_t **data, matrix_t **labels, int32_t dims,
+                                   int codec_mode, double max_err, MPI_Comm comm);
+int partition_reorder_local(matrix_t **data, matrix_t **labels, int32_t dims);
+
+#endif
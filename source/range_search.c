@@ -0,0 +1,305 @@
+#include "range_search.h"
+#include "knn.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define RANGE_SEARCH_TAG 43
+/* cells per grid dimension, so that cell keys always fit in 63 bits */
+#define RANGE_GRID_MAX_CELLS (1 << 20)
+
+static inline int64_t range_bucket(const range_grid_t *g, int64_t key) {
+    return (int64_t) (((uint64_t) key * 0x9E3779B97F4A7C15ULL) >> 32) & (g->buckets - 1);
+}
+
+static inline int64_t range_cell_of(const range_grid_t *g, double v, int d) {
+    int64_t c = (int64_t) floor((v - g->lo[d]) / g->cell);
+    if (c < 0) c = 0;
+    if (c >= g->cells[d]) c = g->cells[d] - 1;
+    return c;
+}
+
+static inline int64_t range_key(const range_grid_t *g, const int64_t *c) {
+    return (c[0] * g->cells[1] + c[1]) * g->cells[2] + c[2];
+}
+
+range_grid_t *range_grid_build(matrix_t *data, int32_t dims, double cell) {
+    if (!data || dims < 1 || dims > matrix_get_cols(data)) return NULL;
+    range_grid_t *g = (range_grid_t*) calloc(1, sizeof(range_grid_t));
+    if (!g) return NULL;
+    int rows = matrix_get_rows(data);
+    g->data = data;
+    g->dims = dims;
+    g->grid_dims = dims < RANGE_GRID_MAX_DIMS ? dims : RANGE_GRID_MAX_DIMS;
+
+    double hi[RANGE_GRID_MAX_DIMS];
+    double extent = 0.0;
+    for (int d = 0; d < RANGE_GRID_MAX_DIMS; ++d) { g->lo[d] = 0.0; hi[d] = 0.0; }
+    for (int d = 0; d < g->grid_dims; ++d) {
+        g->lo[d] = rows ? data->data[0][d] : 0.0;
+        hi[d] = g->lo[d];
+        for (int r = 1; r < rows; ++r) {
+            double v = data->data[r][d];
+            if (v < g->lo[d]) g->lo[d] = v;
+            if (v > hi[d]) hi[d] = v;
+        }
+        if (hi[d] - g->lo[d] > extent) extent = hi[d] - g->lo[d];
+    }
+    if (cell <= 0.0) {
+        double per_dim = ceil(pow(rows > 0 ? rows : 1, 1.0 / g->grid_dims));
+        cell = extent > 0.0 ? extent / per_dim : 1.0;
+    }
+    if (extent / cell >= RANGE_GRID_MAX_CELLS) cell = extent / (RANGE_GRID_MAX_CELLS - 1);
+    g->cell = cell;
+    for (int d = 0; d < RANGE_GRID_MAX_DIMS; ++d)
+        g->cells[d] = d < g->grid_dims ? (int64_t) ((hi[d] - g->lo[d]) / cell) + 1 : 1;
+
+    g->buckets = 2;
+    while (g->buckets < rows) g->buckets <<= 1;
+    g->bucket_start = (int64_t*) calloc(g->buckets + 1, sizeof(int64_t));
+    g->rows = (int32_t*) malloc(sizeof(int32_t) * (rows > 0 ? rows : 1));
+    g->keys = (int64_t*) malloc(sizeof(int64_t) * (rows > 0 ? rows : 1));
+    int64_t *row_key = (int64_t*) malloc(sizeof(int64_t) * (rows > 0 ? rows : 1));
+    if (!g->bucket_start || !g->rows || !g->keys || !row_key) {
+        free(row_key);
+        range_grid_destroy(g);
+        return NULL;
+    }
+
+    /* counting sort of the rows by bucket */
+    for (int r = 0; r < rows; ++r) {
+        int64_t c[RANGE_GRID_MAX_DIMS] = { 0, 0, 0 };
+        for (int d = 0; d < g->grid_dims; ++d) c[d] = range_cell_of(g, data->data[r][d], d);
+        row_key[r] = range_key(g, c);
+        g->bucket_start[range_bucket(g, row_key[r]) + 1]++;
+    }
+    for (int64_t b = 0; b < g->buckets; ++b) g->bucket_start[b+1] += g->bucket_start[b];
+    int64_t *fill = (int64_t*) malloc(sizeof(int64_t) * g->buckets);
+    if (!fill) {
+        free(row_key);
+        range_grid_destroy(g);
+        return NULL;
+    }
+    memcpy(fill, g->bucket_start, sizeof(int64_t) * g->buckets);
+    for (int r = 0; r < rows; ++r) {
+        int64_t e = fill[range_bucket(g, row_key[r])]++;
+        g->rows[e] = r;
+        g->keys[e] = row_key[r];
+    }
+    free(fill);
+    free(row_key);
+    return g;
+}
+
+void range_grid_destroy(range_grid_t *g) {
+    if (!g) return;
+    free(g->bucket_start);
+    free(g->rows);
+    free(g->keys);
+    free(g);
+}
+
+void range_result_destroy(range_result_t *r) {
+    if (!r) return;
+    free(r->start);
+    free(r->index);
+    free(r->distance);
+    free(r);
+}
+
+static int range_hit_comp(const void *a, const void *b) {
+    const struct KNN_Pair *x = (const struct KNN_Pair*) a, *y = (const struct KNN_Pair*) b;
+    if (x->distance != y->distance) return (x->distance > y->distance) - (x->distance < y->distance);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+typedef struct range_hits_t {
+    struct KNN_Pair *hits;
+    int64_t count;
+    int64_t cap;
+} range_hits_t;
+
+static inline int range_hits_push(range_hits_t *h, double dist, int index) {
+    if (h->count == h->cap) {
+        int64_t cap = h->cap ? h->cap * 2 : 16;
+        struct KNN_Pair *grown = (struct KNN_Pair*) realloc(h->hits, sizeof(struct KNN_Pair) * cap);
+        if (!grown) return -1;
+        h->hits = grown;
+        h->cap = cap;
+    }
+    h->hits[h->count].distance = dist;
+    h->hits[h->count].index = index;
+    h->count++;
+    return 0;
+}
+
+/* hits of one query; visits only the cells overlapping the ball's bounding box, or
+ * every row when that box covers more cells than there are rows */
+static int range_query(const range_grid_t *g, const double *q, double radius, int i_offset,
+                       range_hits_t *out, int64_t *examined) {
+    int rows = matrix_get_rows(g->data);
+    double r2 = radius * radius;
+    int64_t cmin[RANGE_GRID_MAX_DIMS] = { 0, 0, 0 }, cmax[RANGE_GRID_MAX_DIMS] = { 0, 0, 0 };
+    double visit = 1.0;
+    for (int d = 0; d < g->grid_dims; ++d) {
+        double a = floor((q[d] - radius - g->lo[d]) / g->cell);
+        double b = floor((q[d] + radius - g->lo[d]) / g->cell);
+        if (b < 0.0 || a >= (double) g->cells[d]) return 0;
+        cmin[d] = a < 0.0 ? 0 : (int64_t) a;
+        cmax[d] = b >= (double) g->cells[d] ? g->cells[d] - 1 : (int64_t) b;
+        visit *= (double) (cmax[d] - cmin[d] + 1);
+    }
+
+    if (visit > rows) {
+        for (int r = 0; r < rows; ++r) {
+            double d2 = knn_sq_dist(q, g->data->data[r], g->dims);
+            if (d2 <= r2 && range_hits_push(out, sqrt(d2), i_offset + r) != 0) return -1;
+        }
+        *examined += rows;
+        return 0;
+    }
+
+    int64_t c[RANGE_GRID_MAX_DIMS];
+    for (c[0] = cmin[0]; c[0] <= cmax[0]; ++c[0])
+        for (c[1] = cmin[1]; c[1] <= cmax[1]; ++c[1])
+            for (c[2] = cmin[2]; c[2] <= cmax[2]; ++c[2]) {
+                int64_t key = range_key(g, c);
+                int64_t b = range_bucket(g, key);
+                for (int64_t e = g->bucket_start[b]; e < g->bucket_start[b+1]; ++e) {
+                    if (g->keys[e] != key) continue;
+                    int r = g->rows[e];
+                    double d2 = knn_sq_dist(q, g->data->data[r], g->dims);
+                    (*examined)++;
+                    if (d2 <= r2 && range_hits_push(out, sqrt(d2), i_offset + r) != 0) return -1;
+                }
+            }
+    return 0;
+}
+
+range_result_t *range_search(range_grid_t *g, matrix_t *points, double radius, int i_offset) {
+    if (!g || !points || radius < 0.0 || matrix_get_cols(points) < g->dims) return NULL;
+    int P = matrix_get_rows(points);
+    range_result_t *res = (range_result_t*) calloc(1, sizeof(range_result_t));
+    range_hits_t *lists = (range_hits_t*) calloc(P > 0 ? P : 1, sizeof(range_hits_t));
+    if (!res || !lists) { free(res); free(lists); return NULL; }
+    res->queries = P;
+
+    int failed = 0;
+    int64_t examined = 0;
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:examined)
+    for (int p = 0; p < P; ++p) {
+        if (range_query(g, points->data[p], radius, i_offset, &lists[p], &examined) != 0) {
+            #pragma omp atomic write
+            failed = 1;
+            continue;
+        }
+        qsort(lists[p].hits, lists[p].count, sizeof(struct KNN_Pair), range_hit_comp);
+    }
+    res->examined = examined;
+
+    res->start = (int64_t*) malloc(sizeof(int64_t) * (P + 1));
+    if (!failed && res->start) {
+        res->start[0] = 0;
+        for (int p = 0; p < P; ++p) res->start[p+1] = res->start[p] + lists[p].count;
+        int64_t total = res->start[P];
+        res->index = (int32_t*) malloc(sizeof(int32_t) * (total > 0 ? total : 1));
+        res->distance = (double*) malloc(sizeof(double) * (total > 0 ? total : 1));
+        if (!res->index || !res->distance) failed = 1;
+        for (int p = 0; p < P && !failed; ++p)
+            for (int64_t i = 0; i < lists[p].count; ++i) {
+                res->index[res->start[p] + i] = lists[p].hits[i].index;
+                res->distance[res->start[p] + i] = lists[p].hits[i].distance;
+            }
+    }
+    for (int p = 0; p < P; ++p) free(lists[p].hits);
+    free(lists);
+    if (failed || !res->start) {
+        fprintf(stderr, "ERROR: range_search: out of memory\n");
+        range_result_destroy(res);
+        return NULL;
+    }
+    return res;
+}
+
+static int range_record_comp(const void *a, const void *b) {
+    const double *x = (const double*) a, *y = (const double*) b;
+    if (x[0] != y[0]) return (x[0] > y[0]) - (x[0] < y[0]);
+    return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+double *range_search_distributed(range_grid_t *g, partition_t *bounds, const double *q,
+                                 double radius, int root, MPI_Comm comm,
+                                 int *hits, int *contacted, int64_t *examined) {
+    int rank = 0, parts = 1;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &parts);
+    int fields = 2 + matrix_get_cols(g->data);
+    double r2 = radius * radius;
+
+    /* the boxes are identical everywhere, so every rank knows who takes part */
+    *contacted = 0;
+    for (int p = 0; p < parts; ++p)
+        if (partition_min_sq_dist(bounds, p, q) <= r2) (*contacted)++;
+    *hits = 0;
+    *examined = 0;
+
+    double *local = NULL;
+    int local_hits = 0;
+    if (partition_min_sq_dist(bounds, rank, q) <= r2) {
+        matrix_t *qm = matrix_create(1, g->dims);
+        range_result_t *res = NULL;
+        if (qm) {
+            memcpy(qm->data[0], q, sizeof(double) * g->dims);
+            res = range_search(g, qm, radius, 0);
+            matrix_destroy(qm);
+        }
+        if (res) {
+            local_hits = (int) res->start[1];
+            *examined = res->examined;
+            local = (double*) malloc(sizeof(double) * fields * (local_hits > 0 ? local_hits : 1));
+            for (int i = 0; local && i < local_hits; ++i) {
+                int r = res->index[i];
+                double *rec = local + (size_t) fields * i;
+                rec[0] = res->distance[i];
+                rec[1] = (double) matrix_get_row_id(g->data, r);
+                memcpy(rec + 2, g->data->data[r], sizeof(double) * (fields - 2));
+            }
+            range_result_destroy(res);
+        }
+        if (!local) {
+            fprintf(stderr, "ERROR: range_search_distributed: rank %d could not search\n", rank);
+            local_hits = 0;
+        }
+        if (rank != root) {
+            MPI_Send(local, local_hits * fields, MPI_DOUBLE, root, RANGE_SEARCH_TAG, comm);
+            free(local);
+            return NULL;
+        }
+    }
+    if (rank != root) return NULL;
+
+    /* root: one message from every other intersecting rank, whatever its size */
+    double *all = local;
+    int total = local_hits;
+    for (int p = 0; p < parts; ++p) {
+        if (p == root || partition_min_sq_dist(bounds, p, q) > r2) continue;
+        MPI_Status st;
+        int count = 0;
+        MPI_Probe(p, RANGE_SEARCH_TAG, comm, &st);
+        MPI_Get_count(&st, MPI_DOUBLE, &count);
+        double *grown = (double*) realloc(all, sizeof(double) * ((size_t) total * fields + count + 1));
+        if (!grown) {
+            fprintf(stderr, "ERROR: range_search_distributed: out of memory\n");
+            MPI_Abort(comm, 1);
+        }
+        all = grown;
+        MPI_Recv(all + (size_t) total * fields, count, MPI_DOUBLE, p, RANGE_SEARCH_TAG, comm,
+                 MPI_STATUS_IGNORE);
+        total += count / fields;
+    }
+    if (!all) all = (double*) malloc(sizeof(double) * fields);
+    qsort(all, total, sizeof(double) * fields, range_record_comp);
+    *hits = total;
+    return all;
+}
@@ -0,0 +1,55 @@
+#ifndef RANGE_SEARCH_H
+#define RANGE_SEARCH_H
+
+#include <stdint.h>
+#include <mpi.h>
+#include "matrix.h"
+#include "partition.h"
+
+/* leading dimensions bucketed by the grid; the rest are only checked exactly */
+#define RANGE_GRID_MAX_DIMS 3
+
+/* Uniform grid over the first min(dims, 3) columns of a matrix. Cells are hashed into
+ * a power-of-two bucket table and the rows of each bucket are stored contiguously, so
+ * the index is O(rows) whatever the extent of the data.
+ */
+typedef struct range_grid_t {
+    matrix_t *data;          /* not owned */
+    int32_t dims;            /* columns compared by the exact distance */
+    int32_t grid_dims;
+    double cell;
+    double lo[RANGE_GRID_MAX_DIMS];
+    int64_t cells[RANGE_GRID_MAX_DIMS];
+    int64_t buckets;
+    int64_t *bucket_start;   /* buckets + 1 */
+    int32_t *rows;           /* data rows grouped by bucket */
+    int64_t *keys;           /* cell key of every entry of rows, to tell hash collisions apart */
+} range_grid_t;
+
+/* CSR result: the hits of query q are index/distance[start[q] .. start[q+1]),
+ * sorted by (distance, index) */
+typedef struct range_result_t {
+    int32_t queries;
+    int64_t *start;
+    int32_t *index;
+    double *distance;
+    int64_t examined;        /* candidate rows whose distance was computed */
+} range_result_t;
+
+/* cell <= 0 picks a size that leaves about one row per cell */
+range_grid_t *range_grid_build(matrix_t *data, int32_t dims, double cell);
+void range_grid_destroy(range_grid_t *g);
+
+range_result_t *range_search(range_grid_t *g, matrix_t *points, double radius, int i_offset);
+void range_result_destroy(range_result_t *r);
+
+/* One query over all ranks. Only ranks whose box in bounds intersects the ball search
+ * and send to root; root returns its hits as records of 2 + cols doubles (distance,
+ * original row id, data row) sorted by distance, and NULL elsewhere. examined is the
+ * calling rank's own candidate count.
+ */
+double *range_search_distributed(range_grid_t *g, partition_t *bounds, const double *q,
+                                 double radius, int root, MPI_Comm comm,
+                                 int *hits, int *contacted, int64_t *examined);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* small seeded generator (splitmix64) shared by the sampling code */
+static inline uint64_t rng_next(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform integer in [0, n) */
+static inline uint64_t rng_below(uint64_t *state, uint64_t n) {
+    return rng_next(state) % n;
+}
+
+/* uniform double in [0, 1) */
+static inline double rng_uniform(uint64_t *state) {
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include "shared_matrix.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* matrix_t whose rows point into buf; freed with view_destroy, never matrix_destroy */
+static matrix_t *view_create(double *buf, int32_t rows, int32_t cols) {
+    matrix_t *m = (matrix_t*) malloc(sizeof(matrix_t));
+    if (!m) return NULL;
+    m->rows = rows;
+    m->cols = cols;
+    m->chunk_offset = 0;
+    m->row_ids = NULL;
+    m->data = (double**) malloc(sizeof(double*) * (rows > 0 ? rows : 1));
+    if (!m->data) { free(m); return NULL; }
+    for (int32_t i = 0; i < rows; ++i) m->data[i] = buf + (size_t) i * cols;
+    return m;
+}
+
+static void view_destroy(matrix_t *m) {
+    if (!m) return;
+    free(m->data);
+    free(m->row_ids);
+    free(m);
+}
+
+MPI_Comm shared_node_comm(MPI_Comm comm) {
+    int rank = 0;
+    MPI_Comm node;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    return node;
+}
+
+/* shared_matrix_from: moves m into the node window and destroys m. Collective on node_comm. */
+shared_matrix_t *shared_matrix_from(matrix_t *m, MPI_Comm node_comm) {
+    int32_t rows = matrix_get_rows(m);
+    int32_t cols = matrix_get_cols(m);
+    int node_size = 1;
+    MPI_Comm_size(node_comm, &node_size);
+
+    shared_matrix_t *s = (shared_matrix_t*) malloc(sizeof(shared_matrix_t));
+    int *counts = (int*) malloc(sizeof(int) * node_size);
+    int *displs = (int*) malloc(sizeof(int) * node_size);
+    if (!s || !counts || !displs) { free(s); free(counts); free(displs); return NULL; }
+    s->node_comm = node_comm;
+
+    double *base = NULL;
+    MPI_Win_allocate_shared((MPI_Aint) sizeof(double) * rows * cols, sizeof(double),
+                            MPI_INFO_NULL, node_comm, &base, &s->win);
+    /* the window is read and written with plain loads and stores inside one passive epoch
+     * that stays open until shared_matrix_destroy */
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, s->win);
+    for (int32_t i = 0; i < rows; ++i)
+        memcpy(base + (size_t) i * cols, m->data[i], sizeof(double) * cols);
+
+    /* the private copy goes as soon as the rows are in the window; only its ids stay */
+    int32_t chunk_offset = matrix_get_chunk_offset(m);
+    int32_t *ids = (int32_t*) malloc(sizeof(int32_t) * (rows > 0 ? rows : 1));
+    if (ids)
+        for (int32_t i = 0; i < rows; ++i) ids[i] = matrix_get_row_id(m, i);
+    int32_t *row_ids = m->row_ids;
+    m->row_ids = NULL;
+    matrix_destroy(m);
+
+    /* segments are contiguous in node-rank order, so rank 0's base addresses the whole node */
+    MPI_Allgather(&rows, 1, MPI_INT, counts, 1, MPI_INT, node_comm);
+    int32_t node_rows = 0;
+    for (int i = 0; i < node_size; ++i) { displs[i] = node_rows; node_rows += counts[i]; }
+    int node_rank = 0;
+    MPI_Comm_rank(node_comm, &node_rank);
+    s->local_start = displs[node_rank];
+
+    MPI_Aint seg_size;
+    int disp_unit;
+    double *node_base = NULL;
+    MPI_Win_shared_query(s->win, 0, &seg_size, &disp_unit, &node_base);
+
+    s->local = view_create(base, rows, cols);
+    s->node = view_create(node_base, node_rows, cols);
+    int32_t *node_ids = (int32_t*) malloc(sizeof(int32_t) * (node_rows > 0 ? node_rows : 1));
+    if (!s->local || !s->node || !ids || !node_ids) {
+        free(ids); free(node_ids); free(counts); free(displs); free(row_ids);
+        shared_matrix_destroy(s);
+        return NULL;
+    }
+    MPI_Allgatherv(ids, rows, MPI_INT32_T, node_ids, counts, displs, MPI_INT32_T, node_comm);
+    s->local->chunk_offset = chunk_offset;
+    s->local->row_ids = row_ids;
+    s->node->row_ids = node_ids;
+    free(ids);
+    free(counts);
+    free(displs);
+
+    /* under the unified model the stores above are only visible to the other ranks after
+     * a sync on both sides of the barrier */
+    MPI_Win_sync(s->win);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(s->win);
+    return s;
+}
+
+void shared_matrix_destroy(shared_matrix_t *s) {
+    if (!s) return;
+    view_destroy(s->local);
+    view_destroy(s->node);
+    MPI_Win_unlock_all(s->win);
+    MPI_Win_free(&s->win);
+    free(s);
+}
+
+/* view of rows [first, first + count) of m, indexed from 0 */
+static matrix_t shared_rows_view(matrix_t *m, int first, int count) {
+    matrix_t view = *m;
+    view.rows = count;
+    view.data = m->data + first;
+    view.row_ids = NULL;
+    return view;
+}
+
+/* knn_search_shared: this rank's rows against every row on the node, read in place.
+ * Indices are positions in data->node. The local rows are joined with the symmetric
+ * tiled self-join (no self-matches); the rows of the other ranks before and after
+ * them are scanned with knn_search and the sorted lists are merged.
+ */
+struct KNN_Pair **knn_search_shared(shared_matrix_t *data, int k) {
+    int rows = matrix_get_rows(data->local);
+    int first = data->local_start;
+    int node_rows = matrix_get_rows(data->node);
+    int after = node_rows - first - rows;
+
+    matrix_t local = shared_rows_view(data->node, first, rows);
+    struct KNN_Pair **out = knn_search_self(&local, k, first);
+    if (!out) return NULL;
+
+    struct KNN_Pair *merged = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * k);
+    if (!merged) { KNN_Pair_destroy_table(out, rows); return NULL; }
+    int ranges[2][2] = { { 0, first }, { first + rows, after } };
+    for (int r = 0; r < 2; ++r) {
+        if (ranges[r][1] <= 0 || rows == 0) continue;
+        matrix_t others = shared_rows_view(data->node, ranges[r][0], ranges[r][1]);
+        struct KNN_Pair **part = knn_search(&others, data->local, k, ranges[r][0]);
+        if (!part) {
+            free(merged);
+            KNN_Pair_destroy_table(out, rows);
+            return NULL;
+        }
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0, a = 0, b = 0; j < k; ++j) {
+                int take_a = b >= k || (a < k && (out[i][a].distance < part[i][b].distance ||
+                            (out[i][a].distance == part[i][b].distance && out[i][a].index <= part[i][b].index)));
+                merged[j] = take_a ? out[i][a++] : part[i][b++];
+            }
+            memcpy(out[i], merged, sizeof(struct KNN_Pair) * k);
+        }
+        KNN_Pair_destroy_table(part, rows);
+    }
+    free(merged);
+    return out;
+}
@@ -0,0 +1,28 @@
+#ifndef SHARED_MATRIX_H
+#define SHARED_MATRIX_H
+
+#include <stdint.h>
+#include <mpi.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* Rows of every rank on a node stored once in an MPI shared-memory window.
+ * local and node are views into the window: local covers this rank's rows, node covers
+ * all ranks of the node in node-rank order (chunk_offset 0, row_ids = original indices).
+ */
+typedef struct shared_matrix_t {
+    MPI_Comm node_comm;
+    MPI_Win win;
+    int32_t local_start;   /* position of local row 0 inside node */
+    matrix_t *local;
+    matrix_t *node;
+} shared_matrix_t;
+
+MPI_Comm shared_node_comm(MPI_Comm comm);
+
+shared_matrix_t *shared_matrix_from(matrix_t *m, MPI_Comm node_comm);
+void shared_matrix_destroy(shared_matrix_t *s);
+
+struct KNN_Pair **knn_search_shared(shared_matrix_t *data, int k);
+
+#endif
@@ -0,0 +1,149 @@
+#include "sketch.h"
+#include "rng.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+/* standard normal draw (Box-Muller) */
+static double gaussian(uint64_t *rng) {
+    double u = rng_uniform(rng);
+    double v = rng_uniform(rng);
+    return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+}
+
+static inline void project(const double *proj, const double *x, int dims, int s, double *out) {
+    for (int j = 0; j < s; ++j) out[j] = 0.0;
+    for (int c = 0; c < dims; ++c) {
+        const double *row = proj + (size_t) c * s;
+        for (int j = 0; j < s; ++j) out[j] += x[c] * row[j];
+    }
+}
+
+sketch_t *sketch_build(matrix_t *data, int s, uint64_t seed) {
+    if (!data || s < 1) return NULL;
+    sketch_t *sk = (sketch_t*) calloc(1, sizeof(sketch_t));
+    if (!sk) return NULL;
+    sk->rows = matrix_get_rows(data);
+    sk->dims = matrix_get_cols(data);
+    sk->s = s;
+    sk->data = data;
+    sk->proj = (double*) malloc(sizeof(double) * (size_t) sk->dims * s);
+    sk->codes = (double*) malloc(sizeof(double) * (size_t) (sk->rows > 0 ? sk->rows : 1) * s);
+    if (!sk->proj || !sk->codes) {
+        sketch_destroy(sk);
+        return NULL;
+    }
+    /* scaled so that projected distances estimate the original ones */
+    uint64_t rng = seed;
+    double scale = 1.0 / sqrt((double) s);
+    for (size_t i = 0; i < (size_t) sk->dims * s; ++i) sk->proj[i] = gaussian(&rng) * scale;
+
+    #pragma omp parallel for schedule(static)
+    for (int r = 0; r < sk->rows; ++r)
+        project(sk->proj, data->data[r], sk->dims, s, sk->codes + (size_t) r * s);
+    return sk;
+}
+
+void sketch_destroy(sketch_t *sk) {
+    if (!sk) return;
+    free(sk->proj);
+    free(sk->codes);
+    free(sk);
+}
+
+size_t sketch_memory(sketch_t *sk) {
+    if (!sk) return 0;
+    return sizeof(double) * ((size_t) sk->dims * sk->s + (size_t) sk->rows * sk->s);
+}
+
+/* queries are external points, or with self_join the sketched rows themselves, whose
+ * own row never enters the lists */
+static struct KNN_Pair **sketch_scan(sketch_t *sk, matrix_t *points, int P, int k, int i_offset,
+                                     int factor, int self_join) {
+    int s = sk->s;
+    int rows = sk->rows;
+    int shortlist = factor < 1 ? k : factor * k;
+    if (shortlist > rows) shortlist = rows > 0 ? rows : 1;
+    if (shortlist < k) shortlist = k;
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(P, k);
+    if (!results) return NULL;
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        struct KNN_Pair *cand = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * shortlist);
+        double *qs = (double*) malloc(sizeof(double) * s);
+        if (!cand || !qs) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        #pragma omp for schedule(static)
+        for (int p = 0; p < P; ++p) {
+            if (!cand || !qs) continue;
+            const double *q = points->data[p];
+            const double *qcode = qs;
+            if (self_join) qcode = sk->codes + (size_t) p * s;
+            else project(sk->proj, q, sk->dims, s, qs);
+
+            /* stage 1: shortlist on the sketches */
+            for (int j = 0; j < shortlist; ++j) { cand[j].distance = 1e300; cand[j].index = -1; }
+            for (int d = 0; d < rows; ++d) {
+                if (self_join && d == p) continue;
+                double dist = knn_sq_dist(qcode, sk->codes + (size_t) d * s, s);
+                if (dist <= cand[shortlist-1].distance) knn_push(cand, shortlist, dist, d);
+            }
+            /* stage 2: exact distances on the shortlist only */
+            struct KNN_Pair *list = results[p];
+            for (int j = 0; j < shortlist && cand[j].index >= 0; ++j) {
+                int d = cand[j].index;
+                double dist = sqrt(knn_sq_dist(q, sk->data->data[d], sk->dims));
+                knn_push(list, k, dist, i_offset + d);
+            }
+        }
+        free(cand);
+        free(qs);
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: sketch_scan: out of memory\n");
+        KNN_Pair_destroy_table(results, P);
+        return NULL;
+    }
+    return results;
+}
+
+struct KNN_Pair **sketch_search(sketch_t *sk, matrix_t *points, int k, int i_offset, int factor) {
+    if (!sk || !points || k < 1 || matrix_get_cols(points) < sk->dims) return NULL;
+    return sketch_scan(sk, points, matrix_get_rows(points), k, i_offset, factor, 0);
+}
+
+struct KNN_Pair **sketch_search_self(sketch_t *sk, int k, int i_offset, int factor) {
+    if (!sk || k < 1) return NULL;
+    return sketch_scan(sk, sk->data, sk->rows, k, i_offset, factor, 1);
+}
+
+int sketch_benchmark(sketch_t *sk, int k, int factor, int samples, uint64_t seed,
+                     double *sketch_time, double *exact_time) {
+    *sketch_time = 0.0;
+    *exact_time = 0.0;
+    if (!sk || sk->rows < 1) return 0;
+    if (samples > sk->rows) samples = sk->rows;
+    matrix_t *queries = matrix_create(samples, sk->dims);
+    if (!queries) return 0;
+    uint64_t rng = seed;
+    for (int i = 0; i < samples; ++i)
+        memcpy(queries->data[i], sk->data->data[rng_below(&rng, sk->rows)], sizeof(double) * sk->dims);
+
+    double t0 = omp_get_wtime();
+    struct KNN_Pair **approx = sketch_search(sk, queries, k, 0, factor);
+    *sketch_time = omp_get_wtime() - t0;
+    t0 = omp_get_wtime();
+    struct KNN_Pair **exact = knn_search(sk->data, queries, k, 0);
+    *exact_time = omp_get_wtime() - t0;
+
+    KNN_Pair_destroy_table(approx, samples);
+    KNN_Pair_destroy_table(exact, samples);
+    matrix_destroy(queries);
+    return samples;
+}
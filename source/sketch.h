@@ -0,0 +1,35 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* Two-stage search: every row is projected to s dimensions with a seeded Gaussian
+ * random projection (Johnson-Lindenstrauss), the queries scan those sketches for a
+ * shortlist of factor * k candidates and only the shortlist pays the full distance.
+ */
+typedef struct sketch_t {
+    int rows;
+    int dims;
+    int s;
+    double *proj;        /* dims x s, N(0, 1/s) entries, identical on every rank for one seed */
+    double *codes;       /* rows x s, contiguous */
+    matrix_t *data;      /* original vectors for the exact re-rank, not owned */
+} sketch_t;
+
+sketch_t *sketch_build(matrix_t *data, int s, uint64_t seed);
+void sketch_destroy(sketch_t *sk);
+
+size_t sketch_memory(sketch_t *sk);
+
+struct KNN_Pair **sketch_search(sketch_t *sk, matrix_t *points, int k, int i_offset, int factor);
+struct KNN_Pair **sketch_search_self(sketch_t *sk, int k, int i_offset, int factor);
+
+/* times sketch_search and the brute-force knn_search on the same sampled rows;
+ * returns the number of rows sampled */
+int sketch_benchmark(sketch_t *sk, int k, int factor, int samples, uint64_t seed,
+                      double *sketch_time, double *exact_time);
+
+#endif
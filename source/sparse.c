@@ -0,0 +1,384 @@
+#include "sparse.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+sparse_t *sparse_create(int32_t rows, int32_t cols, int64_t nnz) {
+    sparse_t *s = (sparse_t*) calloc(1, sizeof(sparse_t));
+    if (!s) return NULL;
+    s->rows = rows;
+    s->cols = cols;
+    s->nnz = nnz;
+    s->row_start = (int64_t*) calloc(rows + 1, sizeof(int64_t));
+    s->col_idx = (int32_t*) malloc(sizeof(int32_t) * (nnz > 0 ? nnz : 1));
+    s->values = (double*) malloc(sizeof(double) * (nnz > 0 ? nnz : 1));
+    s->sq_norms = (double*) calloc(rows > 0 ? rows : 1, sizeof(double));
+    if (!s->row_start || !s->col_idx || !s->values || !s->sq_norms) {
+        sparse_destroy(s);
+        return NULL;
+    }
+    return s;
+}
+
+void sparse_destroy(sparse_t *s) {
+    if (!s) return;
+    free(s->row_start);
+    free(s->col_idx);
+    free(s->values);
+    free(s->sq_norms);
+    free(s);
+}
+
+void sparse_compute_norms(sparse_t *s) {
+    for (int32_t r = 0; r < s->rows; ++r) {
+        double n = 0.0;
+        for (int64_t e = s->row_start[r]; e < s->row_start[r+1]; ++e) n += s->values[e] * s->values[e];
+        s->sq_norms[r] = n;
+    }
+}
+
+size_t sparse_memory(sparse_t *s) {
+    return sizeof(int64_t) * ((size_t) s->rows + 1) + (sizeof(int32_t) + sizeof(double)) * (size_t) s->nnz
+         + sizeof(double) * (size_t) s->rows;
+}
+
+typedef struct sparse_entry_t {
+    int32_t col;
+    double value;
+} sparse_entry_t;
+
+static int entry_col_comp(const void *a, const void *b) {
+    int32_t x = ((const sparse_entry_t*) a)->col, y = ((const sparse_entry_t*) b)->col;
+    return (x > y) - (x < y);
+}
+
+/* data lines of a libsvm file: "label idx:value ...", 1-based indices, '#' comments */
+static int libsvm_data_line(const char *line) {
+    while (*line && isspace((unsigned char) *line)) line++;
+    return *line != '\0' && *line != '#';
+}
+
+/* sparse_load_split_libsvm: rows of chunk req_chunk (same split as matrix_load_split_txt)
+ * into CSR; the first token of each line is the label. The column count is the largest
+ * index in the whole file so that every rank agrees on it.
+ */
+int sparse_load_split_libsvm(const char *filename, int32_t chunks_num, int32_t req_chunk,
+                             sparse_t **out_data, matrix_t **out_labels) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: sparse_load_split_libsvm: cannot open %s\n", filename);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int total_rows = 0;
+    int32_t cols = 0;
+    while (getline(&line, &cap, f) != -1) {
+        if (!libsvm_data_line(line)) continue;
+        total_rows++;
+        for (char *p = strchr(line, ':'); p; p = strchr(p + 1, ':')) {
+            char *q = p;
+            while (q > line && isdigit((unsigned char) q[-1])) q--;
+            int32_t idx = (int32_t) atol(q);
+            if (idx > cols) cols = idx;
+        }
+    }
+
+    if (chunks_num <= 0) chunks_num = 1;
+    int32_t base_rows = total_rows / chunks_num;
+    int remaining = total_rows % chunks_num;
+    int32_t rows;
+    long offset;
+    if (req_chunk < remaining) { rows = base_rows + 1; offset = (long) req_chunk * rows; }
+    else { rows = base_rows; offset = ((long) (base_rows + 1) * remaining) + ((long) base_rows * (req_chunk - remaining)); }
+
+    /* chunk rows are parsed into growable entry arrays, then packed */
+    int64_t *row_start = (int64_t*) calloc(rows + 1, sizeof(int64_t));
+    double *row_labels = (double*) malloc(sizeof(double) * (rows > 0 ? rows : 1));
+    size_t ecap = 1024, nnz = 0;
+    sparse_entry_t *entries = (sparse_entry_t*) malloc(sizeof(sparse_entry_t) * ecap);
+    if (!row_start || !row_labels || !entries) {
+        free(row_start); free(row_labels); free(entries); free(line); fclose(f);
+        return -1;
+    }
+
+    rewind(f);
+    int cur = 0, filled = 0;
+    while (filled < rows && getline(&line, &cap, f) != -1) {
+        if (!libsvm_data_line(line)) continue;
+        if (cur++ < offset) continue;
+        char *tok = strtok(line, " \t\r\n");
+        row_labels[filled] = tok ? atof(tok) : NAN;
+        size_t first = nnz;
+        for (tok = strtok(NULL, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            char *colon = strchr(tok, ':');
+            if (!colon) continue;
+            int32_t idx = (int32_t) atol(tok);
+            double v = atof(colon + 1);
+            if (idx < 1 || v == 0.0) continue;
+            if (nnz == ecap) {
+                sparse_entry_t *grown = (sparse_entry_t*) realloc(entries, sizeof(sparse_entry_t) * ecap * 2);
+                if (!grown) {
+                    free(row_start); free(row_labels); free(entries); free(line); fclose(f);
+                    return -1;
+                }
+                entries = grown;
+                ecap *= 2;
+            }
+            entries[nnz].col = idx - 1;
+            entries[nnz++].value = v;
+        }
+        /* ascending columns, repeated indices summed */
+        qsort(entries + first, nnz - first, sizeof(sparse_entry_t), entry_col_comp);
+        size_t w = first;
+        for (size_t e = first; e < nnz; ++e) {
+            if (w > first && entries[w-1].col == entries[e].col) entries[w-1].value += entries[e].value;
+            else entries[w++] = entries[e];
+        }
+        nnz = w;
+        row_start[++filled] = (int64_t) nnz;
+    }
+    free(line);
+    fclose(f);
+    if (filled != rows) {
+        free(row_start); free(row_labels); free(entries);
+        return -1;
+    }
+
+    sparse_t *s = sparse_create(rows, cols, (int64_t) nnz);
+    matrix_t *labels = matrix_create(rows, 1);
+    if (!s || !labels) {
+        sparse_destroy(s); matrix_destroy(labels);
+        free(row_start); free(row_labels); free(entries);
+        return -1;
+    }
+    memcpy(s->row_start, row_start, sizeof(int64_t) * (rows + 1));
+    for (size_t e = 0; e < nnz; ++e) {
+        s->col_idx[e] = entries[e].col;
+        s->values[e] = entries[e].value;
+    }
+    for (int32_t r = 0; r < rows; ++r) labels->data[r][0] = row_labels[r];
+    s->chunk_offset = (int32_t) offset;
+    labels->chunk_offset = (int32_t) offset;
+    sparse_compute_norms(s);
+    free(row_start);
+    free(row_labels);
+    free(entries);
+
+    *out_data = s;
+    *out_labels = labels;
+    return 0;
+}
+
+/* column-major copy of data (postings per column) plus rows sorted by norm */
+typedef struct sparse_index_t {
+    int64_t *col_start;
+    int32_t *rows;
+    double *values;
+    int32_t *by_norm;
+} sparse_index_t;
+
+/* (squared norm, row) pairs, ties by row */
+static int norm_comp(const void *a, const void *b) {
+    const struct KNN_Pair *x = (const struct KNN_Pair*) a, *y = (const struct KNN_Pair*) b;
+    if (x->distance != y->distance) return x->distance < y->distance ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static void sparse_index_free(sparse_index_t *ix) {
+    free(ix->col_start);
+    free(ix->rows);
+    free(ix->values);
+    free(ix->by_norm);
+}
+
+static int sparse_index_build(const sparse_t *data, sparse_index_t *ix) {
+    ix->col_start = (int64_t*) calloc((size_t) data->cols + 1, sizeof(int64_t));
+    ix->rows = (int32_t*) malloc(sizeof(int32_t) * (data->nnz > 0 ? data->nnz : 1));
+    ix->values = (double*) malloc(sizeof(double) * (data->nnz > 0 ? data->nnz : 1));
+    ix->by_norm = (int32_t*) malloc(sizeof(int32_t) * (data->rows > 0 ? data->rows : 1));
+    int64_t *fill = (int64_t*) malloc(sizeof(int64_t) * ((size_t) data->cols + 1));
+    if (!ix->col_start || !ix->rows || !ix->values || !ix->by_norm || !fill) {
+        free(fill);
+        sparse_index_free(ix);
+        return -1;
+    }
+    for (int64_t e = 0; e < data->nnz; ++e) ix->col_start[data->col_idx[e] + 1]++;
+    for (int32_t c = 0; c < data->cols; ++c) ix->col_start[c+1] += ix->col_start[c];
+    memcpy(fill, ix->col_start, sizeof(int64_t) * ((size_t) data->cols + 1));
+    for (int32_t r = 0; r < data->rows; ++r) {
+        for (int64_t e = data->row_start[r]; e < data->row_start[r+1]; ++e) {
+            int64_t pos = fill[data->col_idx[e]]++;
+            ix->rows[pos] = r;
+            ix->values[pos] = data->values[e];
+        }
+    }
+    free(fill);
+    struct KNN_Pair *order = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * (data->rows > 0 ? data->rows : 1));
+    if (!order) {
+        sparse_index_free(ix);
+        return -1;
+    }
+    for (int32_t r = 0; r < data->rows; ++r) {
+        order[r].distance = data->sq_norms[r];
+        order[r].index = r;
+    }
+    qsort(order, data->rows, sizeof(struct KNN_Pair), norm_comp);
+    for (int32_t r = 0; r < data->rows; ++r) ix->by_norm[r] = order[r].index;
+    free(order);
+    return 0;
+}
+
+/* ||q - x||^2 = ||q||^2 + ||x||^2 - 2 q.x, clamped at 0 against rounding */
+static inline double sparse_sq_dist(double q_norm, double x_norm, double dot) {
+    double d = q_norm + x_norm - 2.0 * dot;
+    return d > 0.0 ? d : 0.0;
+}
+
+/* sparse-dense kernel: every data row against a dense query, O(nnz(data)) */
+static void sparse_scan_dense(const sparse_t *data, const double *q, double q_norm,
+                              struct KNN_Pair *list, int k, int i_offset, int skip) {
+    for (int32_t r = 0; r < data->rows; ++r) {
+        if (r == skip) continue;
+        double dot = 0.0;
+        for (int64_t e = data->row_start[r]; e < data->row_start[r+1]; ++e)
+            dot += data->values[e] * q[data->col_idx[e]];
+        knn_push(list, k, sparse_sq_dist(q_norm, data->sq_norms[r], dot), i_offset + r);
+    }
+}
+
+/* sparse-sparse search. Queries whose postings cost less than a full pass go through the
+ * inverted index: dot products only for rows sharing a column, and among the rows sharing
+ * none (distance ||q||^2 + ||x||^2) only the smallest norms. Denser queries are scattered
+ * into a dense buffer and use the sparse-dense kernel. self != 0 skips row p for query p.
+ */
+static struct KNN_Pair **sparse_search(sparse_t *data, sparse_t *points, int k, int i_offset, int self) {
+    int P = points->rows, rows = data->rows;
+    sparse_index_t ix;
+    if (sparse_index_build(data, &ix) != 0) return NULL;
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(P, k);
+    if (!results) { sparse_index_free(&ix); return NULL; }
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        double *acc = (double*) calloc(rows > 0 ? rows : 1, sizeof(double));
+        char *seen = (char*) calloc(rows > 0 ? rows : 1, 1);
+        int32_t *touched = (int32_t*) malloc(sizeof(int32_t) * (rows > 0 ? rows : 1));
+        double *dense = (double*) calloc((size_t) data->cols + 1, sizeof(double));
+        int ok = acc && seen && touched && dense;
+        if (!ok) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int p = 0; p < P; ++p) {
+            if (!ok) continue;
+            struct KNN_Pair *list = results[p];
+            int skip = self ? p : -1;
+            double q_norm = points->sq_norms[p];
+            int64_t cost = 0;
+            for (int64_t e = points->row_start[p]; e < points->row_start[p+1]; ++e)
+                if (points->col_idx[e] < data->cols)
+                    cost += ix.col_start[points->col_idx[e] + 1] - ix.col_start[points->col_idx[e]];
+
+            if (cost * 2 > data->nnz) {
+                for (int64_t e = points->row_start[p]; e < points->row_start[p+1]; ++e)
+                    if (points->col_idx[e] < data->cols) dense[points->col_idx[e]] = points->values[e];
+                sparse_scan_dense(data, dense, q_norm, list, k, i_offset, skip);
+                for (int64_t e = points->row_start[p]; e < points->row_start[p+1]; ++e)
+                    if (points->col_idx[e] < data->cols) dense[points->col_idx[e]] = 0.0;
+                continue;
+            }
+
+            int n = 0;
+            for (int64_t e = points->row_start[p]; e < points->row_start[p+1]; ++e) {
+                int32_t c = points->col_idx[e];
+                if (c >= data->cols) continue;
+                for (int64_t t = ix.col_start[c]; t < ix.col_start[c+1]; ++t) {
+                    int32_t r = ix.rows[t];
+                    if (!seen[r]) { seen[r] = 1; touched[n++] = r; }
+                    acc[r] += points->values[e] * ix.values[t];
+                }
+            }
+            for (int t = 0; t < n; ++t) {
+                int32_t r = touched[t];
+                if (r != skip)
+                    knn_push(list, k, sparse_sq_dist(q_norm, data->sq_norms[r], acc[r]), i_offset + r);
+            }
+            /* rows sharing no column, by ascending norm, until they cannot enter the list */
+            for (int32_t o = 0; o < rows; ++o) {
+                int32_t r = ix.by_norm[o];
+                if (seen[r] || r == skip) continue;
+                double d = q_norm + data->sq_norms[r];
+                if (d > list[k-1].distance) break;
+                knn_push(list, k, d, i_offset + r);
+            }
+            for (int t = 0; t < n; ++t) {
+                seen[touched[t]] = 0;
+                acc[touched[t]] = 0.0;
+            }
+        }
+        free(acc);
+        free(seen);
+        free(touched);
+        free(dense);
+
+        #pragma omp for schedule(static)
+        for (int p = 0; p < P; ++p)
+            for (int j = 0; j < k; ++j)
+                if (results[p][j].index != -1) results[p][j].distance = sqrt(results[p][j].distance);
+    }
+    sparse_index_free(&ix);
+    if (failed) {
+        fprintf(stderr, "ERROR: sparse_search: out of memory\n");
+        KNN_Pair_destroy_table(results, P);
+        return NULL;
+    }
+    return results;
+}
+
+/* all-kNN of the rows of data, self-matches excluded */
+struct KNN_Pair **sparse_knn_search_self(sparse_t *data, int k, int i_offset) {
+    if (!data || k < 1) return NULL;
+    return sparse_search(data, data, k, i_offset, 1);
+}
+
+/* sparse data against dense query rows (columns beyond data->cols are ignored) */
+struct KNN_Pair **sparse_knn_search_dense(sparse_t *data, matrix_t *points, int k, int i_offset) {
+    if (!data || !points || k < 1) return NULL;
+    int P = matrix_get_rows(points);
+    int cols = matrix_get_cols(points);
+    struct KNN_Pair **results = KNN_Pair_create_empty_table(P, k);
+    if (!results) return NULL;
+
+    int failed = 0;
+    #pragma omp parallel
+    {
+        double *q = (double*) calloc((size_t) data->cols + 1, sizeof(double));
+        if (!q) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        #pragma omp for schedule(dynamic, 16)
+        for (int p = 0; p < P; ++p) {
+            if (!q) continue;
+            double q_norm = 0.0;
+            for (int c = 0; c < cols; ++c) q_norm += points->data[p][c] * points->data[p][c];
+            for (int c = 0; c < cols && c < data->cols; ++c) q[c] = points->data[p][c];
+            sparse_scan_dense(data, q, q_norm, results[p], k, i_offset, -1);
+            for (int j = 0; j < k; ++j)
+                if (results[p][j].index != -1) results[p][j].distance = sqrt(results[p][j].distance);
+        }
+        free(q);
+    }
+    if (failed) {
+        fprintf(stderr, "ERROR: sparse_knn_search_dense: out of memory\n");
+        KNN_Pair_destroy_table(results, P);
+        return NULL;
+    }
+    return results;
+}
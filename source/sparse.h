@@ -0,0 +1,32 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "matrix.h"
+#include "knn.h"
+
+/* CSR matrix: columns ascending inside each row, squared row norms kept for distances */
+typedef struct sparse_t {
+    int32_t rows;
+    int32_t cols;
+    int64_t nnz;
+    int64_t *row_start;   /* rows + 1 */
+    int32_t *col_idx;     /* nnz */
+    double *values;       /* nnz */
+    double *sq_norms;     /* rows */
+    int32_t chunk_offset;
+} sparse_t;
+
+sparse_t *sparse_create(int32_t rows, int32_t cols, int64_t nnz);
+void sparse_destroy(sparse_t *s);
+void sparse_compute_norms(sparse_t *s);
+size_t sparse_memory(sparse_t *s);
+
+int sparse_load_split_libsvm(const char *filename, int32_t chunks_num, int32_t req_chunk,
+                             sparse_t **out_data, matrix_t **out_labels);
+
+struct KNN_Pair **sparse_knn_search_dense(sparse_t *data, matrix_t *points, int k, int i_offset);
+struct KNN_Pair **sparse_knn_search_self(sparse_t *data, int k, int i_offset);
+
+#endif
@@ -7,8 +7,21 @@
 
 #include "matrix.h"
 #include "knn.h"
+#include "partition.h"
+#include "codec.h"
+#include "hier_comm.h"
+#include "range_search.h"
+#include "sparse.h"
+#include "metric.h"
 
 #define MPI_MASTER 0
+/* rows scanned between deadline checks in --deadline mode */
+#define ANYTIME_BLOCK 1024
+/* doubles per neighbour record: distance, index, 6 features, label */
+#define RECORD_FIELDS 9
+/* --deadline: share of the deadline spent scanning; the rest is left for the replies */
+#define ANYTIME_SCAN_SHARE 0.8
+#define ANYTIME_TAG 39
 
 double get_elapsed_time(struct timeval start, struct timeval stop) {
     double elapsed_time = (stop.tv_sec - start.tv_sec) * 1.0;
@@ -16,9 +29,162 @@ double get_elapsed_time(struct timeval start, struct timeval stop) {
     return elapsed_time;
 }
 
+static int double_asc_comp(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/* anytime scan: searches the rows block by block, each block bounded by the current k-th
+ * distance, until every row is seen or the deadline passes (the first block always runs) */
+static struct KNN_Pair **anytime_search(matrix_t *data, matrix_t *query, int k,
+                                        double deadline, int *scanned) {
+    int rows = matrix_get_rows(data);
+    int offset = matrix_get_chunk_offset(data);
+    struct KNN_Pair **best = KNN_Pair_create_empty_table(1, k);
+    struct KNN_Pair *merged = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * k);
+    if (!best || !merged) { KNN_Pair_destroy_table(best, 1); free(merged); return NULL; }
+    *scanned = 0;
+    for (int start = 0; start < rows; start += ANYTIME_BLOCK) {
+        if (start > 0 && MPI_Wtime() >= deadline) break;
+        matrix_t view = *data;
+        view.rows = rows - start < ANYTIME_BLOCK ? rows - start : ANYTIME_BLOCK;
+        view.data = data->data + start;
+        view.row_ids = NULL;
+        struct KNN_Pair **part = knn_search_bounded(&view, query, k, offset + start,
+                                                    best[0][k-1].distance);
+        if (!part) break;
+        for (int i = 0, a = 0, b = 0; i < k; ++i) {
+            int take_a = b >= k || (a < k && (best[0][a].distance < part[0][b].distance ||
+                        (best[0][a].distance == part[0][b].distance && best[0][a].index <= part[0][b].index)));
+            merged[i] = take_a ? best[0][a++] : part[0][b++];
+        }
+        memcpy(best[0], merged, sizeof(struct KNN_Pair) * k);
+        KNN_Pair_destroy_table(part, 1);
+        *scanned += view.rows;
+    }
+    free(merged);
+    return best;
+}
+
+/* --radius mode: every reference point within r of the query, from the grid index of
+ * each rank; only the ranks whose box intersects the ball search and reply */
+static int range_query_run(matrix_t *local_data, matrix_t *query, double radius, int k, int rank) {
+    int dims = matrix_get_cols(query);
+    double b0 = MPI_Wtime();
+    range_grid_t *grid = range_grid_build(local_data, dims, radius);
+    partition_t *bounds = partition_gather_bounds(local_data, dims, MPI_COMM_WORLD);
+    double build_time = MPI_Wtime() - b0, max_build = 0.0;
+    if (!grid || !bounds) {
+        fprintf(stderr, "ERROR: rank %d no pudo construir la rejilla\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Reduce(&build_time, &max_build, 1, MPI_DOUBLE, MPI_MAX, MPI_MASTER, MPI_COMM_WORLD);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double s0 = MPI_Wtime();
+    int hits = 0, contacted = 0;
+    int64_t examined = 0;
+    double *records = range_search_distributed(grid, bounds, query->data[0], radius, MPI_MASTER,
+                                               MPI_COMM_WORLD, &hits, &contacted, &examined);
+    double elapsed = MPI_Wtime() - s0;
+
+    long local_counts[2] = { (long) examined, matrix_get_rows(local_data) }, counts[2] = { 0, 0 };
+    MPI_Reduce(local_counts, counts, 2, MPI_LONG, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
+
+    if (rank == MPI_MASTER) {
+        int fields = 2 + matrix_get_cols(local_data);
+        printf("\nRejilla uniforme (celda %.3f) construida en %.6f segundos\n", grid->cell, max_build);
+        printf("Búsqueda por radio r=%.3f: %d vecinos en %.6f segundos, %d de %d procesos contactados, "
+               "%ld de %ld filas examinadas\n",
+               radius, hits, elapsed, contacted, bounds->parts, counts[0], counts[1]);
+
+        int label_counts[2048] = {0};
+        int best_label = -1, best_count = 0;
+        for (int i = 0; i < hits; ++i) {
+            const double *rec = records + (size_t) fields * i;
+            if (i < k)
+                printf("%d) idx=%d  edad=%.1f estatura=%.1f peso=%.1f glucosa=%.1f fc=%.1f oxigeno=%.1f  label=%.0f  dist=%.6f\n",
+                       i + 1, (int) rec[1], rec[2], rec[3], rec[4], rec[5], rec[6], rec[7], rec[8], rec[0]);
+            int li = (int) rec[8];
+            if (li >= 0 && li < 2048 && ++label_counts[li] > best_count) {
+                best_count = label_counts[li];
+                best_label = li;
+            }
+        }
+        if (hits > k) printf("... (%d vecinos más dentro del radio)\n", hits - k);
+        printf("\nPredicted class: %d (votes=%d de %d)\n", best_label, best_count, hits);
+    }
+    free(records);
+    partition_destroy(bounds);
+    range_grid_destroy(grid);
+    return 0;
+}
+
+/* --sparse mode: the dense query against a libsvm dataset kept in CSR on every rank, with
+ * the sparse-dense kernel; the master merges the (distance, row, label) lists */
+static int sparse_query_run(const char *fn, matrix_t *query, int k, int rank, int tasks_num) {
+    sparse_t *data = NULL;
+    matrix_t *labels = NULL;
+    if (sparse_load_split_libsvm(fn, tasks_num, rank, &data, &labels) != 0) {
+        fprintf(stderr, "ERROR: rank %d no pudo cargar %s\n", rank, fn);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    double s0 = MPI_Wtime();
+    struct KNN_Pair **knns = sparse_knn_search_dense(data, query, k, data->chunk_offset);
+    if (!knns) {
+        fprintf(stderr, "ERROR: rank %d: la búsqueda dispersa falló\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    double *sendbuf = (double*) malloc(sizeof(double) * 3 * k);
+    double *recvbuf = rank == MPI_MASTER ? (double*) malloc(sizeof(double) * 3 * k * tasks_num) : NULL;
+    for (int i = 0; i < k; ++i) {
+        int r = knns[0][i].index - data->chunk_offset;
+        sendbuf[3 * i] = knns[0][i].distance;
+        sendbuf[3 * i + 1] = knns[0][i].index;
+        sendbuf[3 * i + 2] = r >= 0 && r < data->rows ? labels->data[r][0] : NAN;
+    }
+    MPI_Gather(sendbuf, 3 * k, MPI_DOUBLE, recvbuf, 3 * k, MPI_DOUBLE, MPI_MASTER, MPI_COMM_WORLD);
+    double elapsed = MPI_Wtime() - s0;
+
+    long local_counts[2] = { (long) data->nnz, data->rows }, counts[2] = { 0, 0 };
+    MPI_Reduce(local_counts, counts, 2, MPI_LONG, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
+    if (rank == MPI_MASTER) {
+        int total = k * tasks_num;
+        struct KNN_Pair *all = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * total);
+        for (int i = 0; i < total; ++i) {
+            all[i].distance = recvbuf[3 * i];
+            all[i].index = i;   /* position in recvbuf, to find the label again */
+        }
+        qsort(all, total, sizeof(struct KNN_Pair), KNN_Pair_asc_comp);
+        printf("\nBúsqueda dispersa (CSR, %d columnas, %ld no ceros en %ld filas) en %.6f segundos\n",
+               data->cols, counts[0], counts[1], elapsed);
+        int label_counts[2048] = {0};
+        int best_label = -1, best_count = 0;
+        for (int i = 0, shown = 0; i < total && shown < k; ++i) {
+            const double *rec = recvbuf + 3 * all[i].index;
+            if ((int) rec[1] < 0) continue;
+            printf("%d) idx=%d  label=%.0f  dist=%.6f\n", ++shown, (int) rec[1], rec[2], rec[0]);
+            int li = (int) rec[2];
+            if (!isnan(rec[2]) && li >= 0 && li < 2048 && ++label_counts[li] > best_count) {
+                best_count = label_counts[li];
+                best_label = li;
+            }
+        }
+        printf("\nPredicted class: %d (votes=%d)\n", best_label, best_count);
+        free(all);
+    }
+    free(sendbuf);
+    free(recvbuf);
+    KNN_Pair_destroy_table(knns, 1);
+    sparse_destroy(data);
+    matrix_destroy(labels);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 8) {
-    printf("Uso: %s <edad> <estatura> <peso> <glucosa> <fc> <oxigeno> <k>\n", argv[0]);
+    if (argc < 8) {
+    printf("Uso: %s <edad> <estatura> <peso> <glucosa> <fc> <oxigeno> <k> [--repartition] [--route] [--deadline <ms>] [--hier] [--radius <r>] [--sparse <libsvm>] [--metric <euclid|cosine|ip|wl2>] [--weights <w1,...,w6>]\n", argv[0]);
     return -1;
 }
 
@@ -32,11 +198,66 @@ int main(int argc, char *argv[]) {
 
     if (k <= 0) { fprintf(stderr, "k debe ser > 0\n"); return -1; }
 
+    int repartition = 0, route = 0, hier = 0;
+    double radius = -1.0;
+    char *sparse_fn = NULL;
+    char *weights_arg = NULL;
+    metric_kind_t metric_kind = METRIC_EUCLIDEAN;
+    double deadline_ms = -1.0;
+    for (int a = 8; a < argc; ++a) {
+        if (strcmp(argv[a], "--repartition") == 0) repartition = 1;
+        else if (strcmp(argv[a], "--route") == 0) route = 1;
+        else if (strcmp(argv[a], "--hier") == 0) hier = 1;
+        else if (strcmp(argv[a], "--deadline") == 0 && a + 1 < argc) deadline_ms = atof(argv[++a]);
+        else if (strcmp(argv[a], "--radius") == 0 && a + 1 < argc) radius = atof(argv[++a]);
+        else if (strcmp(argv[a], "--sparse") == 0 && a + 1 < argc) sparse_fn = argv[++a];
+        else if (strcmp(argv[a], "--weights") == 0 && a + 1 < argc) weights_arg = argv[++a];
+        else if (strcmp(argv[a], "--metric") == 0 && a + 1 < argc) {
+            if (metric_parse(argv[++a], &metric_kind) != 0) {
+                fprintf(stderr, "ERROR: --metric espera euclid, cosine, ip o wl2\n");
+                return -1;
+            }
+        }
+        else { fprintf(stderr, "ERROR: opción desconocida %s\n", argv[a]); return -1; }
+    }
+    if (deadline_ms >= 0.0 && (route || hier)) {
+        fprintf(stderr, "ERROR: --deadline no se combina con --route ni --hier\n");
+        return -1;
+    }
+    if (radius >= 0.0 && (route || hier || deadline_ms >= 0.0)) {
+        fprintf(stderr, "ERROR: --radius ya contacta solo los procesos cercanos; no se combina con --route, --hier ni --deadline\n");
+        return -1;
+    }
+
+    if (sparse_fn && (repartition || route || hier || deadline_ms >= 0.0 || radius >= 0.0)) {
+        fprintf(stderr, "ERROR: --sparse no se combina con --repartition, --route, --hier, --deadline ni --radius\n");
+        return -1;
+    }
+
+    if (weights_arg && metric_kind != METRIC_WEIGHTED_L2) {
+        fprintf(stderr, "ERROR: --weights solo se aplica a --metric wl2\n");
+        return -1;
+    }
+    if (metric_kind != METRIC_EUCLIDEAN && (route || deadline_ms >= 0.0 || radius >= 0.0 || sparse_fn)) {
+        fprintf(stderr, "ERROR: --metric solo se aplica a la búsqueda exacta (sin --route, --deadline, --radius ni --sparse)\n");
+        return -1;
+    }
+
     int tasks_num = 1, rank = 0;
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &tasks_num);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
+    if (sparse_fn) {
+        matrix_t *dense_query = matrix_create(1, 6);
+        double feats[6] = { edad, estatura, peso, glucosa, fc, oxigeno };
+        for (int f = 0; f < 6; ++f) matrix_set_cell(dense_query, 0, f, feats[f]);
+        int rc = sparse_query_run(sparse_fn, dense_query, k, rank, tasks_num);
+        matrix_destroy(dense_query);
+        MPI_Finalize();
+        return rc;
+    }
+
     const char *data_fn = "dataset/input.txt"; //dataset con 6 features + 1 label
 
     /* Each proc loads its chunk */
@@ -55,6 +276,12 @@ int main(int argc, char *argv[]) {
         MPI_Finalize();
         return -1;
     }
+    if (repartition &&
+        partition_redistribute_spatial(&local_data, NULL, cols - 1, CODEC_RAW, 0.0, MPI_COMM_WORLD) != 0) {
+        fprintf(stderr, "ERROR: rank %d no pudo redistribuir los datos\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
     matrix_t *query = matrix_create(1, cols - 1);
     matrix_set_cell(query, 0, 0, edad);
     matrix_set_cell(query, 0, 1, estatura);
@@ -63,13 +290,137 @@ int main(int argc, char *argv[]) {
     matrix_set_cell(query, 0, 4, fc);
     matrix_set_cell(query, 0, 5, oxigeno);
 
+    if (radius >= 0.0) {
+        int rc = range_query_run(local_data, query, radius, k, rank);
+        matrix_destroy(local_data);
+        matrix_destroy(query);
+        MPI_Finalize();
+        return rc;
+    }
+
+    /* --metric: the features without the label column, with the metric's per-row or
+     * per-column state (wl2 weights from the global variances unless given) */
+    matrix_t *features = NULL;
+    metric_t *metric = NULL;
+    if (metric_kind != METRIC_EUCLIDEAN) {
+        int dims = cols - 1, rows = matrix_get_rows(local_data);
+        features = matrix_create(rows, dims);
+        double *moments = NULL, *weights = NULL;
+        if (!features) {
+            fprintf(stderr, "ERROR: rank %d sin memoria para las columnas\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        for (int r = 0; r < rows; ++r)
+            memcpy(features->data[r], local_data->data[r], sizeof(double) * dims);
+        if (weights_arg) {
+            weights = (double*) malloc(sizeof(double) * dims);
+            if (!weights) {
+                fprintf(stderr, "ERROR: rank %d sin memoria para los pesos\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            if (metric_parse_weights(weights_arg, dims, weights) != 0) {
+                /* todos los procesos leen la misma lista y salen juntos */
+                if (rank == MPI_MASTER)
+                    fprintf(stderr, "ERROR: --weights espera %d pesos no negativos separados por comas\n", dims);
+                MPI_Finalize();
+                return -1;
+            }
+        } else if (metric_kind == METRIC_WEIGHTED_L2) {
+            moments = (double*) malloc(sizeof(double) * (1 + 2 * dims));
+            metric_moments(features, dims, moments);
+            MPI_Allreduce(MPI_IN_PLACE, moments, 1 + 2 * dims, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        }
+        metric = metric_create(metric_kind, features, moments, weights);
+        free(moments);
+        free(weights);
+        if (!metric) {
+            fprintf(stderr, "ERROR: rank %d no pudo preparar la métrica %s\n", rank, metric_name(metric_kind));
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
+    /* two-level communication: the master's query reaches every node leader, then its node,
+     * and the top-k lists are merged inside every node first */
+    hier_comm_t *hc = hier ? hier_comm_create(MPI_COMM_WORLD) : NULL;
+    if (hc) hier_bcast(hc, query->data[0], cols - 1, MPI_DOUBLE);
+
+    /* with a deadline the master may answer before every rank reports, so the row count
+     * is known up front */
+    int total_scanned = 0, total_rows = 0, local_rows = matrix_get_rows(local_data);
+    if (deadline_ms >= 0.0)
+        MPI_Reduce(&local_rows, &total_rows, 1, MPI_INT, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
+
+    /* Partition summaries are shared once, before any query is timed */
+    partition_t *bounds = route ? partition_gather_bounds(local_data, cols - 1, MPI_COMM_WORLD) : NULL;
+
     /* --- Medición de tiempo total --- */
-    MPI_Barrier(MPI_COMM_WORLD);
+    if (hc) hier_barrier(hc);
+    else MPI_Barrier(MPI_COMM_WORLD);
     struct timeval t0, t1;
     gettimeofday(&t0, NULL);
 
-    /* Each process computes its k nearest neighbors for the single query against its local_data */
-    struct KNN_Pair **local_knns = knn_search(local_data, query, k, matrix_get_chunk_offset(local_data));
+    struct KNN_Pair **local_knns = NULL;
+    int scanned = 0;
+    double search_time = 0.0, s0;
+
+    double query_start = MPI_Wtime();
+    if (deadline_ms >= 0.0) {
+        /* Anytime mode: every rank stops scanning at the same share of the deadline with its
+         * best-so-far, leaving the rest of it for the replies */
+        s0 = MPI_Wtime();
+        local_knns = anytime_search(local_data, query, k,
+                                    query_start + ANYTIME_SCAN_SHARE * deadline_ms / 1000.0, &scanned);
+        search_time += MPI_Wtime() - s0;
+    } else if (!route) {
+        /* Each process computes its k nearest neighbors for the single query against its local_data */
+        s0 = MPI_Wtime();
+        if (metric)
+            local_knns = metric_search(metric, features, query, k, matrix_get_chunk_offset(local_data));
+        else
+            local_knns = knn_search(local_data, query, k, matrix_get_chunk_offset(local_data));
+        search_time += MPI_Wtime() - s0;
+        scanned = matrix_get_rows(local_data);
+    } else {
+        /* Two-phase routing: the ranks whose boxes are closest to the query (enough rows for k)
+         * search first; the k-th distance they find is the bound for the rest, which skip the
+         * scan when their box lies beyond it. */
+        double *box_dists = (double*) malloc(sizeof(double) * tasks_num);
+        int32_t *order = partition_order_by_distance(bounds, query->data[0], box_dists);
+        int first_phase = 0;
+        for (int i = 0, covered = 0; i < tasks_num && covered < k; ++i) {
+            if (order[i] == rank) first_phase = 1;
+            covered += bounds->rows[order[i]];
+        }
+
+        double *kth = (double*) malloc(sizeof(double) * k);
+        double *all_kth = (double*) malloc(sizeof(double) * k * tasks_num);
+        if (first_phase) {
+            s0 = MPI_Wtime();
+            local_knns = knn_search(local_data, query, k, matrix_get_chunk_offset(local_data));
+            search_time += MPI_Wtime() - s0;
+            scanned = matrix_get_rows(local_data);
+        }
+        for (int i = 0; i < k; ++i) kth[i] = local_knns ? local_knns[0][i].distance : 1e300;
+        MPI_Allgather(kth, k, MPI_DOUBLE, all_kth, k, MPI_DOUBLE, MPI_COMM_WORLD);
+        qsort(all_kth, k * tasks_num, sizeof(double), double_asc_comp);
+        double bound = all_kth[k-1];
+
+        if (!first_phase) {
+            if (bound < 1e300 && sqrt(box_dists[rank]) > bound) {
+                local_knns = KNN_Pair_create_empty_table(1, k);
+            } else {
+                s0 = MPI_Wtime();
+                local_knns = knn_search_bounded(local_data, query, k,
+                                                matrix_get_chunk_offset(local_data), bound);
+                search_time += MPI_Wtime() - s0;
+                scanned = matrix_get_rows(local_data);
+            }
+        }
+        free(kth);
+        free(all_kth);
+        free(order);
+        free(box_dists);
+    }
     if (!local_knns) {
         if (rank == MPI_MASTER) fprintf(stderr, "ERROR: knn_search failed\n");
         matrix_destroy(local_data); matrix_destroy(query);
@@ -78,7 +429,7 @@ int main(int argc, char *argv[]) {
     }
 
     /* Prepare send buffer: per neighbor: distance, index, x, y, label (5 doubles) */
-    int elems_per = 9;
+    int elems_per = RECORD_FIELDS;
     double *sendbuf = (double*) malloc(sizeof(double) * k * elems_per);
     for (int i = 0; i < k; ++i) {
         double dist = local_knns[0][i].distance;
@@ -93,6 +444,8 @@ int main(int argc, char *argv[]) {
             }
             lab = matrix_get_cell(local_data, local_idx, 6); // última columna = etiqueta
         }
+        if (local_idx >= 0 && local_idx < matrix_get_rows(local_data))
+            idx = matrix_get_row_id(local_data, local_idx);
         sendbuf[elems_per * i + 0] = dist;
         sendbuf[elems_per * i + 1] = (double) idx;
         for (int f = 0; f < 6; f++) {
@@ -102,22 +455,134 @@ int main(int argc, char *argv[]) {
     }
     
     double *recvbuf = NULL;
+    int records = hc ? k : k * tasks_num;
     if (rank == MPI_MASTER) {
-        recvbuf = (double*) malloc(sizeof(double) * k * elems_per * tasks_num);
+        recvbuf = (double*) malloc(sizeof(double) * elems_per * records);
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
-    gettimeofday(&t0, NULL);
+    double total_search_time = 0.0, latency = 0.0;
+    int on_time = 0, late = 0;
+    if (hc) {
+        /* top-k lists are merged inside each node first; only leaders cross the network */
+        int counts[2] = { scanned, local_rows }, total_counts[2] = { 0, 0 };
+        hier_barrier(hc);
+        gettimeofday(&t0, NULL);
+        hier_reduce_topk(hc, sendbuf, recvbuf, k, elems_per);
+        hier_reduce(hc, counts, total_counts, 2, MPI_INT, MPI_SUM);
+        hier_reduce(hc, &search_time, &total_search_time, 1, MPI_DOUBLE, MPI_SUM);
+        gettimeofday(&t1, NULL);
+        latency = MPI_Wtime() - query_start;
+        total_scanned = total_counts[0];
+        total_rows = total_counts[1];
+    } else if (deadline_ms >= 0.0) {
+        /* every worker sends (scanned, rows, search time) and its encoded list as soon as it
+         * stops; the master polls until the deadline and answers from what has arrived */
+        double header[3] = { scanned, local_rows, search_time };
+        gettimeofday(&t0, NULL);
+        if (rank != MPI_MASTER) {
+            size_t len = 0;
+            char *packed = codec_encode_records(sendbuf, k, elems_per, &len);
+            char *msg = packed ? (char*) malloc(sizeof(header) + len) : NULL;
+            if (!msg) {
+                fprintf(stderr, "ERROR: rank %d no pudo codificar sus candidatos\n", rank);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            memcpy(msg, header, sizeof(header));
+            memcpy(msg + sizeof(header), packed, len);
+            free(packed);
+            MPI_Request req;
+            MPI_Isend(msg, (int) (sizeof(header) + len), MPI_CHAR, MPI_MASTER, ANYTIME_TAG,
+                      MPI_COMM_WORLD, &req);
+            MPI_Wait(&req, MPI_STATUS_IGNORE);
+            free(msg);
+        } else {
+            double end = query_start + deadline_ms / 1000.0;
+            memcpy(recvbuf, sendbuf, sizeof(double) * k * elems_per);
+            total_scanned = scanned;
+            total_search_time = search_time;
+            on_time = 1;
+            for (int pending = tasks_num - 1; pending > 0; --pending) {
+                /* past the deadline the remaining replies are only drained, not used */
+                int flag = 0, in_time = 1;
+                MPI_Status st;
+                while (!flag && (in_time = MPI_Wtime() < end))
+                    MPI_Iprobe(MPI_ANY_SOURCE, ANYTIME_TAG, MPI_COMM_WORLD, &flag, &st);
+                if (!in_time) {
+                    late = pending;
+                    break;
+                }
+                int len = 0;
+                MPI_Get_count(&st, MPI_CHAR, &len);
+                char *msg = (char*) malloc(len > 0 ? len : 1);
+                MPI_Recv(msg, len, MPI_CHAR, st.MPI_SOURCE, ANYTIME_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                double h[3] = { 0.0, 0.0, 0.0 };
+                int bad = len < (int) sizeof(h);
+                if (!bad) {
+                    memcpy(h, msg, sizeof(h));
+                    bad = codec_decode_records(msg + sizeof(h), len - sizeof(h),
+                                               recvbuf + (size_t) on_time * k * elems_per, k, elems_per) != 0;
+                }
+                if (bad) {
+                    fprintf(stderr, "ERROR: candidatos del rank %d corruptos\n", st.MPI_SOURCE);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+                free(msg);
+                total_scanned += (int) h[0];
+                total_search_time += h[2];
+                on_time++;
+            }
+            latency = MPI_Wtime() - query_start;
+            records = on_time * k;
+        }
+        gettimeofday(&t1, NULL);
+    } else {
+        MPI_Reduce(&scanned, &total_scanned, 1, MPI_INT, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
+        MPI_Reduce(&local_rows, &total_rows, 1, MPI_INT, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
+        MPI_Reduce(&search_time, &total_search_time, 1, MPI_DOUBLE, MPI_SUM, MPI_MASTER, MPI_COMM_WORLD);
 
-    MPI_Gather(sendbuf, k*elems_per, MPI_DOUBLE, recvbuf, k*elems_per, MPI_DOUBLE, MPI_MASTER, MPI_COMM_WORLD);
+        MPI_Barrier(MPI_COMM_WORLD);
+        gettimeofday(&t0, NULL);
 
-    MPI_Barrier(MPI_COMM_WORLD);
-    gettimeofday(&t1, NULL);
+        /* candidate lists travel encoded (codec.h), with variable sizes */
+        size_t len = 0;
+        char *packed = codec_encode_records(sendbuf, k, elems_per, &len);
+        if (!packed) {
+            fprintf(stderr, "ERROR: rank %d no pudo codificar sus candidatos\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        int packed_len = (int) len;
+        int *lens = rank == MPI_MASTER ? (int*) malloc(sizeof(int) * tasks_num) : NULL;
+        int *displs = rank == MPI_MASTER ? (int*) malloc(sizeof(int) * tasks_num) : NULL;
+        MPI_Gather(&packed_len, 1, MPI_INT, lens, 1, MPI_INT, MPI_MASTER, MPI_COMM_WORLD);
+        char *gathered = NULL;
+        if (rank == MPI_MASTER) {
+            int total_len = 0;
+            for (int p = 0; p < tasks_num; ++p) { displs[p] = total_len; total_len += lens[p]; }
+            gathered = (char*) malloc(total_len > 0 ? total_len : 1);
+        }
+        MPI_Gatherv(packed, packed_len, MPI_CHAR, gathered, lens, displs, MPI_CHAR, MPI_MASTER, MPI_COMM_WORLD);
+        if (rank == MPI_MASTER) {
+            for (int p = 0; p < tasks_num; ++p) {
+                if (codec_decode_records(gathered + displs[p], lens[p],
+                                         recvbuf + (size_t) p * k * elems_per, k, elems_per) != 0) {
+                    fprintf(stderr, "ERROR: candidatos del rank %d corruptos\n", p);
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+            }
+        }
+        free(gathered);
+        free(lens);
+        free(displs);
+        free(packed);
+
+        MPI_Barrier(MPI_COMM_WORLD);
+        gettimeofday(&t1, NULL);
+    }
 
     if (rank == MPI_MASTER) {
         double elapsed_total = get_elapsed_time(t0, t1);
         printf("\nTiempo total de ejecución del KNN distribuido = %.6f segundos\n", elapsed_total);
-        int total = k * tasks_num;
+        int total = records;
         struct KNN_Pair *all = (struct KNN_Pair*) malloc(sizeof(struct KNN_Pair) * total);
         for (int i = 0; i < total; ++i) {
             all[i].distance = recvbuf[elems_per * i + 0];
@@ -127,7 +592,17 @@ int main(int argc, char *argv[]) {
 
         double elapsed = get_elapsed_time(t0, t1);
         printf("Distributed single-query knn usando %d procesos: tiempo gather + sort = %.6f secs\n", tasks_num, elapsed);
+        printf("Filas escaneadas: %d de %d, tiempo de búsqueda sumado = %.6f secs\n",
+               total_scanned, total_rows, total_search_time);
+        if (deadline_ms >= 0.0) {
+            printf("Plazo %.3f ms: latencia %.3f ms, respuesta %s, %d de %d procesos a tiempo, "
+                   "%.2f%% de los datos escaneados\n",
+                   deadline_ms, latency * 1000.0, total_scanned < total_rows ? "PARCIAL" : "exacta",
+                   on_time, tasks_num, total_rows ? 100.0 * total_scanned / total_rows : 0.0);
+        }
 
+        if (metric)
+            printf("Métrica: %s\n", metric_name(metric_kind));
         printf("\n=== Top %d vecinos para query (edad=%.1f, estatura=%.1f, peso=%.1f, glucosa=%.1f, fc=%.1f, oxigeno=%.1f) ===\n",
                k, edad, estatura, peso, glucosa, fc, oxigeno);
 
@@ -175,10 +650,37 @@ int main(int argc, char *argv[]) {
         free(all);
     }
 
+    /* replies that missed the deadline are received (and dropped) after the answer */
+    for (int i = 0; i < late; ++i) {
+        MPI_Status st;
+        int len = 0;
+        MPI_Probe(MPI_ANY_SOURCE, ANYTIME_TAG, MPI_COMM_WORLD, &st);
+        MPI_Get_count(&st, MPI_CHAR, &len);
+        char *msg = (char*) malloc(len > 0 ? len : 1);
+        MPI_Recv(msg, len, MPI_CHAR, st.MPI_SOURCE, ANYTIME_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        free(msg);
+    }
+
+    if (hc) {
+        long traffic[6] = { hc->node_messages, hc->node_bytes, hc->inter_messages, hc->inter_bytes,
+                            hc->flat_messages, hc->flat_bytes };
+        long totals[6] = { 0, 0, 0, 0, 0, 0 };
+        hier_reduce(hc, traffic, totals, 6, MPI_LONG, MPI_SUM);
+        if (rank == MPI_MASTER) {
+            printf("Tráfico de las colectivas (%d nodos): dentro de los nodos %ld mensajes, %ld bytes; "
+                   "entre nodos %ld mensajes, %ld bytes; con colectivas planas (estimado): %ld mensajes, %ld bytes\n",
+                   hc->nodes, totals[0], totals[1], totals[2], totals[3], totals[4], totals[5]);
+        }
+        hier_comm_destroy(hc);
+    }
+
     /* cleanup */
     if (recvbuf) free(recvbuf);
     free(sendbuf);
     KNN_Pair_destroy_table(local_knns, 1);
+    partition_destroy(bounds);
+    metric_destroy(metric);
+    matrix_destroy(features);
     matrix_destroy(local_data);
     matrix_destroy(query);
 